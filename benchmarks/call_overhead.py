@@ -0,0 +1,65 @@
+# Copyright 2020 Patrick Worthey
+#
+# Source: https://github.com/ptrick/synther
+# Docs: https://synther.github.io/
+# LICENSE: MIT
+# See LICENSE and README.md files for more information.
+
+# Times the per-call overhead of the native bindings: calls to _synther that do next to no work,
+# so what's left is argument passing, parsing and the trip into the engine. Each result is the
+# best of several runs, in nanoseconds per call.
+#
+# Usage: python benchmarks/call_overhead.py [--calls 200000] [--out results.json]
+
+import argparse
+import json
+import platform
+import timeit
+
+import _synther as syn
+import synther
+
+def cases():
+  buf = syn.gen_buffer()
+  empty = syn.gen_buffer()
+  syn.produce_wave(buf, 0, 1, 1, 1, 440.0, 1000.0, 0)
+  data = b'\0' * 16
+  return [
+    # A note that renders no samples, as in scores full of tiny notes
+    ('produce_wave', lambda: syn.produce_wave(buf, 0, 0, 0, 0, 440.0, 1000.0, 0)),
+    ('produce_wave_keywords', lambda: syn.produce_wave(buffer=buf, attack_start_ms=0, attack_ms=0, sustain_ms=0, decay_ms=0, freq_hz=440.0, amp=1000.0, wave_type=0)),
+    ('sample_buffer', lambda: syn.sample_buffer(buf, empty, 0, 0, 0)),
+    ('get_buffer_capacity', lambda: syn.get_buffer_capacity(buf)),
+    ('hash_bytes', lambda: syn.hash_bytes(data, 1)),
+    ('gen_free_buffer', lambda: syn.free_buffer(syn.gen_buffer())),
+  ]
+
+def main():
+  parser = argparse.ArgumentParser(description='Times the per-call overhead of the native bindings.')
+  parser.add_argument('--calls', type=int, default=200000, help='Calls per timed run.')
+  parser.add_argument('--out', help='Where to write the JSON results. Printed if not given.')
+  args = parser.parse_args()
+
+  results = []
+  for name, call in cases():
+    try:
+      call()
+    except TypeError:
+      continue # Keywords aren't taken by older builds
+    best = min(timeit.repeat(call, number=args.calls, repeat=5))
+    results.append({'name': name, 'ns_per_call': best / args.calls * 1e9})
+
+  report = {
+    'python': platform.python_version(),
+    'synther': synther.__version__,
+    'machine': platform.machine(),
+    'results': results
+  }
+  if args.out != None:
+    with open(args.out, 'w') as fp:
+      json.dump(report, fp, indent=2)
+  else:
+    print(json.dumps(report, indent=2))
+
+if __name__ == '__main__':
+  main()
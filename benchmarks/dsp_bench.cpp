@@ -0,0 +1,259 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension
+* Copyright 2020 Patrick Worthey
+* Source: https://github.com/ptrick/synther
+* LICENSE: MIT
+* See LICENSE and README.md files for more information.
+* *******************************************************
+*/
+
+// Microbenchmarks for the signal processing kernels and the .wav reader and writer, without Python
+// in the way. Every benchmark reports its best time, samples/sec and MB/s as one JSON line. Given a
+// baseline (a previous run's output), each result is also compared against it.
+//
+// Build: make -C benchmarks dsp_bench
+// Usage: benchmarks/dsp_bench [--baseline benchmarks/dsp_baseline.json] [--filter substring] [--min-time seconds]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Synth.h"
+#include "WavIO.h"
+
+namespace {
+  struct Result {
+    std::string name;
+    double seconds;
+    double samples_per_sec;
+    double mb_per_sec;
+  };
+
+  double min_time = 0.25;
+  std::string filter;
+
+  // Runs a benchmark repeatedly for at least min_time (and at least 3 times), keeping the best time.
+  // setup runs before every timed run, untimed. run returns the samples and bytes it processed.
+  bool measure(const std::string& name, const std::function<void ()>& setup, const std::function<void (uint64_t&, uint64_t&)>& run, Result& out) {
+    if (!filter.empty() && name.find(filter) == std::string::npos) {
+      return false;
+    }
+    double best = 1e300;
+    double total = 0.0;
+    uint64_t samples = 0;
+    uint64_t bytes = 0;
+    for (int reps = 0; reps < 3 || total < min_time; ++reps) {
+      setup();
+      samples = 0;
+      bytes = 0;
+      auto start = std::chrono::steady_clock::now();
+      run(samples, bytes);
+      double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      best = std::min(best, elapsed);
+      total += elapsed;
+    }
+    best = std::max(best, 1e-9);
+    out = Result{name, best, samples / best, bytes / best / 1e6};
+    return true;
+  }
+
+  std::string seconds_label(double seconds) {
+    std::ostringstream label;
+    label << seconds << "s";
+    return label.str();
+  }
+
+  template <typename Word>
+  void put_word(std::ofstream& f, Word value, unsigned size) {
+    for (; size; --size, value >>= 8) {
+      f.put(static_cast<char>(value & 0xFF));
+    }
+  }
+
+  // Writes a .wav file in formats write_wav() doesn't produce, to exercise the reader's resampling
+  void write_test_wav(const std::string& filename, uint32_t sample_rate, uint16_t channels, uint16_t bits, double seconds) {
+    uint16_t block = static_cast<uint16_t>(channels * bits / 8);
+    uint32_t frames = static_cast<uint32_t>(seconds * sample_rate);
+    uint32_t data_size = frames * block;
+    std::ofstream f(filename, std::ios::binary);
+    f << "RIFF";
+    put_word(f, 36 + data_size, 4);
+    f << "WAVEfmt ";
+    put_word(f, 16, 4);
+    put_word(f, 1, 2);
+    put_word(f, channels, 2);
+    put_word(f, sample_rate, 4);
+    put_word(f, sample_rate * block, 4);
+    put_word(f, block, 2);
+    put_word(f, bits, 2);
+    f << "data";
+    put_word(f, data_size, 4);
+    uint64_t state = 88172645463325252ULL;
+    for (uint32_t n = 0; n < data_size; ++n) {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      f.put(static_cast<char>(state & 0xFF));
+    }
+  }
+
+  long file_size(const std::string& filename) {
+    std::ifstream f(filename, std::ios::binary | std::ios::ate);
+    return static_cast<long>(f.tellg());
+  }
+
+  // Reads the name and samples_per_sec of every result line of an earlier run
+  std::map<std::string, double> load_baseline(const std::string& filename) {
+    std::map<std::string, double> baseline;
+    std::ifstream f(filename);
+    std::string line;
+    while (std::getline(f, line)) {
+      size_t name_at = line.find("\"name\": \"");
+      size_t rate_at = line.find("\"samples_per_sec\": ");
+      if (name_at == std::string::npos || rate_at == std::string::npos) {
+        continue;
+      }
+      name_at += std::strlen("\"name\": \"");
+      std::string name = line.substr(name_at, line.find('"', name_at) - name_at);
+      baseline[name] = std::atof(line.c_str() + rate_at + std::strlen("\"samples_per_sec\": "));
+    }
+    return baseline;
+  }
+}
+
+int main(int argc, char **argv) {
+  std::string baseline_file;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--baseline") {
+      baseline_file = argv[i + 1];
+    }
+    else if (arg == "--filter") {
+      filter = argv[i + 1];
+    }
+    else if (arg == "--min-time") {
+      min_time = std::atof(argv[i + 1]);
+    }
+    else {
+      std::fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  const double sizes[] = {0.1, 1.0, 10.0};
+  const char *wave_names[] = {"sine", "saw", "square", "triangle", "noise"};
+  std::vector<Result> results;
+  Result result;
+
+  for (double seconds : sizes) {
+    Synth::bigint_t ms = static_cast<Synth::bigint_t>(seconds * 1000);
+
+    for (int wave_type = 0; wave_type < 5; ++wave_type) {
+      Synth::WaveOp op = Synth::make_wave_op(0, 10, ms - 20, 10, 440.0, 8000.0, wave_type);
+      std::vector<uint16_t> b(op.end_index, 0);
+      auto setup = [] {};
+      auto run = [&](uint64_t& samples, uint64_t& bytes) {
+        Synth::WaveState state;
+        Synth::render_wave(b, op, state, 0, op.end_index);
+        samples = op.end_index - op.start_index;
+        bytes = samples * sizeof(uint16_t);
+      };
+      if (measure(std::string("produce_wave/") + wave_names[wave_type] + "/" + seconds_label(seconds), setup, run, result)) {
+        results.push_back(result);
+      }
+    }
+
+    {
+      std::vector<uint16_t> source(Synth::ms_to_buffer_index(ms), 1);
+      std::vector<uint16_t> target(source.size(), 0);
+      Synth::MixOp op = Synth::resolve_mix(target.size(), source.size(), 0, 0, 0);
+      auto setup = [] {};
+      auto run = [&](uint64_t& samples, uint64_t& bytes) {
+        Synth::apply_mix(target, source, op, 0, op.target_size);
+        samples = op.frames * 2;
+        // Both buffers are read, the target is written
+        bytes = samples * sizeof(uint16_t) * 3;
+      };
+      if (measure("sample_buffer/" + seconds_label(seconds), setup, run, result)) {
+        results.push_back(result);
+      }
+    }
+
+    const std::string written = "dsp_bench_write.wav";
+    {
+      std::vector<uint16_t> b(Synth::ms_to_buffer_index(ms), 0x1234);
+      auto setup = [] {};
+      auto run = [&](uint64_t& samples, uint64_t& bytes) {
+        WavIO::write_wav(written.c_str(), b);
+        samples = b.size();
+        bytes = samples * sizeof(uint16_t);
+      };
+      if (measure("write_wav/" + seconds_label(seconds), setup, run, result)) {
+        results.push_back(result);
+      }
+    }
+
+    // Native 44.1 kHz stereo input, as written by write_wav(), and inputs that have to be resampled
+    struct Input {
+      const char *label;
+      uint32_t rate;
+      uint16_t channels;
+      uint16_t bits;
+    };
+    const Input inputs[] = {
+      {"44100hz_16bit_stereo", 44100, 2, 16},
+      {"22050hz_16bit_mono", 22050, 1, 16},
+      {"48000hz_24bit_stereo", 48000, 2, 24}
+    };
+    for (const Input& input : inputs) {
+      const std::string name = std::string("sample_wav/") + input.label + "/" + seconds_label(seconds);
+      if (!filter.empty() && name.find(filter) == std::string::npos) {
+        continue;
+      }
+      const std::string filename = std::string("dsp_bench_") + input.label + ".wav";
+      write_test_wav(filename, input.rate, input.channels, input.bits, seconds);
+      std::vector<uint16_t> b;
+      auto setup = [&] { b.assign(Synth::ms_to_buffer_index(ms), 0); };
+      auto run = [&](uint64_t& samples, uint64_t& bytes) {
+        WavIO::sample_wav(filename.c_str(), b, 0, 0, 0);
+        samples = b.size();
+        bytes = static_cast<uint64_t>(file_size(filename));
+      };
+      if (measure(name, setup, run, result)) {
+        results.push_back(result);
+      }
+      std::remove(filename.c_str());
+    }
+    std::remove(written.c_str());
+  }
+
+  std::map<std::string, double> baseline;
+  if (!baseline_file.empty()) {
+    baseline = load_baseline(baseline_file);
+  }
+
+  std::printf("{\"benchmarks\": [\n");
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& r = results[i];
+    std::printf("  {\"name\": \"%s\", \"seconds\": %.9f, \"samples_per_sec\": %.0f, \"mb_per_sec\": %.2f}%s\n",
+      r.name.c_str(), r.seconds, r.samples_per_sec, r.mb_per_sec, i + 1 < results.size() ? "," : "");
+  }
+  std::printf("]}\n");
+
+  for (const Result& r : results) {
+    auto base = baseline.find(r.name);
+    if (base != baseline.end() && base->second > 0) {
+      std::fprintf(stderr, "%-40s %14.0f samples/s  %+7.1f%% vs baseline\n", r.name.c_str(), r.samples_per_sec, (r.samples_per_sec / base->second - 1.0) * 100.0);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,186 @@
+# Copyright 2020 Patrick Worthey
+#
+# Source: https://github.com/ptrick/synther
+# Docs: https://synther.github.io/
+# LICENSE: MIT
+# See LICENSE and README.md files for more information.
+
+# Times SyntherProject.build() end to end on reproducible synthetic songs: many stems of notes,
+# .wav clips sampled throughout, and busses mixed down through a deep chain of sample_buffer()
+# stages. For every song size, a cold build, a no-op build, and a rebuild after editing a single
+# note are timed, along with the peak memory of the process and what the native engine reports
+# through synther.stats().
+#
+# Each song size runs in a process of its own, so peak memory is measured per size.
+#
+# Usage: python benchmarks/project_bench.py [--notes 1000,10000,100000] [--out results.json]
+
+import argparse
+import json
+import os
+import platform
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+try:
+  import resource
+except ImportError:
+  resource = None # Not on Windows, where peak memory isn't reported
+
+import synther
+
+_notes_per_stem = 250
+_busses = 4
+_chain_depth = 8
+_clip_count = 4
+_scale_hz = [220.0, 246.94, 261.63, 293.66, 329.63, 349.23, 392.0, 440.0]
+_nested_calls = ('read_wav', 'write_wav') # Timed within the calls that make them
+
+def make_clips():
+  # One-shot samples for the songs to trigger, written with the low-level API
+  clips = []
+  for n in range(_clip_count):
+    buffer = synther.gen_buffer()
+    synther.produce_wave(buffer, 0, 2, 60 + 20 * n, 40, 80 * (n + 1), 9000, synther.WaveType(n % 5))
+    filename = 'clip%d.wav' % (n)
+    synther.dump_buffer(buffer, filename)
+    synther.free_buffer(buffer)
+    clips.append(filename)
+  return clips
+
+def make_song(notes, clips, seed=1, edit=False):
+  rng = random.Random(seed)
+  proj = synther.gen_project()
+  stem_count = max(1, notes // _notes_per_stem)
+  stems = []
+  for stem in range(stem_count):
+    buffer = proj.queue_gen_buffer()
+    start_ms = rng.randrange(0, 500)
+    for note in range(notes // stem_count):
+      start_ms += rng.choice((125, 250, 250, 500))
+      if note % 8 == 7:
+        proj.queue_sample_file(buffer, rng.choice(clips), start_ms, 0, 0)
+        continue
+      freq_hz = rng.choice(_scale_hz) * rng.choice((0.5, 1.0, 2.0))
+      if edit and stem == 0 and note == 0:
+        freq_hz += 1.0
+      wave_type = synther.WaveType(rng.randrange(0, 5))
+      proj.queue_produce_wave(buffer, start_ms, 10, rng.randrange(50, 300), 30, freq_hz, 2000, wave_type)
+    stems.append(buffer)
+
+  # Stems are mixed into busses, the busses into a master that runs through a chain of stages
+  busses = []
+  for bus in range(_busses):
+    buffer = proj.queue_gen_buffer()
+    for stem in stems[bus::_busses]:
+      proj.queue_sample_buffer(buffer, stem, 0, 0, 0)
+    proj.queue_dump_buffer(buffer, 'bus%d.wav' % (bus))
+    busses.append(buffer)
+  master = proj.queue_gen_buffer()
+  for bus in busses:
+    proj.queue_sample_buffer(master, bus, 0, 0, 0)
+  for stage in range(_chain_depth):
+    buffer = proj.queue_gen_buffer()
+    proj.queue_sample_buffer(buffer, master, 0, 0, 0)
+    proj.queue_sample_buffer(buffer, master, 20 * (stage + 1), 0, 0)
+    master = buffer
+  proj.queue_dump_buffer(master, 'master.wav')
+  return proj
+
+def peak_rss_mib():
+  if resource == None:
+    return None
+  peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+  # Kilobytes on Linux, bytes on macOS
+  return peak / (1 << 20) if sys.platform == 'darwin' else peak / (1 << 10)
+
+def timed_build(proj):
+  synther.reset_stats()
+  start = time.perf_counter()
+  proj.build()
+  elapsed = time.perf_counter() - start
+  stats = synther.stats()
+  return elapsed, {
+    'native_s': sum(ns for name, ns in stats['call_time_ns'].items() if not name in _nested_calls) / 1e9,
+    'samples': sum(stats['wave_samples'].values()),
+    'mix_bytes': stats['mix_bytes'],
+    'wav_bytes_read': stats['wav_bytes_read'],
+    'wav_bytes_written': stats['wav_bytes_written'],
+    'cache_hits': stats['cache_hits'],
+    'cache_misses': stats['cache_misses']
+  }
+
+def run_song(notes):
+  with tempfile.TemporaryDirectory() as work_dir:
+    os.chdir(work_dir)
+    clips = make_clips()
+
+    start = time.perf_counter()
+    proj = make_song(notes, clips)
+    queue_s = time.perf_counter() - start
+    proj.clean()
+
+    cold_s, cold = timed_build(proj)
+    cold_rss = peak_rss_mib()
+    # A fresh project object with the same commands, as when a script is run again
+    noop_s, noop = timed_build(make_song(notes, clips))
+    edit_s, edit = timed_build(make_song(notes, clips, edit=True))
+    proj.clean()
+    os.chdir(os.path.dirname(work_dir))
+
+  return {
+    'notes': notes,
+    'queue_s': queue_s,
+    'cold_build_s': cold_s,
+    'noop_build_s': noop_s,
+    'edit_build_s': edit_s,
+    'cold_peak_rss_mib': cold_rss,
+    'peak_rss_mib': peak_rss_mib(),
+    'native': {'cold': cold, 'noop': noop, 'edit': edit}
+  }
+
+def main():
+  parser = argparse.ArgumentParser(description='Times SyntherProject builds on synthetic songs.')
+  parser.add_argument('--notes', default='1000,10000,100000', help='Comma separated song sizes, in notes.')
+  parser.add_argument('--out', help='Where to write the JSON results. Printed if not given.')
+  parser.add_argument('--song', type=int, help=argparse.SUPPRESS) # Runs a single size, in this process
+  args = parser.parse_args()
+  synther.set_log_level(synther.LogLvl.ERROR)
+
+  if args.song != None:
+    result = run_song(args.song)
+    with open(args.out, 'w') as fp:
+      json.dump(result, fp)
+    return
+
+  results = []
+  for notes in [int(n) for n in args.notes.split(',')]:
+    with tempfile.NamedTemporaryFile(suffix='.json', delete=False) as fp:
+      result_file = fp.name
+    try:
+      subprocess.run([sys.executable, os.path.abspath(__file__), '--song', str(notes), '--out', result_file], check=True)
+      with open(result_file) as fp:
+        result = json.load(fp)
+    finally:
+      os.remove(result_file)
+    print('%7d notes: cold %8.3f s, no-op %7.3f s, edit %8.3f s, peak RSS %7.1f MiB' % (
+      notes, result['cold_build_s'], result['noop_build_s'], result['edit_build_s'], result['peak_rss_mib'] or 0), file=sys.stderr)
+    results.append(result)
+
+  report = {
+    'python': platform.python_version(),
+    'synther': synther.__version__,
+    'machine': platform.machine(),
+    'results': results
+  }
+  if args.out != None:
+    with open(args.out, 'w') as fp:
+      json.dump(report, fp, indent=2)
+  else:
+    print(json.dumps(report, indent=2))
+
+if __name__ == '__main__':
+  main()
@@ -0,0 +1,61 @@
+# Copyright 2020 Patrick Worthey
+# 
+# Source: https://github.com/ptrick/synther
+# Docs: https://synther.github.io/
+# LICENSE: MIT
+# See LICENSE and README.md files for more information.
+
+# Compares the tiled graph executor against the default one-command-at-a-time
+# build on a long mix that runs through many stages.
+#
+# Usage: python benchmarks/tiled_render.py [minutes] [stages] [tile_frames]
+
+import os
+import sys
+import tempfile
+import time
+
+import synther
+
+def make_project(minutes, stages):
+  proj = synther.gen_project()
+  proj.set_buffer_cache_limit(0)
+  length_ms = minutes * 60 * 1000
+  source = proj.queue_gen_buffer()
+  for start_ms in range(0, length_ms, 250):
+    proj.queue_produce_wave(source, start_ms, 10, 200, 40, 110 + start_ms % 880, 3000, synther.WaveType.SAW)
+  for _ in range(stages):
+    stage = proj.queue_gen_buffer()
+    proj.queue_sample_buffer(stage, source, 0, 0, 0)
+    source = stage
+  proj.queue_dump_buffer(source, 'tiled_render.wav')
+  return proj
+
+def time_build(proj, **build_args):
+  best = None
+  for _ in range(3):
+    start = time.perf_counter()
+    proj.rebuild(**build_args)
+    elapsed = time.perf_counter() - start
+    best = elapsed if best == None else min(best, elapsed)
+  return best
+
+def main():
+  minutes = int(sys.argv[1]) if len(sys.argv) > 1 else 10
+  stages = int(sys.argv[2]) if len(sys.argv) > 2 else 30
+  tile_frames = int(sys.argv[3]) if len(sys.argv) > 3 else 4096
+  synther.set_log_level(synther.LogLvl.WARNING)
+
+  with tempfile.TemporaryDirectory() as work_dir:
+    os.chdir(work_dir)
+    proj = make_project(minutes, stages)
+    op_by_op = time_build(proj)
+    tiled = time_build(proj, tiled=True, tile_frames=tile_frames)
+    proj.clean()
+
+  print('%d minute mix, %d stages' % (minutes, stages))
+  print('  op-by-op: %8.3f s' % (op_by_op))
+  print('  tiled:    %8.3f s (%d frames per tile, %.2fx)' % (tiled, tile_frames, op_by_op / tiled))
+
+if __name__ == '__main__':
+  main()
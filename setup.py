@@ -1,10 +1,30 @@
 import os
 from setuptools import setup, Extension, find_packages
+from setuptools.command.build_ext import build_ext
 
-module = Extension('_synther', sources=['src/lib.cpp', 'src/WavIO.cpp'])
+# Render streams run on a native thread
+thread_args = [] if os.name == 'nt' else ['-pthread']
+
+# The engine, usable from C++ on its own (see src/Engine.h). The Python module is a binding over it.
+core = ('synther_core', {
+  'sources': ['src/Engine.cpp', 'src/CommandLog.cpp', 'src/FM.cpp', 'src/NoteCache.cpp', 'src/Synth.cpp', 'src/Sequencer.cpp', 'src/Wavetable.cpp', 'src/WavIO.cpp', 'src/Trace.cpp', 'src/Stats.cpp'],
+  'cflags': thread_args})
+
+# Builds the engine before the module links against it, also when build_ext is run on its own
+class build_ext_with_core(build_ext):
+  def run(self):
+    self.run_command('build_clib')
+    build_ext.run(self)
+
+module = Extension('_synther', 
+  sources=['src/lib.cpp'], 
+  extra_compile_args=thread_args, 
+  extra_link_args=thread_args)
 
 setup(
   name='synther', 
+  libraries=[core], 
+  cmdclass={'build_ext': build_ext_with_core}, 
   ext_modules = [module], 
   py_modules=['synther'], 
   package_dir={'':'src'},)
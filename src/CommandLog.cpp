@@ -0,0 +1,277 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension
+* Copyright 2020 Patrick Worthey
+* Source: https://github.com/ptrick/synther
+* LICENSE: MIT
+* See LICENSE and README.md files for more information.
+* *******************************************************
+*/
+
+#include "CommandLog.h"
+
+#include <cmath>
+#include <cstring>
+
+namespace Synth {
+  namespace {
+    const uint8_t file_inputs_bit = 0x80;
+
+    // Fingerprint content is hashed as 64 bit words
+    uint64_t word(bigint_t value) {
+      return static_cast<uint64_t>(value);
+    }
+
+    uint64_t word(double value) {
+      uint64_t bits;
+      std::memcpy(&bits, &value, sizeof(bits));
+      return bits;
+    }
+
+    template <typename T>
+    size_t table_bytes(const std::vector<T>& table) {
+      return table.capacity() * sizeof(T);
+    }
+  }
+
+  CommandLog::CommandLog(uint64_t seed) : seed(seed) {}
+
+  CommandId CommandLog::push(CommandKind kind, BufferId buffer, uint32_t row, CommandId source_dependency, const uint64_t *content, size_t words) {
+    CommandId id = static_cast<CommandId>(kinds.size());
+    auto last = latest.find(buffer);
+    CommandId dependency = last == latest.end() ? no_command : last->second;
+
+    bool file_inputs = kind == CommandKind::SampleFile;
+    uint64_t fingerprint;
+    if (kind == CommandKind::DumpBuffer && dependency != no_command) {
+      // Dumping leaves the buffer untouched
+      fingerprint = fingerprints[dependency];
+      file_inputs = (kinds[dependency] & file_inputs_bit) != 0;
+    }
+    else {
+      // The kind, the arguments but for buffer handles (which only name a buffer), and the fingerprints of the dependencies
+      uint64_t key[12];
+      size_t n = 0;
+      key[n++] = static_cast<uint64_t>(kind);
+      for (size_t i = 0; i < words; ++i) {
+        key[n++] = content[i];
+      }
+      for (CommandId d : {dependency, source_dependency}) {
+        if (d != no_command) {
+          key[n++] = fingerprints[d];
+          file_inputs = file_inputs || (kinds[d] & file_inputs_bit) != 0;
+        }
+      }
+      fingerprint = hash64(key, n * sizeof(uint64_t), seed);
+    }
+
+    kinds.push_back(static_cast<uint8_t>(kind) | (file_inputs ? file_inputs_bit : 0));
+    rows.push_back(row);
+    buffers.push_back(buffer);
+    dependencies.push_back(dependency);
+    fingerprints.push_back(fingerprint);
+    latest[buffer] = id;
+    return id;
+  }
+
+  uint32_t CommandLog::intern(const char *filename, uint64_t& hash) {
+    size_t len = std::strlen(filename);
+    hash = hash64(filename, len, seed);
+    auto range = name_index.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (std::strcmp(arena.c_str() + name_offsets[it->second], filename) == 0) {
+        return it->second;
+      }
+    }
+    uint32_t name = static_cast<uint32_t>(name_offsets.size());
+    name_offsets.push_back(static_cast<uint32_t>(arena.size()));
+    arena.append(filename, len + 1);
+    name_index.emplace(hash, name);
+    return name;
+  }
+
+  BufferId CommandLog::gen_buffer() {
+    std::lock_guard<std::mutex> guard(lock);
+    BufferId buffer = ++last_buffer;
+    push(CommandKind::GenBuffer, buffer, 0, no_command, NULL, 0);
+    return buffer;
+  }
+
+  void CommandLog::produce_wave(BufferId buffer, bigint_t attack_start_ms, bigint_t attack_ms, bigint_t sustain_ms, bigint_t decay_ms, double freq_hz, double amp, int wave_type,
+                                uint64_t table_fingerprint) {
+    std::lock_guard<std::mutex> guard(lock);
+    uint32_t row = static_cast<uint32_t>(waves.size());
+    waves.push_back(WaveArgs{attack_start_ms, attack_ms, sustain_ms, decay_ms, freq_hz, amp, wave_type});
+    uint64_t content[] = {word(attack_start_ms), word(attack_ms), word(sustain_ms), word(decay_ms), word(freq_hz), word(amp), word(static_cast<bigint_t>(wave_type)), table_fingerprint};
+    push(CommandKind::ProduceWave, buffer, row, no_command, content, content[7] == 0 ? 7 : 8);
+  }
+
+  void CommandLog::sample_file(BufferId buffer, const char *filename, bigint_t buffer_start_ms, bigint_t sample_start_ms, bigint_t duration_ms) {
+    std::lock_guard<std::mutex> guard(lock);
+    uint64_t name_hash;
+    uint32_t name = intern(filename, name_hash);
+    uint32_t row = static_cast<uint32_t>(files.size());
+    files.push_back(FileArgs{buffer_start_ms, sample_start_ms, duration_ms, name});
+    uint64_t content[] = {name_hash, word(buffer_start_ms), word(sample_start_ms), word(duration_ms)};
+    push(CommandKind::SampleFile, buffer, row, no_command, content, 4);
+  }
+
+  void CommandLog::sample_buffer(BufferId target, BufferId source, bigint_t first_start_ms, bigint_t second_start_ms, bigint_t duration_ms) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto last = latest.find(source);
+    CommandId source_dependency = last == latest.end() ? no_command : last->second;
+    uint32_t row = static_cast<uint32_t>(mixes.size());
+    mixes.push_back(MixArgs{source, {first_start_ms, second_start_ms}, duration_ms, source_dependency});
+    uint64_t content[] = {word(first_start_ms), word(second_start_ms), word(duration_ms)};
+    push(CommandKind::SampleBuffer, target, row, source_dependency, content, 3);
+  }
+
+  void CommandLog::dump_buffer(BufferId buffer, const char *filename) {
+    std::lock_guard<std::mutex> guard(lock);
+    uint64_t name_hash;
+    uint32_t name = intern(filename, name_hash);
+    uint32_t row = static_cast<uint32_t>(dumps.size());
+    dumps.push_back(name);
+    push(CommandKind::DumpBuffer, buffer, row, no_command, &name_hash, 1);
+  }
+
+  void CommandLog::render_sequence(BufferId buffer, std::shared_ptr<const Score> score, bigint_t start_ms) {
+    std::lock_guard<std::mutex> guard(lock);
+    uint32_t row = static_cast<uint32_t>(sequences.size());
+    // The score is hashed in by its own fingerprint
+    uint64_t content[] = {word(start_ms), score->fingerprint()};
+    sequences.push_back(SequenceArgs{std::move(score), start_ms});
+    push(CommandKind::RenderSequence, buffer, row, no_command, content, 2);
+  }
+
+  size_t CommandLog::size() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return kinds.size();
+  }
+
+  bool CommandLog::command(CommandId id, Command& out) const {
+    std::lock_guard<std::mutex> guard(lock);
+    if (id >= kinds.size()) {
+      return false;
+    }
+    out.kind = static_cast<CommandKind>(kinds[id] & ~file_inputs_bit);
+    out.file_inputs = (kinds[id] & file_inputs_bit) != 0;
+    out.buffer = buffers[id];
+    out.dependency = dependencies[id];
+    out.source_dependency = no_command;
+    out.fingerprint = fingerprints[id];
+    out.filename.clear();
+    out.sequence = SequenceArgs();
+    uint32_t row = rows[id];
+    switch (out.kind) {
+      case CommandKind::ProduceWave:
+        out.wave = waves[row];
+        break;
+      case CommandKind::SampleFile:
+        out.file = files[row];
+        out.filename = arena.c_str() + name_offsets[out.file.filename];
+        break;
+      case CommandKind::SampleBuffer:
+        out.mix = mixes[row];
+        out.source_dependency = out.mix.source_dependency;
+        break;
+      case CommandKind::DumpBuffer:
+        out.filename = arena.c_str() + name_offsets[dumps[row]];
+        break;
+      case CommandKind::RenderSequence:
+        out.sequence = sequences[row];
+        break;
+      case CommandKind::GenBuffer:
+        break;
+    }
+    return true;
+  }
+
+  std::vector<CommandId> CommandLog::find(CommandKind kind) const {
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<CommandId> ids;
+    for (size_t id = 0; id < kinds.size(); ++id) {
+      if ((kinds[id] & ~file_inputs_bit) == static_cast<uint8_t>(kind)) {
+        ids.push_back(static_cast<CommandId>(id));
+      }
+    }
+    return ids;
+  }
+
+  std::vector<CommandId> CommandLog::latest_commands() const {
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<CommandId> ids;
+    ids.reserve(latest.size());
+    for (auto& last : latest) {
+      ids.push_back(last.second);
+    }
+    return ids;
+  }
+
+  std::vector<CommandId> CommandLog::mix_sources() const {
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<CommandId> ids;
+    for (const MixArgs& mix : mixes) {
+      if (mix.source_dependency != no_command) {
+        ids.push_back(mix.source_dependency);
+      }
+    }
+    return ids;
+  }
+
+  std::vector<std::string> CommandLog::filenames() const {
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<std::string> names;
+    names.reserve(name_offsets.size());
+    for (uint32_t offset : name_offsets) {
+      names.push_back(arena.c_str() + offset);
+    }
+    return names;
+  }
+
+  std::vector<std::pair<CommandId, uint64_t>> CommandLog::resolve_file_inputs(const std::vector<double>& mtimes) const {
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<std::pair<CommandId, uint64_t>> resolved;
+    std::vector<uint64_t> keys(fingerprints);
+    // Only commands downstream of a sample_file are revisited, once each, in order
+    for (size_t id = 0; id < kinds.size(); ++id) {
+      if (!(kinds[id] & file_inputs_bit)) {
+        continue;
+      }
+      CommandKind kind = static_cast<CommandKind>(kinds[id] & ~file_inputs_bit);
+      CommandId dependency = dependencies[id];
+      if (kind == CommandKind::DumpBuffer) {
+        keys[id] = keys[dependency];
+      }
+      else {
+        uint64_t stamp[3];
+        size_t n = 0;
+        CommandId source_dependency = kind == CommandKind::SampleBuffer ? mixes[rows[id]].source_dependency : no_command;
+        for (CommandId d : {dependency, source_dependency}) {
+          if (d != no_command) {
+            stamp[n++] = keys[d];
+          }
+        }
+        if (kind == CommandKind::SampleFile) {
+          uint32_t name = files[rows[id]].filename;
+          if (name < mtimes.size() && !std::isnan(mtimes[name])) {
+            stamp[n++] = word(mtimes[name]);
+          }
+        }
+        keys[id] = hash64(stamp, n * sizeof(uint64_t), fingerprints[id]);
+      }
+      resolved.emplace_back(static_cast<CommandId>(id), keys[id]);
+    }
+    return resolved;
+  }
+
+  size_t CommandLog::memory_bytes() const {
+    std::lock_guard<std::mutex> guard(lock);
+    // Hash tables are counted at roughly a node and a bucket per entry
+    size_t node_bytes = sizeof(void*) * 3 + sizeof(uint64_t) * 2;
+    return table_bytes(kinds) + table_bytes(rows) + table_bytes(buffers) + table_bytes(dependencies) + table_bytes(fingerprints) +
+      table_bytes(waves) + table_bytes(files) + table_bytes(mixes) + table_bytes(dumps) + table_bytes(sequences) +
+      arena.capacity() + table_bytes(name_offsets) +
+      (name_index.size() + latest.size()) * node_bytes;
+  }
+}
@@ -0,0 +1,161 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension
+* Copyright 2020 Patrick Worthey
+* Source: https://github.com/ptrick/synther
+* LICENSE: MIT
+* See LICENSE and README.md files for more information.
+* *******************************************************
+*/
+
+#ifndef SYNTHER_COMMAND_LOG_H
+#define SYNTHER_COMMAND_LOG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Engine.h"
+#include "Sequencer.h"
+
+// The commands queued on a project, recorded for the build system to render later. Commands are
+// stored in columns rather than as objects: a few fixed size fields per command, the arguments in a
+// typed table per kind of command, and file names once each in an arena. A note costs under a
+// hundred bytes.
+//
+// Every command is numbered in the order it was queued, and depends on the previous command on its
+// buffer (and for mixes, on the last command on the source). Its fingerprint hashes its arguments
+// and the fingerprints of its dependencies, so it names the buffer state the command leaves behind.
+namespace Synth {
+  typedef uint32_t CommandId;
+  constexpr CommandId no_command = UINT32_MAX;
+
+  // Matches _CmdType in synther.py
+  enum class CommandKind : uint8_t {
+    DumpBuffer     = 0,
+    SampleFile     = 1,
+    GenBuffer      = 2,
+    ProduceWave    = 3,
+    SampleBuffer   = 4,
+    RenderSequence = 6  // 5 is the build system's own load of a cached buffer state
+  };
+
+  struct WaveArgs {
+    bigint_t attack_start_ms;
+    bigint_t attack_ms;
+    bigint_t sustain_ms;
+    bigint_t decay_ms;
+    double freq_hz;
+    double amp;
+    int32_t wave_type;
+  };
+
+  struct FileArgs {
+    bigint_t buffer_start_ms;
+    bigint_t sample_start_ms;
+    bigint_t duration_ms;
+    uint32_t filename;
+  };
+
+  // Start times in the order they were queued, which the build system maps onto sample_buffer()
+  struct MixArgs {
+    BufferId source;
+    bigint_t start_ms[2];
+    bigint_t duration_ms;
+    CommandId source_dependency;
+  };
+
+  // The score is shared with the sequencer it was queued from, which never changes it (see Sequencer.h)
+  struct SequenceArgs {
+    std::shared_ptr<const Score> score;
+    bigint_t start_ms;
+  };
+
+  // A command as read back from the log. Only the arguments of its kind are set.
+  struct Command {
+    CommandKind kind;
+    BufferId buffer;
+    CommandId dependency;        // The previous command on the buffer
+    CommandId source_dependency; // The last command on the source of a mix
+    uint64_t fingerprint;
+    bool file_inputs;            // Whether the buffer state depends on sampled .wav files
+    WaveArgs wave;
+    FileArgs file;
+    MixArgs mix;
+    SequenceArgs sequence;
+    std::string filename;        // Of file samples and dumps
+  };
+
+  class CommandLog {
+   public:
+    explicit CommandLog(uint64_t seed);
+
+    CommandLog(const CommandLog&) = delete;
+    CommandLog& operator=(const CommandLog&) = delete;
+
+    // Queues the creation of a buffer, and returns its handle
+    BufferId gen_buffer();
+    // Registered wave type ids are only good for one engine, so the fingerprint of the table they name
+    // is hashed in too (see WavetableRegistry::fingerprint()), or 0 for built-in ones
+    void produce_wave(BufferId buffer, bigint_t attack_start_ms, bigint_t attack_ms, bigint_t sustain_ms, bigint_t decay_ms, double freq_hz, double amp, int wave_type,
+                      uint64_t table_fingerprint);
+    void sample_file(BufferId buffer, const char *filename, bigint_t buffer_start_ms, bigint_t sample_start_ms, bigint_t duration_ms);
+    void sample_buffer(BufferId target, BufferId source, bigint_t first_start_ms, bigint_t second_start_ms, bigint_t duration_ms);
+    void dump_buffer(BufferId buffer, const char *filename);
+    void render_sequence(BufferId buffer, std::shared_ptr<const Score> score, bigint_t start_ms);
+
+    size_t size() const;
+    bool command(CommandId id, Command& out) const;
+
+    // The commands of a kind, in order
+    std::vector<CommandId> find(CommandKind kind) const;
+    // The last command on every buffer
+    std::vector<CommandId> latest_commands() const;
+    // The states that mixes read their source in
+    std::vector<CommandId> mix_sources() const;
+
+    // Every file name queued, in the order first seen
+    std::vector<std::string> filenames() const;
+    // Folds the modification times of sampled files into the fingerprints that depend on them, giving
+    // the keys of those buffer states. mtimes has one entry per name of filenames(), NaN if missing.
+    std::vector<std::pair<CommandId, uint64_t>> resolve_file_inputs(const std::vector<double>& mtimes) const;
+
+    // The bytes of memory held by the log
+    size_t memory_bytes() const;
+
+   private:
+    CommandId push(CommandKind kind, BufferId buffer, uint32_t row, CommandId source_dependency, const uint64_t *content, size_t words);
+    uint32_t intern(const char *filename, uint64_t& hash);
+
+    mutable std::mutex lock;
+    uint64_t seed;
+    BufferId last_buffer = 0;
+
+    // One entry per command
+    std::vector<uint8_t> kinds; // The kind, with the high bit set for file inputs
+    std::vector<uint32_t> rows; // Into the table of the kind
+    std::vector<BufferId> buffers;
+    std::vector<CommandId> dependencies;
+    std::vector<uint64_t> fingerprints;
+
+    // One table per kind of command with arguments
+    std::vector<WaveArgs> waves;
+    std::vector<FileArgs> files;
+    std::vector<MixArgs> mixes;
+    std::vector<uint32_t> dumps; // File names
+    std::vector<SequenceArgs> sequences;
+
+    // File names, null terminated and back to back
+    std::string arena;
+    std::vector<uint32_t> name_offsets;
+    std::unordered_multimap<uint64_t, uint32_t> name_index;
+
+    std::unordered_map<BufferId, CommandId> latest;
+  };
+}
+
+#endif
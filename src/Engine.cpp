@@ -0,0 +1,1177 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension
+* Copyright 2020 Patrick Worthey
+* Source: https://github.com/ptrick/synther
+* LICENSE: MIT
+* See LICENSE and README.md files for more information.
+* *******************************************************
+*/
+
+#include "Engine.h"
+#include "WavIO.h"
+#include "Trace.h"
+#include "Stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <thread>
+
+namespace Synth {
+  namespace {
+    typedef std::map<BufferId, Buffer> BufferStore;
+
+    // Finds the buffer with an id, or returns NULL
+    typedef std::function<Buffer* (BufferId)> BufferLookup;
+
+    Result ok() {
+      return Result{Status::Ok, 0};
+    }
+
+    Result error(Status status, BufferId buffer = 0) {
+      return Result{status, buffer};
+    }
+
+    // Resizes a buffer, counting the resize and whether it had to move to a larger allocation
+    void resize_buffer(Buffer& b, size_t size) {
+      if (b.size() == size) {
+        return;
+      }
+      size_t capacity = b.capacity();
+      b.resize(size, 0);
+      Stats::add(Stats::Counter::BufferResizes, 1);
+      if (b.capacity() != capacity) {
+        Stats::add(Stats::Counter::BufferReallocations, 1);
+      }
+    }
+
+    // One operation of a render graph, resolved against the buffer sizes it will see when it runs
+    struct GraphOp {
+      GraphOpKind kind;
+      BufferId target;
+      BufferId source;
+      size_t begin; // The range of the target written to
+      size_t end;
+      WaveOp wave;
+      std::shared_ptr<const Wavetable> table; // Of a band-limited or registered wave type
+      WaveState wave_state;
+      NoteSamples note; // The cached samples of the wave, if it has been looked up and found
+      bool note_checked = false;
+      MixOp mix;
+      Buffer clip; // Decoded .wav samples, starting at begin
+      std::shared_ptr<VoicePool> voices; // Of a score, allocated before any tile runs
+    };
+
+    // Which ops of a graph write to which part of its range, so that a tile only visits the ops
+    // writing to it. The range is cut into blocks, and each block lists the ops that write to it, in
+    // order: a tile then costs as much as the notes playing in it, however many notes the graph holds.
+    class OpIndex {
+     public:
+      // Indexes the ops writing to [begin, end)
+      void build(const std::vector<GraphOp>& ops, size_t begin, size_t end);
+
+      // The ops writing to [begin, end), in order. Valid until the next call.
+      const std::vector<uint32_t>& find(const std::vector<GraphOp>& ops, size_t begin, size_t end);
+
+     private:
+      size_t block_of(size_t n) const { return (n - origin) >> shift; }
+
+      size_t origin = 0;
+      size_t limit = 0;
+      unsigned shift = 0;
+      // Block b lists the ops in ids[offsets[b]] to ids[offsets[b + 1]], sorted
+      std::vector<size_t> offsets;
+      std::vector<uint32_t> ids;
+      std::vector<uint32_t> found;
+    };
+
+    void OpIndex::build(const std::vector<GraphOp>& ops, size_t begin, size_t end) {
+      origin = begin;
+      limit = end;
+      offsets.clear();
+      ids.clear();
+      if (begin >= end) {
+        return;
+      }
+
+      // Blocks start at 4096 frames, and grow until long ops (mixes of whole songs) are listed in at
+      // most a few blocks each on average, which bounds the index to a few entries per op
+      size_t spans = 0;
+      for (const GraphOp& op : ops) {
+        spans += op.begin < op.end ? op.end - op.begin : 0;
+      }
+      shift = 13;
+      while ((spans >> shift) > ops.size() * 4) {
+        ++shift;
+      }
+
+      size_t blocks = block_of(end - 1) + 1;
+      offsets.assign(blocks + 1, 0);
+      for (const GraphOp& op : ops) {
+        if (op.begin < op.end) {
+          for (size_t b = block_of(op.begin); b <= block_of(op.end - 1); ++b) {
+            ++offsets[b + 1];
+          }
+        }
+      }
+      for (size_t b = 0; b < blocks; ++b) {
+        offsets[b + 1] += offsets[b];
+      }
+      ids.resize(offsets[blocks]);
+      std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+      for (size_t i = 0; i < ops.size(); ++i) {
+        if (ops[i].begin < ops[i].end) {
+          for (size_t b = block_of(ops[i].begin); b <= block_of(ops[i].end - 1); ++b) {
+            ids[next[b]++] = static_cast<uint32_t>(i);
+          }
+        }
+      }
+    }
+
+    const std::vector<uint32_t>& OpIndex::find(const std::vector<GraphOp>& ops, size_t begin, size_t end) {
+      found.clear();
+      begin = std::max(begin, origin);
+      end = std::min(end, limit);
+      if (begin >= end) {
+        return found;
+      }
+
+      // An op writing to several of the blocks is taken from the first of them only
+      size_t first = block_of(begin);
+      size_t last = block_of(end - 1);
+      for (size_t b = first; b <= last; ++b) {
+        for (size_t k = offsets[b]; k < offsets[b + 1]; ++k) {
+          const GraphOp& op = ops[ids[k]];
+          if (op.begin < end && op.end > begin && (b == first || block_of(op.begin) == b)) {
+            found.push_back(ids[k]);
+          }
+        }
+      }
+      if (first != last) {
+        std::sort(found.begin(), found.end());
+      }
+      return found;
+    }
+
+    // Runs a list of operations one tile at a time: every operation writing to the first tile runs,
+    // then every operation writing to the second tile, and so on. Intermediate buffers are then
+    // consumed while they are still in cache, instead of each operation sweeping its whole range
+    // before the next one starts.
+    //
+    // That order is only equivalent to running the operations one after the other if no operation
+    // reads ahead of the tile being rendered. Mixes that read a source at a later time than they
+    // write it, or that read a source some later operation still writes to, make the graph fall back
+    // to a single tile.
+    class RenderGraph {
+     public:
+      // Resolves a list of operations against the buffers found by lookup, without touching them.
+      // Waves are played from tables, and looked up in notes, if given, when they first run.
+      Result resolve(const std::vector<GraphOpSpec>& specs, const BufferLookup& lookup, const WavetableRegistry& tables, std::shared_ptr<NoteCache> notes);
+
+      // Grows every buffer the graph writes to its final size
+      void allocate();
+
+      // Runs each operation's share of the target range [begin, end)
+      void run_tile(size_t begin, size_t end);
+
+      // Runs the whole graph, tile_samples at a time if it is tileable. Stops between tiles (or
+      // between ops, if it isn't tileable) once cancelled is set, and returns whether it finished.
+      bool run(size_t tile_samples, const std::atomic<bool> *cancelled = nullptr);
+
+      bool tileable() const { return tiled; }
+
+      // The number of samples the operations write, in total
+      size_t samples() const;
+
+     private:
+      void run_op(GraphOp& op, size_t begin, size_t end);
+
+      std::vector<GraphOp> ops;
+      std::shared_ptr<NoteCache> notes;
+      std::map<BufferId, size_t> sizes; // Simulated sizes of the buffers, as of the op being resolved
+      std::map<BufferId, Buffer*> resolved;
+      OpIndex index;
+      bool tiled = true;
+      size_t range_begin = SIZE_MAX;
+      size_t range_end = 0;
+    };
+
+    Result RenderGraph::resolve(const std::vector<GraphOpSpec>& specs, const BufferLookup& lookup, const WavetableRegistry& tables, std::shared_ptr<NoteCache> note_cache) {
+      ops.assign(specs.size(), GraphOp());
+      notes = std::move(note_cache);
+
+      auto find_size = [&](BufferId buffer, size_t& size) {
+        auto sz = sizes.find(buffer);
+        if (sz != sizes.end()) {
+          size = sz->second;
+          return true;
+        }
+        Buffer *b = lookup(buffer);
+        if (b == nullptr) {
+          return false;
+        }
+        resolved[buffer] = b;
+        size = sizes[buffer] = b->size();
+        return true;
+      };
+
+      // Resolve every op before touching any buffer, so a bad op leaves them all untouched
+      for (size_t i = 0; i < specs.size(); ++i) {
+        const GraphOpSpec& spec = specs[i];
+        GraphOp& op = ops[i];
+        op.kind = spec.kind;
+        op.target = spec.target;
+        op.source = spec.source;
+        size_t target_size;
+
+        if (op.kind == GraphOpKind::ProduceWave) {
+          if (!find_size(op.target, target_size)) {
+            return error(Status::BufferNotFound, op.target);
+          }
+          if (!tables.valid(spec.wave_type)) {
+            return error(Status::WaveTypeNotFound);
+          }
+          op.table = tables.find(spec.wave_type);
+          op.wave = make_wave_op(spec.start_ms, spec.attack_ms, spec.sustain_ms, spec.decay_ms, spec.freq_hz, spec.amp, spec.wave_type, op.table.get());
+          op.begin = op.wave.start_index;
+          op.end = op.wave.end_index;
+          sizes[op.target] = std::max(target_size, op.wave.end_index);
+        }
+        else if (op.kind == GraphOpKind::SampleFile) {
+          if (!find_size(op.target, target_size)) {
+            return error(Status::BufferNotFound, op.target);
+          }
+          if (!WavIO::decode_wav(spec.filename.c_str(), op.clip, op.begin, spec.start_ms, spec.source_start_ms, spec.duration_ms)) {
+            return error(Status::ReadFailed);
+          }
+          op.end = op.begin + op.clip.size();
+          sizes[op.target] = std::max(target_size, op.end);
+        }
+        else if (op.kind == GraphOpKind::SampleBuffer) {
+          size_t source_size;
+          if (!find_size(op.target, target_size)) {
+            return error(Status::BufferNotFound, op.target);
+          }
+          if (!find_size(op.source, source_size)) {
+            return error(Status::BufferNotFound, op.source);
+          }
+          op.mix = resolve_mix(target_size, source_size, spec.source_start_ms, spec.start_ms, spec.duration_ms);
+          op.begin = op.mix.target_start;
+          op.end = op.mix.target_start + op.mix.frames * 2;
+          sizes[op.target] = op.mix.target_size;
+        }
+        else if (op.kind == GraphOpKind::RenderSequence && spec.score) {
+          if (!find_size(op.target, target_size)) {
+            return error(Status::BufferNotFound, op.target);
+          }
+          op.voices = std::make_shared<VoicePool>(spec.score, spec.start_ms);
+          op.begin = op.voices->begin();
+          op.end = op.voices->end();
+          sizes[op.target] = std::max(target_size, op.end);
+        }
+        else {
+          return error(Status::GraphOpNotFound);
+        }
+      }
+
+      // Tiles are only safe if no mix reads ahead of the tile being rendered
+      for (size_t i = 0; i < ops.size() && tiled; ++i) {
+        if (ops[i].kind != GraphOpKind::SampleBuffer || ops[i].mix.frames == 0) {
+          continue;
+        }
+        if (ops[i].mix.source_start > ops[i].mix.target_start) {
+          tiled = false;
+        }
+        else if (ops[i].mix.source_start < ops[i].mix.target_start) {
+          for (size_t j = i + 1; j < ops.size(); ++j) {
+            if (ops[j].target == ops[i].source) {
+              tiled = false;
+              break;
+            }
+          }
+        }
+      }
+
+      for (auto& op : ops) {
+        if (op.begin < op.end) {
+          range_begin = std::min(range_begin, op.begin);
+          range_end = std::max(range_end, op.end);
+        }
+      }
+      index.build(ops, range_begin, range_end);
+      return ok();
+    }
+
+    void RenderGraph::allocate() {
+      for (auto& sz : sizes) {
+        resize_buffer(*resolved[sz.first], sz.second);
+      }
+    }
+
+    void RenderGraph::run_tile(size_t tile_begin, size_t tile_end) {
+      for (uint32_t i : index.find(ops, tile_begin, tile_end)) {
+        run_op(ops[i], tile_begin, tile_end);
+      }
+    }
+
+    void RenderGraph::run_op(GraphOp& op, size_t tile_begin, size_t tile_end) {
+      auto& target = *resolved[op.target];
+      switch (op.kind) {
+        case GraphOpKind::ProduceWave:
+          if (!op.note_checked) {
+            op.note = notes ? notes->find(op.wave) : nullptr;
+            op.note_checked = true;
+          }
+          if (op.note) {
+            mix_note(target, op.wave, *op.note, tile_begin, tile_end);
+          }
+          else {
+            render_wave(target, op.wave, op.wave_state, tile_begin, tile_end);
+          }
+          break;
+        case GraphOpKind::SampleFile:
+          for (size_t n = std::max(tile_begin, op.begin); n < std::min(tile_end, op.end); ++n) {
+            target[n] += op.clip[n - op.begin];
+          }
+          break;
+        case GraphOpKind::SampleBuffer:
+          apply_mix(target, *resolved[op.source], op.mix, tile_begin, tile_end);
+          break;
+        case GraphOpKind::RenderSequence:
+          op.voices->render(target, tile_begin, tile_end);
+          break;
+      }
+    }
+
+    bool RenderGraph::run(size_t tile_samples, const std::atomic<bool> *cancelled) {
+      auto stop = [&]() { return cancelled != nullptr && cancelled->load(std::memory_order_relaxed); };
+      if (!tiled) {
+        // One op after the other, each over the whole range, which is what a single tile runs
+        for (uint32_t i : index.find(ops, range_begin, range_end)) {
+          if (stop()) {
+            return false;
+          }
+          run_op(ops[i], range_begin, range_end);
+        }
+        return true;
+      }
+      for (size_t tile_begin = range_begin; tile_begin < range_end; tile_begin = tile_begin + std::min(tile_samples, range_end - tile_begin)) {
+        if (stop()) {
+          return false;
+        }
+        run_tile(tile_begin, tile_begin + std::min(tile_samples, range_end - tile_begin));
+      }
+      return true;
+    }
+
+    size_t RenderGraph::samples() const {
+      size_t total = 0;
+      for (auto& op : ops) {
+        total += op.end > op.begin ? op.end - op.begin : 0;
+      }
+      return total;
+    }
+
+    // A single-producer single-consumer ring of fixed-size sample blocks. The producer fills the slot
+    // at head and publishes it by advancing head; the consumer reads the slot at tail and hands it back
+    // by advancing tail. Neither side ever takes a lock.
+    class BlockRing {
+     public:
+      BlockRing(size_t slot_count, size_t block_samples)
+        : data(slot_count * block_samples), lengths(slot_count), slots(slot_count), block(block_samples) {}
+
+      // The next free slot, or NULL while the consumer still holds all of them
+      uint16_t* acquire_write() {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == slots) {
+          return nullptr;
+        }
+        return &data[(h % slots) * block];
+      }
+
+      void publish(size_t samples) {
+        size_t h = head.load(std::memory_order_relaxed);
+        lengths[h % slots] = samples;
+        head.store(h + 1, std::memory_order_release);
+      }
+
+      // The oldest published slot, or NULL if the producer hasn't published one yet
+      uint16_t* acquire_read(size_t& samples) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) {
+          return nullptr;
+        }
+        samples = lengths[t % slots];
+        return &data[(t % slots) * block];
+      }
+
+      void release_read() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+      }
+
+     private:
+      std::vector<uint16_t> data;
+      std::vector<size_t> lengths;
+      size_t slots;
+      size_t block;
+      // Padded onto cache lines of their own, without over-aligning the ring (which C++11 can't allocate)
+      char pad_head[64];
+      std::atomic<size_t> head{0};
+      char pad_tail[64 - sizeof(std::atomic<size_t>)];
+      std::atomic<size_t> tail{0};
+      char pad_end[64 - sizeof(std::atomic<size_t>)];
+    };
+
+    // Waits on the other end of a BlockRing: spins briefly, then yields, then sleeps
+    void ring_backoff(unsigned& attempt) {
+      if (attempt >= 128) {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+      else if (attempt >= 64) {
+        std::this_thread::yield();
+      }
+      ++attempt;
+    }
+  }
+
+  // A render running on its own thread into private buffers
+  struct StreamState {
+    StreamState(size_t block, size_t slot_count) : block_samples(block), ring(slot_count, block) {}
+
+    BufferStore store;
+    RenderGraph graph;
+    BufferId output = 0;
+    size_t block_samples;
+    BlockRing ring;
+    std::atomic<bool> finished{false};
+    std::atomic<bool> failed{false};
+    std::atomic<bool> cancelled{false};
+    std::atomic<bool> closed{false};
+    std::thread producer;
+  };
+
+  // A buffer in an engine's registry, with the lock every call touching it holds
+  struct BufferSlot {
+    std::mutex lock;
+    Buffer samples;
+  };
+
+  namespace {
+    void produce_stream(StreamState *st) {
+      if (Trace::active.load(std::memory_order_relaxed)) {
+        Trace::name_thread("render_stream");
+      }
+      try {
+        st->graph.allocate();
+        const Buffer& out = st->store[st->output];
+        // Every buffer the graph writes has its final size once allocated
+        size_t total = out.size();
+        // A block of the output is final once its tile has run. Graphs that can't be tiled render
+        // in one go before the first block is handed over, stopping between ops if the stream is closed.
+        if (!st->graph.tileable() && !st->graph.run(SIZE_MAX, &st->cancelled)) {
+          st->finished.store(true, std::memory_order_release);
+          return;
+        }
+        for (size_t begin = 0; begin < total; begin += st->block_samples) {
+          if (st->cancelled.load(std::memory_order_relaxed)) {
+            break;
+          }
+          size_t end = std::min(begin + st->block_samples, total);
+          Trace::Scope trace("render_block");
+          trace.samples = end - begin;
+          if (st->graph.tileable()) {
+            st->graph.run_tile(begin, end);
+          }
+          uint16_t *slot;
+          unsigned attempt = 0;
+          while ((slot = st->ring.acquire_write()) == nullptr) {
+            if (st->cancelled.load(std::memory_order_relaxed)) {
+              st->finished.store(true, std::memory_order_release);
+              return;
+            }
+            ring_backoff(attempt);
+          }
+          std::copy(out.begin() + begin, out.begin() + end, slot);
+          st->ring.publish(end - begin);
+        }
+      }
+      catch (const std::exception&) {
+        st->failed.store(true, std::memory_order_relaxed);
+      }
+      st->finished.store(true, std::memory_order_release);
+    }
+
+    // Holds the locks of a set of buffers, taken in order of id so that calls locking several
+    // buffers can't deadlock each other
+    class SlotLocks {
+     public:
+      template <typename Slots>
+      explicit SlotLocks(const Slots& slots) {
+        for (auto& slot : slots) {
+          slot.second->lock.lock();
+          held.push_back(slot.second.get());
+        }
+      }
+
+      ~SlotLocks() {
+        for (auto slot = held.rbegin(); slot != held.rend(); ++slot) {
+          (*slot)->lock.unlock();
+        }
+      }
+
+      SlotLocks(const SlotLocks&) = delete;
+      SlotLocks& operator=(const SlotLocks&) = delete;
+
+     private:
+      std::vector<BufferSlot*> held;
+    };
+
+    // Starts the producer of a stream whose graph has been resolved
+    Result start_stream(std::unique_ptr<StreamState> st, std::unique_ptr<Stream>& stream) {
+      try {
+        st->producer = std::thread(produce_stream, st.get());
+      }
+      catch (const std::exception&) {
+        return error(Status::ThreadFailed);
+      }
+      stream.reset(new Stream(std::move(st)));
+      return ok();
+    }
+  }
+
+  GraphOpSpec GraphOpSpec::wave(BufferId buffer, bigint_t attack_start_ms, bigint_t attack_ms, bigint_t sustain_ms, bigint_t decay_ms, double freq_hz, double amp, int wave_type) {
+    GraphOpSpec spec = GraphOpSpec();
+    spec.kind = GraphOpKind::ProduceWave;
+    spec.target = buffer;
+    spec.start_ms = attack_start_ms;
+    spec.attack_ms = attack_ms;
+    spec.sustain_ms = sustain_ms;
+    spec.decay_ms = decay_ms;
+    spec.freq_hz = freq_hz;
+    spec.amp = amp;
+    spec.wave_type = wave_type;
+    return spec;
+  }
+
+  GraphOpSpec GraphOpSpec::file(BufferId buffer, const std::string& filename, bigint_t buffer_start_ms, bigint_t sample_start_ms, bigint_t duration_ms) {
+    GraphOpSpec spec = GraphOpSpec();
+    spec.kind = GraphOpKind::SampleFile;
+    spec.target = buffer;
+    spec.filename = filename;
+    spec.start_ms = buffer_start_ms;
+    spec.source_start_ms = sample_start_ms;
+    spec.duration_ms = duration_ms;
+    return spec;
+  }
+
+  GraphOpSpec GraphOpSpec::mix(BufferId target, BufferId source, bigint_t source_start_ms, bigint_t target_start_ms, bigint_t duration_ms) {
+    GraphOpSpec spec = GraphOpSpec();
+    spec.kind = GraphOpKind::SampleBuffer;
+    spec.target = target;
+    spec.source = source;
+    spec.start_ms = target_start_ms;
+    spec.source_start_ms = source_start_ms;
+    spec.duration_ms = duration_ms;
+    return spec;
+  }
+
+  GraphOpSpec GraphOpSpec::sequence(BufferId buffer, std::shared_ptr<const Score> score, bigint_t start_ms) {
+    GraphOpSpec spec = GraphOpSpec();
+    spec.kind = GraphOpKind::RenderSequence;
+    spec.target = buffer;
+    spec.score = std::move(score);
+    spec.start_ms = start_ms;
+    return spec;
+  }
+
+  Stream::Stream(std::unique_ptr<StreamState> st) : state(std::move(st)), holding(false) {}
+
+  Stream::~Stream() {
+    close();
+  }
+
+  bool Stream::next(const uint16_t *&data, size_t& samples) {
+    std::lock_guard<std::mutex> lock(consumer);
+    // The previous block may be overwritten from here on
+    if (holding) {
+      state->ring.release_read();
+      holding = false;
+    }
+    if (state->closed.load(std::memory_order_relaxed)) {
+      return false;
+    }
+
+    uint16_t *slot;
+    unsigned attempt = 0;
+    while ((slot = state->ring.acquire_read(samples)) == nullptr) {
+      if (state->finished.load(std::memory_order_acquire)) {
+        // Blocks published right before finishing
+        slot = state->ring.acquire_read(samples);
+        break;
+      }
+      ring_backoff(attempt);
+    }
+    if (slot == nullptr) {
+      return false;
+    }
+    holding = true;
+    data = slot;
+    return true;
+  }
+
+  void Stream::close() {
+    std::lock_guard<std::mutex> lock(closer);
+    state->closed.store(true, std::memory_order_relaxed);
+    state->cancelled.store(true, std::memory_order_relaxed);
+    if (state->producer.joinable()) {
+      state->producer.join();
+    }
+  }
+
+  bool Stream::failed() const {
+    return state->failed.load(std::memory_order_relaxed);
+  }
+
+  Engine::Engine() : notes(std::make_shared<NoteCache>()) {}
+
+  Engine::~Engine() {}
+
+  void Engine::find_slots(const std::vector<BufferId>& ids, SlotMap& slots) const {
+    std::shared_lock<std::shared_timed_mutex> lock(registry);
+    for (BufferId id : ids) {
+      auto bf = buffers.find(id);
+      if (bf != buffers.end()) {
+        slots[id] = bf->second;
+      }
+    }
+  }
+
+  std::shared_ptr<BufferSlot> Engine::find_slot(BufferId buffer) const {
+    std::shared_lock<std::shared_timed_mutex> lock(registry);
+    auto bf = buffers.find(buffer);
+    return bf == buffers.end() ? nullptr : bf->second;
+  }
+
+  bool Engine::record(const GraphOpSpec& op, Result& result) {
+    std::lock_guard<std::mutex> lock(pending_lock);
+    if (!lazy.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    if (find_slot(op.target) == nullptr) {
+      result = error(Status::BufferNotFound, op.target);
+    }
+    else if (op.kind == GraphOpKind::SampleBuffer && find_slot(op.source) == nullptr) {
+      result = error(Status::BufferNotFound, op.source);
+    }
+    else if (op.kind == GraphOpKind::ProduceWave && !tables.valid(op.wave_type)) {
+      result = error(Status::WaveTypeNotFound);
+    }
+    else {
+      pending.push_back(op);
+      result = ok();
+    }
+    return true;
+  }
+
+  Result Engine::settle(const std::vector<BufferId>& ids) const {
+    // Nothing is recorded outside of lazy mode, and turning it off flushes before the flag is cleared
+    if (!lazy.load(std::memory_order_acquire)) {
+      return ok();
+    }
+    std::lock_guard<std::mutex> lock(pending_lock);
+    return settle_locked(&ids);
+  }
+
+  Result Engine::settle_locked(const std::vector<BufferId> *ids) const {
+    if (pending.empty()) {
+      return ok();
+    }
+    Trace::Scope trace("flush");
+    std::vector<GraphOpSpec> ops;
+    if (ids == nullptr) {
+      ops.swap(pending);
+    }
+    else {
+      // One pass from the newest operation back. An operation runs if it writes to or reads from
+      // the buffers, or if a running operation needs it to have run first: earlier writes to the
+      // buffers it writes to or reads from, and earlier reads of the buffers it writes to.
+      size_t n = pending.size();
+      std::map<BufferId, size_t> writes_before;
+      std::map<BufferId, size_t> reads_before;
+      for (BufferId id : *ids) {
+        writes_before[id] = n;
+        reads_before[id] = n;
+      }
+      auto needed = [](const std::map<BufferId, size_t>& before, BufferId id, size_t i) {
+        auto b = before.find(id);
+        return b != before.end() && i < b->second;
+      };
+      auto need = [](std::map<BufferId, size_t>& before, BufferId id, size_t i) {
+        size_t& b = before[id];
+        b = std::max(b, i);
+      };
+
+      std::vector<bool> taken(n, false);
+      for (size_t i = n; i-- > 0;) {
+        const GraphOpSpec& op = pending[i];
+        bool mix = op.kind == GraphOpKind::SampleBuffer;
+        if (!needed(writes_before, op.target, i) && !(mix && needed(reads_before, op.source, i))) {
+          continue;
+        }
+        taken[i] = true;
+        need(writes_before, op.target, i);
+        need(reads_before, op.target, i);
+        if (mix) {
+          need(writes_before, op.source, i);
+        }
+      }
+
+      size_t kept = 0;
+      for (size_t i = 0; i < n; ++i) {
+        if (taken[i]) {
+          ops.push_back(std::move(pending[i]));
+        }
+        else {
+          pending[kept++] = std::move(pending[i]);
+        }
+      }
+      pending.resize(kept);
+    }
+
+    size_t samples = 0;
+    Result result = run_graph(ops, lazy_tile_frames, samples);
+    trace.samples = samples;
+    return result;
+  }
+
+  Result Engine::run_graph(const std::vector<GraphOpSpec>& ops, size_t tile_frames, size_t& samples) const {
+    // Missing buffers are left for resolve() to report, in the order of the ops
+    std::vector<BufferId> ids;
+    for (auto& op : ops) {
+      ids.push_back(op.target);
+      if (op.kind == GraphOpKind::SampleBuffer) {
+        ids.push_back(op.source);
+      }
+    }
+    SlotMap slots;
+    find_slots(ids, slots);
+    SlotLocks locks(slots);
+
+    RenderGraph graph;
+    Result result = graph.resolve(ops, [&](BufferId buffer) -> Buffer* {
+      auto slot = slots.find(buffer);
+      return slot == slots.end() ? nullptr : &slot->second->samples;
+    }, tables, notes);
+    if (!result.ok()) {
+      return result;
+    }
+    graph.allocate();
+    graph.run(tile_frames * 2);
+    samples = graph.samples();
+    return ok();
+  }
+
+  BufferId Engine::create_buffer() {
+    std::shared_ptr<BufferSlot> slot = std::make_shared<BufferSlot>();
+    std::unique_lock<std::shared_timed_mutex> lock(registry);
+    buffers[++last_id] = slot;
+    return last_id;
+  }
+
+  Result Engine::free_buffer(BufferId buffer) {
+    std::shared_ptr<BufferSlot> slot;
+    {
+      // Nothing can be recorded against the buffer between settling it and freeing it
+      std::unique_lock<std::mutex> settled(pending_lock, std::defer_lock);
+      if (lazy.load(std::memory_order_acquire)) {
+        settled.lock();
+        std::vector<BufferId> ids{buffer};
+        Result result = settle_locked(&ids);
+        if (!result.ok()) {
+          return result;
+        }
+      }
+      std::unique_lock<std::shared_timed_mutex> lock(registry);
+      auto bf = buffers.find(buffer);
+      if (bf == buffers.end()) {
+        return error(Status::BufferNotFound, buffer);
+      }
+      slot.swap(bf->second);
+      buffers.erase(bf);
+    }
+    // Calls still using the buffer hold on to it until they are done. Otherwise its memory is
+    // released here, outside the registry lock.
+    return ok();
+  }
+
+  Result Engine::copy_samples(BufferId buffer, uint16_t *out, size_t capacity, size_t& count) const {
+    Result settled = settle(std::vector<BufferId>{buffer});
+    if (!settled.ok()) {
+      return settled;
+    }
+    std::shared_ptr<BufferSlot> slot = find_slot(buffer);
+    if (slot == nullptr) {
+      return error(Status::BufferNotFound, buffer);
+    }
+    std::lock_guard<std::mutex> lock(slot->lock);
+    count = slot->samples.size();
+    if (count > 0 && count <= capacity) {
+      std::memcpy(out, slot->samples.data(), count * sizeof(uint16_t));
+    }
+    return ok();
+  }
+
+  Result Engine::capacity_bytes(BufferId buffer, size_t& bytes) const {
+    Result settled = settle(std::vector<BufferId>{buffer});
+    if (!settled.ok()) {
+      return settled;
+    }
+    std::shared_ptr<BufferSlot> slot = find_slot(buffer);
+    if (slot == nullptr) {
+      return error(Status::BufferNotFound, buffer);
+    }
+    std::lock_guard<std::mutex> lock(slot->lock);
+    bytes = slot->samples.capacity() * sizeof(uint16_t);
+    return ok();
+  }
+
+  size_t Engine::buffer_count() const {
+    std::shared_lock<std::shared_timed_mutex> lock(registry);
+    return buffers.size();
+  }
+
+  void Engine::memory_usage(size_t& bytes, size_t& capacity_bytes) const {
+    std::vector<std::shared_ptr<BufferSlot>> slots;
+    {
+      std::shared_lock<std::shared_timed_mutex> lock(registry);
+      slots.reserve(buffers.size());
+      for (auto& bf : buffers) {
+        slots.push_back(bf.second);
+      }
+    }
+    bytes = 0;
+    capacity_bytes = 0;
+    for (auto& slot : slots) {
+      std::lock_guard<std::mutex> lock(slot->lock);
+      bytes += slot->samples.size() * sizeof(uint16_t);
+      capacity_bytes += slot->samples.capacity() * sizeof(uint16_t);
+    }
+  }
+
+  Result Engine::produce_wave(BufferId buffer, bigint_t attack_start_ms, bigint_t attack_ms, bigint_t sustain_ms, bigint_t decay_ms, double freq_hz, double amp, int wave_type) {
+    Trace::Scope trace("produce_wave");
+    Result recorded;
+    if (lazy.load(std::memory_order_acquire) && record(GraphOpSpec::wave(buffer, attack_start_ms, attack_ms, sustain_ms, decay_ms, freq_hz, amp, wave_type), recorded)) {
+      return recorded;
+    }
+    std::shared_ptr<BufferSlot> slot = find_slot(buffer);
+    if (slot == nullptr) {
+      return error(Status::BufferNotFound, buffer);
+    }
+    if (!tables.valid(wave_type)) {
+      return error(Status::WaveTypeNotFound);
+    }
+
+    std::shared_ptr<const Wavetable> table = tables.find(wave_type);
+    WaveOp op = make_wave_op(attack_start_ms, attack_ms, sustain_ms, decay_ms, freq_hz, amp, wave_type, table.get());
+    NoteSamples note = notes->find(op);
+    std::lock_guard<std::mutex> lock(slot->lock);
+    Buffer& b = slot->samples;
+    if (b.size() < op.end_index) {
+      resize_buffer(b, op.end_index);
+    }
+
+    if (note) {
+      mix_note(b, op, *note, 0, op.end_index);
+    }
+    else {
+      WaveState state;
+      render_wave(b, op, state, 0, op.end_index);
+    }
+    trace.samples = op.end_index - op.start_index;
+    return ok();
+  }
+
+  Result Engine::produce_bank(BufferId buffer, bigint_t attack_start_ms, bigint_t attack_ms, bigint_t sustain_ms, bigint_t decay_ms, const std::vector<BankVoice>& voices, double amp, int wave_type) {
+    Trace::Scope trace("produce_bank");
+    Result settled = settle(std::vector<BufferId>{buffer});
+    if (!settled.ok()) {
+      return settled;
+    }
+    std::shared_ptr<BufferSlot> slot = find_slot(buffer);
+    if (slot == nullptr) {
+      return error(Status::BufferNotFound, buffer);
+    }
+    if (!tables.valid(wave_type)) {
+      return error(Status::WaveTypeNotFound);
+    }
+
+    std::shared_ptr<const Wavetable> table = tables.find(wave_type);
+    WaveOp op = make_wave_op(attack_start_ms, attack_ms, sustain_ms, decay_ms, 0.0, amp, wave_type, table.get());
+    std::lock_guard<std::mutex> lock(slot->lock);
+    Buffer& b = slot->samples;
+    if (b.size() < op.end_index) {
+      resize_buffer(b, op.end_index);
+    }
+
+    render_bank(b, op, voices, 0, op.end_index);
+    trace.samples = op.end_index - op.start_index;
+    return ok();
+  }
+
+  Result Engine::produce_fm(BufferId buffer, bigint_t start_ms, double freq_hz, const std::vector<FMOperator>& operators, double amp) {
+    Trace::Scope trace("produce_fm");
+    Result settled = settle(std::vector<BufferId>{buffer});
+    if (!settled.ok()) {
+      return settled;
+    }
+    std::shared_ptr<BufferSlot> slot = find_slot(buffer);
+    if (slot == nullptr) {
+      return error(Status::BufferNotFound, buffer);
+    }
+    if (!valid_fm_operators(operators)) {
+      return error(Status::InvalidOperator);
+    }
+
+    size_t end_index = fm_end_index(start_ms, operators);
+    std::lock_guard<std::mutex> lock(slot->lock);
+    Buffer& b = slot->samples;
+    if (b.size() < end_index) {
+      resize_buffer(b, end_index);
+    }
+
+    render_fm(b, start_ms, freq_hz, operators, amp);
+    trace.samples = end_index - std::min(end_index, ms_to_buffer_index(start_ms));
+    return ok();
+  }
+
+  Result Engine::render_sequence(BufferId buffer, std::shared_ptr<const Score> score, bigint_t start_ms) {
+    Trace::Scope trace("render_sequence");
+    Result recorded;
+    if (lazy.load(std::memory_order_acquire) && record(GraphOpSpec::sequence(buffer, score, start_ms), recorded)) {
+      return recorded;
+    }
+    std::shared_ptr<BufferSlot> slot = find_slot(buffer);
+    if (slot == nullptr) {
+      return error(Status::BufferNotFound, buffer);
+    }
+
+    VoicePool voices(std::move(score), start_ms);
+    std::lock_guard<std::mutex> lock(slot->lock);
+    Buffer& b = slot->samples;
+    if (b.size() < voices.end()) {
+      resize_buffer(b, voices.end());
+    }
+
+    voices.render(b, 0, voices.end());
+    trace.samples = voices.end() - std::min(voices.end(), voices.begin());
+    return ok();
+  }
+
+  Result Engine::sample_file(BufferId buffer, const char *filename, bigint_t buffer_start_ms, bigint_t sample_start_ms, bigint_t duration_ms) {
+    Trace::Scope trace("sample_file");
+    Result settled = settle(std::vector<BufferId>{buffer});
+    if (!settled.ok()) {
+      return settled;
+    }
+    std::shared_ptr<BufferSlot> slot = find_slot(buffer);
+    if (slot == nullptr) {
+      return error(Status::BufferNotFound, buffer);
+    }
+
+    std::lock_guard<std::mutex> lock(slot->lock);
+    Buffer& b = slot->samples;
+    size_t size = b.size();
+    size_t capacity = b.capacity();
+    if (!WavIO::sample_wav(filename, b, buffer_start_ms, sample_start_ms, duration_ms)) {
+      return error(Status::ReadFailed);
+    }
+    if (b.size() != size) {
+      Stats::add(Stats::Counter::BufferResizes, 1);
+      if (b.capacity() != capacity) {
+        Stats::add(Stats::Counter::BufferReallocations, 1);
+      }
+    }
+    return ok();
+  }
+
+  Result Engine::sample_buffer(BufferId target, BufferId source, bigint_t source_start_ms, bigint_t target_start_ms, bigint_t duration_ms) {
+    Trace::Scope trace("sample_buffer");
+    Result recorded;
+    if (lazy.load(std::memory_order_acquire) && record(GraphOpSpec::mix(target, source, source_start_ms, target_start_ms, duration_ms), recorded)) {
+      return recorded;
+    }
+    SlotMap slots;
+    find_slots(std::vector<BufferId>{target, source}, slots);
+    if (slots.count(target) == 0) {
+      return error(Status::BufferNotFound, target);
+    }
+    if (slots.count(source) == 0) {
+      return error(Status::BufferNotFound, source);
+    }
+
+    SlotLocks locks(slots);
+    Buffer& t = slots[target]->samples;
+    const Buffer& s = slots[source]->samples;
+    MixOp op = resolve_mix(t.size(), s.size(), source_start_ms, target_start_ms, duration_ms);
+    resize_buffer(t, op.target_size);
+    apply_mix(t, s, op, 0, op.target_size);
+    trace.samples = op.frames * 2;
+    return ok();
+  }
+
+  Result Engine::dump_buffer(BufferId buffer, const char *filename) const {
+    Trace::Scope trace("dump_buffer");
+    Result settled = settle(std::vector<BufferId>{buffer});
+    if (!settled.ok()) {
+      return settled;
+    }
+    std::shared_ptr<BufferSlot> slot = find_slot(buffer);
+    if (slot == nullptr) {
+      return error(Status::BufferNotFound, buffer);
+    }
+    std::lock_guard<std::mutex> lock(slot->lock);
+    if (!WavIO::write_wav(filename, slot->samples)) {
+      return error(Status::WriteFailed);
+    }
+    return ok();
+  }
+
+  Result Engine::set_samples(BufferId buffer, const uint16_t *samples, size_t count) {
+    Result settled = settle(std::vector<BufferId>{buffer});
+    if (!settled.ok()) {
+      return settled;
+    }
+    std::shared_ptr<BufferSlot> slot = find_slot(buffer);
+    if (slot == nullptr) {
+      return error(Status::BufferNotFound, buffer);
+    }
+    std::lock_guard<std::mutex> lock(slot->lock);
+    resize_buffer(slot->samples, count);
+    if (count > 0) {
+      std::memcpy(&slot->samples[0], samples, count * sizeof(uint16_t));
+    }
+    return ok();
+  }
+
+  Result Engine::clear_buffer(BufferId buffer) {
+    Result settled = settle(std::vector<BufferId>{buffer});
+    if (!settled.ok()) {
+      return settled;
+    }
+    std::shared_ptr<BufferSlot> slot = find_slot(buffer);
+    if (slot == nullptr) {
+      return error(Status::BufferNotFound, buffer);
+    }
+    std::lock_guard<std::mutex> lock(slot->lock);
+    // Keeps the capacity, so the storage can be recycled for new audio
+    slot->samples.clear();
+    return ok();
+  }
+
+  Result Engine::render_graph(const std::vector<GraphOpSpec>& ops, size_t tile_frames) {
+    Trace::Scope trace("render_graph");
+    if (tile_frames == 0) {
+      return error(Status::InvalidLength);
+    }
+
+    // Operations recorded in lazy mode come first
+    std::vector<BufferId> ids;
+    for (auto& op : ops) {
+      ids.push_back(op.target);
+      if (op.kind == GraphOpKind::SampleBuffer) {
+        ids.push_back(op.source);
+      }
+    }
+    Result result = settle(ids);
+    if (!result.ok()) {
+      return result;
+    }
+
+    size_t samples = 0;
+    result = run_graph(ops, tile_frames, samples);
+    trace.samples = samples;
+    return result;
+  }
+
+  Result Engine::stream_graph(const std::vector<GraphOpSpec>& ops, BufferId output, size_t block_frames, size_t slots, std::unique_ptr<Stream>& stream) const {
+    if (block_frames == 0 || slots == 0) {
+      return error(Status::InvalidLength);
+    }
+
+    std::unique_ptr<StreamState> st(new StreamState(block_frames * 2, slots));
+    st->output = output;
+    BufferStore& store = st->store;
+    Result result = st->graph.resolve(ops, [&](BufferId buffer) { return &store[buffer]; }, tables, notes);
+    if (!result.ok()) {
+      return result;
+    }
+    return start_stream(std::move(st), stream);
+  }
+
+  Result Engine::stream_buffer(BufferId buffer, size_t block_frames, size_t slots, std::unique_ptr<Stream>& stream) const {
+    if (block_frames == 0 || slots == 0) {
+      return error(Status::InvalidLength);
+    }
+    std::shared_ptr<BufferSlot> slot = find_slot(buffer);
+    if (slot == nullptr) {
+      return error(Status::BufferNotFound, buffer);
+    }
+    Result settled = settle(std::vector<BufferId>{buffer});
+    if (!settled.ok()) {
+      return settled;
+    }
+
+    // The stream works from a snapshot, so the buffer stays free to change while it is consumed
+    std::unique_ptr<StreamState> st(new StreamState(block_frames * 2, slots));
+    {
+      std::lock_guard<std::mutex> lock(slot->lock);
+      st->store[0] = slot->samples;
+    }
+    return start_stream(std::move(st), stream);
+  }
+
+  Result Engine::set_lazy(bool enabled, size_t tile_frames) {
+    if (tile_frames == 0) {
+      return error(Status::InvalidLength);
+    }
+    std::lock_guard<std::mutex> lock(pending_lock);
+    Result result = enabled ? ok() : settle_locked(nullptr);
+    lazy_tile_frames = tile_frames;
+    lazy.store(enabled, std::memory_order_release);
+    return result;
+  }
+
+  bool Engine::is_lazy() const {
+    return lazy.load(std::memory_order_acquire);
+  }
+
+  Result Engine::flush(BufferId buffer) {
+    if (find_slot(buffer) == nullptr) {
+      return error(Status::BufferNotFound, buffer);
+    }
+    return settle(std::vector<BufferId>{buffer});
+  }
+
+  Result Engine::flush() {
+    std::lock_guard<std::mutex> lock(pending_lock);
+    return settle_locked(nullptr);
+  }
+
+  int Engine::register_wavetable(const std::vector<double>& cycle) {
+    return tables.add(cycle);
+  }
+
+  void Engine::set_note_cache_limit(size_t bytes) {
+    notes->set_limit(bytes);
+  }
+
+  size_t Engine::note_cache_bytes() const {
+    return notes->bytes();
+  }
+}
@@ -0,0 +1,229 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension
+* Copyright 2020 Patrick Worthey
+* Source: https://github.com/ptrick/synther
+* LICENSE: MIT
+* See LICENSE and README.md files for more information.
+* *******************************************************
+*/
+
+#ifndef SYNTHER_ENGINE_H
+#define SYNTHER_ENGINE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include "FM.h"
+#include "NoteCache.h"
+#include "Sequencer.h"
+#include "Synth.h"
+#include "Wavetable.h"
+
+// The rendering engine of the synther_core library: a registry of audio buffers and the operations
+// on them. The Python module is a thin binding over it, and C++ programs can link the library and
+// use it directly:
+//
+//   Synth::Engine engine;
+//   Synth::BufferId song = engine.create_buffer();
+//   engine.produce_wave(song, 0, 10, 500, 10, 440.0, 8000.0, static_cast<int>(Synth::WaveType::Sine));
+//   engine.dump_buffer(song, "song.wav");
+//
+// An engine can be used from any number of threads at once. Each buffer has a lock of its own, so
+// calls on distinct buffers only meet briefly in the registry, and calls on one buffer take turns.
+// Calls touching several buffers lock them in order of id. Streams render on threads of their own,
+// into buffers of their own.
+namespace Synth {
+  typedef bigint_t BufferId;
+  typedef std::vector<uint16_t> Buffer; // Interleaved stereo samples at 44.1 kHz
+
+  enum class Status : int {
+    Ok               = 0,
+    BufferNotFound   = 1,
+    WaveTypeNotFound = 2,
+    ReadFailed       = 3,
+    WriteFailed      = 4,
+    InvalidLength    = 5,
+    GraphOpNotFound  = 6,
+    ThreadFailed     = 7,
+    InvalidOperator  = 8
+  };
+
+  // The outcome of an engine call. With BufferNotFound, buffer is the one that was missing.
+  struct Result {
+    Status status;
+    BufferId buffer;
+
+    bool ok() const { return status == Status::Ok; }
+  };
+
+  enum class GraphOpKind : int {
+    ProduceWave  = 0,
+    SampleFile   = 1,
+    SampleBuffer = 2,
+    RenderSequence = 3
+  };
+
+  // One operation of a render graph, with the same arguments as the matching Engine call
+  struct GraphOpSpec {
+    GraphOpKind kind;
+    BufferId target;
+    BufferId source;
+    std::string filename;
+    bigint_t start_ms;        // Wave attack start, file or mix start in the target
+    bigint_t source_start_ms; // Start within the file or source buffer
+    bigint_t attack_ms;
+    bigint_t sustain_ms;
+    bigint_t decay_ms;
+    bigint_t duration_ms;
+    double freq_hz;
+    double amp;
+    int wave_type;
+    std::shared_ptr<const Score> score;
+
+    static GraphOpSpec wave(BufferId buffer, bigint_t attack_start_ms, bigint_t attack_ms, bigint_t sustain_ms, bigint_t decay_ms, double freq_hz, double amp, int wave_type);
+    static GraphOpSpec file(BufferId buffer, const std::string& filename, bigint_t buffer_start_ms, bigint_t sample_start_ms, bigint_t duration_ms);
+    static GraphOpSpec mix(BufferId target, BufferId source, bigint_t source_start_ms, bigint_t target_start_ms, bigint_t duration_ms);
+    static GraphOpSpec sequence(BufferId buffer, std::shared_ptr<const Score> score, bigint_t start_ms);
+  };
+
+  struct StreamState;
+  struct BufferSlot;
+
+  // A render running on a background thread, handed over one block of samples at a time. Safe to
+  // call from any thread, but a block is only valid until the next call to next() from any of them.
+  class Stream {
+   public:
+    explicit Stream(std::unique_ptr<StreamState> state);
+    ~Stream();
+
+    Stream(const Stream&) = delete;
+    Stream& operator=(const Stream&) = delete;
+
+    // Waits for the next block. It stays valid until the next call. Returns false once the
+    // render is over, has failed (see failed()), or the stream is closed.
+    bool next(const uint16_t *&data, size_t& samples);
+
+    // Stops the render and waits for its thread to exit
+    void close();
+
+    bool failed() const;
+
+   private:
+    std::unique_ptr<StreamState> state;
+    std::mutex consumer; // Guards holding and the consumer side of the ring
+    std::mutex closer;
+    bool holding;
+  };
+
+  class Engine {
+   public:
+    Engine();
+    ~Engine();
+
+    Engine(const Engine&) = delete;
+    Engine& operator=(const Engine&) = delete;
+
+    BufferId create_buffer();
+    Result free_buffer(BufferId buffer);
+
+    // Sets count to the number of samples in a buffer, and copies them to out if they fit in capacity
+    Result copy_samples(BufferId buffer, uint16_t *out, size_t capacity, size_t& count) const;
+
+    // The bytes of memory allocated for a buffer
+    Result capacity_bytes(BufferId buffer, size_t& bytes) const;
+
+    size_t buffer_count() const;
+    // The bytes of audio held by all buffers, and the bytes of memory allocated for them
+    void memory_usage(size_t& bytes, size_t& capacity_bytes) const;
+
+    Result produce_wave(BufferId buffer, bigint_t attack_start_ms, bigint_t attack_ms, bigint_t sustain_ms, bigint_t decay_ms, double freq_hz, double amp, int wave_type);
+    // Renders a bank of voices with one envelope, summing them before they are added to the buffer
+    Result produce_bank(BufferId buffer, bigint_t attack_start_ms, bigint_t attack_ms, bigint_t sustain_ms, bigint_t decay_ms, const std::vector<BankVoice>& voices, double amp, int wave_type);
+    // Renders an FM note (see FM.h). InvalidOperator if an operator is modulated by itself or an earlier one.
+    Result produce_fm(BufferId buffer, bigint_t start_ms, double freq_hz, const std::vector<FMOperator>& operators, double amp);
+    // Plays a score (see Sequencer.h) from start_ms
+    Result render_sequence(BufferId buffer, std::shared_ptr<const Score> score, bigint_t start_ms);
+    Result sample_file(BufferId buffer, const char *filename, bigint_t buffer_start_ms, bigint_t sample_start_ms, bigint_t duration_ms);
+    Result sample_buffer(BufferId target, BufferId source, bigint_t source_start_ms, bigint_t target_start_ms, bigint_t duration_ms);
+    Result dump_buffer(BufferId buffer, const char *filename) const;
+
+    // Replaces the contents of a buffer
+    Result set_samples(BufferId buffer, const uint16_t *samples, size_t count);
+
+    // Empties a buffer while keeping its memory allocated for reuse
+    Result clear_buffer(BufferId buffer);
+
+    // Runs the operations one cache-sized tile at a time. Leaves every buffer untouched if an
+    // operation is invalid.
+    Result render_graph(const std::vector<GraphOpSpec>& ops, size_t tile_frames);
+
+    // Renders the operations on a background thread, into private buffers starting out empty,
+    // and streams the output buffer in blocks
+    Result stream_graph(const std::vector<GraphOpSpec>& ops, BufferId output, size_t block_frames, size_t slots, std::unique_ptr<Stream>& stream) const;
+
+    // Streams a snapshot of a buffer in blocks
+    Result stream_buffer(BufferId buffer, size_t block_frames, size_t slots, std::unique_ptr<Stream>& stream) const;
+
+    // In lazy mode, produce_wave() and sample_buffer() only record the operation. Recorded operations
+    // run once a buffer they touch is needed (read, dumped, replaced, freed, ...) or flushed, fused
+    // into one render_graph() pass of tile_frames tiles. Turning lazy mode off flushes everything.
+    Result set_lazy(bool enabled, size_t tile_frames);
+    bool is_lazy() const;
+
+    // Runs the recorded operations a buffer depends on, and those that depend on its current state
+    Result flush(BufferId buffer);
+    // Runs every recorded operation
+    Result flush();
+
+    // Registers one cycle of a wave as a wave type of this engine's own, or returns -1 (see Wavetable.h)
+    int register_wavetable(const std::vector<double>& cycle);
+    // The band-limited and registered wavetables the engine's wave types play
+    const WavetableRegistry& wavetables() const { return tables; }
+
+    // Caps the memory kept for rendered notes that repeat (see NoteCache.h). 0 turns the cache off.
+    void set_note_cache_limit(size_t bytes);
+    // The bytes of samples held by the note cache
+    size_t note_cache_bytes() const;
+
+   private:
+    typedef std::map<BufferId, std::shared_ptr<BufferSlot>> SlotMap;
+
+    // The slots of the buffers that exist among ids. Slots stay valid even if freed meanwhile.
+    void find_slots(const std::vector<BufferId>& ids, SlotMap& slots) const;
+    std::shared_ptr<BufferSlot> find_slot(BufferId buffer) const;
+
+    // Records an operation if in lazy mode, and returns whether it was
+    bool record(const GraphOpSpec& op, Result& result);
+    // Runs the recorded operations that touch any of the buffers, with everything they depend on
+    Result settle(const std::vector<BufferId>& ids) const;
+    // The same, with pending_lock held. Runs every recorded operation if ids is NULL.
+    Result settle_locked(const std::vector<BufferId> *ids) const;
+    Result run_graph(const std::vector<GraphOpSpec>& ops, size_t tile_frames, size_t& samples) const;
+
+    mutable std::shared_timed_mutex registry; // Guards last_id and buffers, but not their contents
+    BufferId last_id = 0;
+    SlotMap buffers;
+
+    // Recorded operations don't change what a buffer holds as far as callers can tell, so running
+    // them is fair game for const calls
+    mutable std::mutex pending_lock; // Guards pending and lazy_tile_frames, and orders flushes
+    mutable std::vector<GraphOpSpec> pending;
+    std::atomic<bool> lazy{false};
+    size_t lazy_tile_frames = 4096;
+
+    // Shared with the graphs of running streams, which may outlive the engine
+    std::shared_ptr<NoteCache> notes;
+    // Graphs hold on to the tables they play, so streams don't need the registry to outlive them
+    WavetableRegistry tables;
+  };
+}
+
+#endif
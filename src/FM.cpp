@@ -0,0 +1,164 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension
+* Copyright 2020 Patrick Worthey
+* Source: https://github.com/ptrick/synther
+* LICENSE: MIT
+* See LICENSE and README.md files for more information.
+* *******************************************************
+*/
+
+#include "FM.h"
+#include "Stats.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace Synth {
+  namespace {
+    constexpr double two_pi = 6.283185307179586476925286766559;
+
+    // Frames rendered per block, small enough for every operator's block to stay in L1
+    constexpr size_t block_frames = 256;
+
+    // One cycle of a sine, read with linear interpolation, which is within 1e-6 of sin()
+    constexpr size_t sine_samples = 4096;
+
+    const std::vector<double>& sine_table() {
+      static const std::vector<double> table = [] {
+        std::vector<double> t(sine_samples + 1);
+        for (size_t i = 0; i <= sine_samples; ++i) {
+          t[i] = std::sin(two_pi * i / sine_samples);
+        }
+        return t;
+      }();
+      return table;
+    }
+
+    // The sine at a phase in cycles, of any sign or size
+    double sine(const double *table, double phase) {
+      double position = (phase - std::floor(phase)) * sine_samples;
+      size_t i = static_cast<size_t>(position);
+      double t = position - i;
+      return table[i] + (table[i + 1] - table[i]) * t;
+    }
+
+    std::vector<bool> find_carriers(const std::vector<FMOperator>& operators) {
+      std::vector<bool> carriers(operators.size(), true);
+      for (auto& op : operators) {
+        for (size_t m : op.modulators) {
+          carriers[m] = false;
+        }
+      }
+      return carriers;
+    }
+  }
+
+  bool valid_fm_operators(const std::vector<FMOperator>& operators) {
+    for (size_t i = 0; i < operators.size(); ++i) {
+      for (size_t m : operators[i].modulators) {
+        if (m <= i || m >= operators.size()) {
+          return false;
+        }
+      }
+    }
+    return !operators.empty();
+  }
+
+  size_t fm_end_index(bigint_t start_ms, const std::vector<FMOperator>& operators) {
+    std::vector<bool> carriers = find_carriers(operators);
+    size_t end = ms_to_buffer_index(start_ms);
+    for (size_t i = 0; i < operators.size(); ++i) {
+      if (carriers[i]) {
+        const FMOperator& op = operators[i];
+        end = std::max(end, ms_to_buffer_index(start_ms + op.attack_ms + op.sustain_ms + op.decay_ms));
+      }
+    }
+    return end;
+  }
+
+  void render_fm(std::vector<uint16_t>& b, bigint_t start_ms, double freq_hz, const std::vector<FMOperator>& operators, double amp) {
+    const double *table = sine_table().data();
+    const size_t count = operators.size();
+    const size_t first = ms_to_buffer_index(start_ms);
+    const size_t last = fm_end_index(start_ms, operators);
+    if (first >= last) {
+      return;
+    }
+    Stats::add_wave_samples(static_cast<int>(WaveType::Sine), (last - first) * count);
+
+    std::vector<bool> carriers = find_carriers(operators);
+    std::vector<WaveOp> envelopes(count);
+    std::vector<double> phase(count, 0.0);     // In cycles
+    std::vector<double> increment(count);      // Cycles per frame
+    std::vector<double> history(count * 2, 0.0); // The last two outputs of each operator, for feedback
+    for (size_t j = 0; j < count; ++j) {
+      const FMOperator& op = operators[j];
+      envelopes[j] = make_wave_op(start_ms, op.attack_ms, op.sustain_ms, op.decay_ms, 0.0, op.level, 0);
+      double frequency = freq_hz * op.ratio / 44100.0;
+      increment[j] = frequency - std::floor(frequency);
+    }
+
+    // Each operator's output over the block, in radians of phase for the operators it modulates
+    std::vector<double> outputs(count * block_frames);
+    std::vector<double> shift(block_frames);
+    double sums[block_frames];
+    for (size_t block = first; block < last; block += block_frames * 2) {
+      size_t frames = std::min(block_frames, (last - block + 1) / 2);
+      std::fill(sums, sums + frames, 0.0);
+
+      for (size_t j = count; j-- > 0;) {
+        const FMOperator& op = operators[j];
+        const WaveOp& env = envelopes[j];
+        double *out = &outputs[j * block_frames];
+        if (block >= env.end_index) {
+          std::fill(out, out + frames, 0.0);
+          continue;
+        }
+
+        std::fill(shift.begin(), shift.begin() + frames, 0.0);
+        for (size_t m : op.modulators) {
+          const double *in = &outputs[m * block_frames];
+          for (size_t i = 0; i < frames; ++i) {
+            shift[i] += in[i];
+          }
+        }
+
+        double p = phase[j];
+        if (op.feedback == 0.0) {
+          for (size_t i = 0; i < frames; ++i) {
+            out[i] = env.amp * envelope(env, block + 2 * i) * sine(table, p + shift[i] / two_pi);
+            p += increment[j];
+          }
+        }
+        else {
+          double y1 = history[2 * j];
+          double y2 = history[2 * j + 1];
+          for (size_t i = 0; i < frames; ++i) {
+            double y = env.amp * envelope(env, block + 2 * i) * sine(table, p + (shift[i] + op.feedback * (y1 + y2) / 2.0) / two_pi);
+            out[i] = y;
+            y2 = y1;
+            y1 = y;
+            p += increment[j];
+          }
+          history[2 * j] = y1;
+          history[2 * j + 1] = y2;
+        }
+        phase[j] = p - std::floor(p);
+
+        if (carriers[j]) {
+          for (size_t i = 0; i < frames; ++i) {
+            sums[i] += out[i];
+          }
+        }
+      }
+
+      for (size_t i = 0; i < frames; ++i) {
+        size_t n = block + 2 * i;
+        uint16_t value = static_cast<uint16_t>(static_cast<int32_t>(amp * sums[i]));
+        b[n] += value;
+        b[n+1] += value;
+      }
+    }
+  }
+}
@@ -0,0 +1,48 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension
+* Copyright 2020 Patrick Worthey
+* Source: https://github.com/ptrick/synther
+* LICENSE: MIT
+* See LICENSE and README.md files for more information.
+* *******************************************************
+*/
+
+#ifndef SYNTHER_FM_H
+#define SYNTHER_FM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Synth.h"
+
+// Frequency modulation synthesis, in the phase modulation form: a note is a graph of sine operators,
+// each one's output shifting the phase of the operators it modulates. Operators that modulate no
+// other operator are carriers, and the note is the sum of their outputs.
+//
+// Modulators must come after the operators they modulate, which is what keeps a graph free of
+// cycles (besides an operator's feedback onto itself). Notes render a block of frames at a time:
+// every operator fills the block, last to first, and the carriers' sum is added to the buffer once.
+namespace Synth {
+  struct FMOperator {
+    double ratio;          // Of the note's frequency
+    double level;          // The peak output: an amplitude for carriers, a modulation index (in radians) for modulators
+    bigint_t attack_ms;    // The operator's envelope, from the start of the note
+    bigint_t sustain_ms;
+    bigint_t decay_ms;
+    double feedback;       // The operator's own last output (averaged over two samples) added to its phase, scaled
+    std::vector<size_t> modulators; // Indices of the operators modulating this one
+  };
+
+  // Whether every modulator of every operator is a later operator
+  bool valid_fm_operators(const std::vector<FMOperator>& operators);
+
+  // The buffer index where the last carrier ends
+  size_t fm_end_index(bigint_t start_ms, const std::vector<FMOperator>& operators);
+
+  // Adds a note to the buffer, which must already be large enough. Carriers' outputs are scaled by amp.
+  void render_fm(std::vector<uint16_t>& b, bigint_t start_ms, double freq_hz, const std::vector<FMOperator>& operators, double amp);
+}
+
+#endif
@@ -0,0 +1,127 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension
+* Copyright 2020 Patrick Worthey
+* Source: https://github.com/ptrick/synther
+* LICENSE: MIT
+* See LICENSE and README.md files for more information.
+* *******************************************************
+*/
+
+#include "NoteCache.h"
+#include "Stats.h"
+
+#include <cstring>
+
+namespace Synth {
+  namespace {
+    // Bounds the memory spent remembering notes asked for once
+    const size_t max_seen = 1 << 16;
+
+    uint64_t word(double value) {
+      uint64_t bits;
+      std::memcpy(&bits, &value, sizeof(bits));
+      return bits;
+    }
+  }
+
+  constexpr size_t NoteCache::default_limit;
+
+  bool NoteCache::Key::operator==(const Key& other) const {
+    return std::memcmp(words, other.words, sizeof(words)) == 0;
+  }
+
+  size_t NoteCache::KeyHash::operator()(const Key& key) const {
+    return static_cast<size_t>(hash64(key.words, sizeof(key.words), 0));
+  }
+
+  NoteCache::NoteCache(size_t limit_bytes) : limit(limit_bytes) {}
+
+  NoteSamples NoteCache::find(const WaveOp& op) {
+    size_t period = wave_period(op.wave_type, op.freq_hz);
+    if (period == 0 || op.end_index <= op.start_index) {
+      return nullptr;
+    }
+    Key key{{
+      static_cast<uint64_t>(op.wave_type),
+      word(op.freq_hz),
+      word(op.amp),
+      op.attack_end_index - op.start_index,
+      op.sustain_end_index - op.start_index,
+      op.end_index - op.start_index,
+      (op.start_index / 2) % period
+    }};
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (limit == 0) {
+        return nullptr;
+      }
+      auto it = index.find(key);
+      if (it != index.end()) {
+        entries.splice(entries.begin(), entries, it->second);
+        Stats::add(Stats::Counter::NoteCacheHits, 1);
+        return it->second->samples;
+      }
+      Stats::add(Stats::Counter::NoteCacheMisses, 1);
+      uint64_t hash = KeyHash()(key);
+      if (seen.count(hash) == 0) {
+        if (seen.size() >= max_seen) {
+          seen.clear();
+        }
+        seen.insert(hash);
+        return nullptr;
+      }
+      seen.erase(hash);
+    }
+
+    // Rendered without the lock, so a long note doesn't hold up other threads
+    std::shared_ptr<std::vector<uint16_t>> samples = std::make_shared<std::vector<uint16_t>>();
+    render_note(op, *samples);
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (index.count(key) == 0) {
+      entries.push_front(Entry{key, samples});
+      index[key] = entries.begin();
+      held += samples->size() * sizeof(uint16_t);
+      evict_locked();
+    }
+    return samples;
+  }
+
+  void NoteCache::evict_locked() {
+    while (held > limit && !entries.empty()) {
+      const Entry& last = entries.back();
+      held -= last.samples->size() * sizeof(uint16_t);
+      index.erase(last.key);
+      entries.pop_back();
+    }
+  }
+
+  void NoteCache::set_limit(size_t limit_bytes) {
+    std::lock_guard<std::mutex> guard(lock);
+    limit = limit_bytes;
+    evict_locked();
+    if (limit == 0) {
+      seen.clear();
+    }
+  }
+
+  size_t NoteCache::bytes() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return held;
+  }
+
+  size_t NoteCache::size() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return entries.size();
+  }
+
+  void NoteCache::clear() {
+    std::lock_guard<std::mutex> guard(lock);
+    entries.clear();
+    index.clear();
+    seen.clear();
+    held = 0;
+  }
+}
@@ -0,0 +1,87 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension
+* Copyright 2020 Patrick Worthey
+* Source: https://github.com/ptrick/synther
+* LICENSE: MIT
+* See LICENSE and README.md files for more information.
+* *******************************************************
+*/
+
+#ifndef SYNTHER_NOTE_CACHE_H
+#define SYNTHER_NOTE_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "Synth.h"
+
+// Rendered notes, kept for scores that play the same note over and over. A repeat is mixed in from
+// the cached copy instead of being synthesized again.
+//
+// Two waves render the same samples if they have the same type, frequency, amplitude and envelope
+// lengths, and start at the same point of the wave's period (see wave_period()): the phase of a wave
+// depends on where in the buffer it starts, not just on its own parameters. Waves without an exact
+// period, like noise, are never cached.
+//
+// A note is only kept the second time it is asked for, so notes played once don't churn the cache.
+// The least recently used notes are dropped to stay under the memory limit.
+namespace Synth {
+  typedef std::shared_ptr<const std::vector<uint16_t>> NoteSamples;
+
+  class NoteCache {
+   public:
+    static constexpr size_t default_limit = 64 << 20;
+
+    explicit NoteCache(size_t limit_bytes = default_limit);
+
+    NoteCache(const NoteCache&) = delete;
+    NoteCache& operator=(const NoteCache&) = delete;
+
+    // The samples of a wave as render_note() gives them, or NULL if the wave should be rendered
+    // directly: it can't be cached, or hasn't been asked for before
+    NoteSamples find(const WaveOp& op);
+
+    // Drops notes until the cache fits in limit_bytes. A limit of 0 turns the cache off.
+    void set_limit(size_t limit_bytes);
+
+    // The bytes of samples held
+    size_t bytes() const;
+    size_t size() const;
+
+    void clear();
+
+   private:
+    struct Key {
+      uint64_t words[7];
+
+      bool operator==(const Key& other) const;
+    };
+
+    struct KeyHash {
+      size_t operator()(const Key& key) const;
+    };
+
+    struct Entry {
+      Key key;
+      NoteSamples samples;
+    };
+
+    void evict_locked();
+
+    mutable std::mutex lock;
+    size_t limit;
+    size_t held = 0;
+    std::list<Entry> entries; // Most recently used first
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+    std::unordered_set<uint64_t> seen; // Hashes of the keys asked for once
+  };
+}
+
+#endif
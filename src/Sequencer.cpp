@@ -0,0 +1,331 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension
+* Copyright 2020 Patrick Worthey
+* Source: https://github.com/ptrick/synther
+* LICENSE: MIT
+* See LICENSE and README.md files for more information.
+* *******************************************************
+*/
+
+#include "Sequencer.h"
+#include "Stats.h"
+#include "Wavetable.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace Synth {
+  namespace {
+    constexpr double two_pi = 6.283185307179586476925286766559;
+
+    // Frames summed per block, so the buffer is written once per block rather than once per voice
+    constexpr size_t block_frames = 256;
+
+    double fraction(double x) {
+      return x - std::floor(x);
+    }
+
+    uint64_t word(double value) {
+      uint64_t bits;
+      std::memcpy(&bits, &value, sizeof(bits));
+      return bits;
+    }
+
+    // Noise is hashed from the note and the frame, so it doesn't depend on how the score is split into
+    // ranges. Uniform in [-1, 1).
+    double noise_at(uint64_t key, uint64_t frame) {
+      uint64_t x = key + frame * 0x9e3779b97f4a7c15ULL;
+      x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+      x ^= x >> 31;
+      return static_cast<double>(x >> 11) * (2.0 / 9007199254740992.0) - 1.0;
+    }
+
+    // Adds count frames of a voice to sums, with its gain ramping linearly
+    template <typename Shape>
+    void add_segment(double *sums, size_t count, double phase, double increment, double gain, double slope, Shape shape) {
+      for (size_t i = 0; i < count; ++i) {
+        sums[i] += gain * shape(i, phase);
+        gain += slope;
+        phase += increment;
+        phase -= phase >= 1.0 ? 1.0 : 0.0;
+      }
+    }
+
+    // Sines rotate a pair, starting from the exact phase every segment, like the sines of a bank
+    void add_sine_segment(double *sums, size_t count, double phase, double increment, double gain, double slope) {
+      double c = std::cos(two_pi * phase);
+      double s = std::sin(two_pi * phase);
+      double cs = std::cos(two_pi * increment);
+      double ss = std::sin(two_pi * increment);
+      for (size_t i = 0; i < count; ++i) {
+        sums[i] += gain * s;
+        gain += slope;
+        double rotated = c * cs - s * ss;
+        s = s * cs + c * ss;
+        c = rotated;
+      }
+    }
+  }
+
+  bool valid_instrument(const Instrument& instrument, const WavetableRegistry& tables) {
+    return tables.valid(instrument.wave_type) && instrument.attack_ms >= 0 && instrument.release_ms >= 0;
+  }
+
+  bool valid_note_events(const std::vector<NoteEvent>& events, size_t instruments) {
+    bigint_t time_ms = 0;
+    for (const NoteEvent& e : events) {
+      if (e.time_ms < time_ms || (e.kind != NoteEventKind::NoteOn && e.kind != NoteEventKind::NoteOff) ||
+          e.note < 0 || e.note > 127 || e.instrument < 0 || static_cast<size_t>(e.instrument) >= instruments) {
+        return false;
+      }
+      time_ms = e.time_ms;
+    }
+    return true;
+  }
+
+  Score::Score(size_t voices, std::vector<Instrument> instruments, std::vector<NoteEvent> events)
+    : voice_count(std::max<size_t>(voices, 1)), instrument_list(std::move(instruments)), event_list(std::move(events)) {
+    std::vector<uint64_t> words;
+    words.reserve(1 + instrument_list.size() * 5 + event_list.size() * 5);
+    words.push_back(voice_count);
+    for (const Instrument& i : instrument_list) {
+      longest_release_ms = std::max(longest_release_ms, i.release_ms);
+      words.insert(words.end(), {static_cast<uint64_t>(i.wave_type), static_cast<uint64_t>(i.attack_ms), static_cast<uint64_t>(i.release_ms),
+        word(i.amp), i.table_fingerprint});
+    }
+    for (const NoteEvent& e : event_list) {
+      words.insert(words.end(), {static_cast<uint64_t>(e.time_ms), static_cast<uint64_t>(e.kind), static_cast<uint64_t>(e.note),
+        word(e.velocity), static_cast<uint64_t>(e.instrument)});
+    }
+    digest = hash64(words.data(), words.size() * sizeof(uint64_t), 0);
+  }
+
+  bigint_t Score::duration_ms() const {
+    return event_list.empty() ? 0 : event_list.back().time_ms + longest_release_ms;
+  }
+
+  size_t Score::end_index(bigint_t start_ms) const {
+    // Every note falls silent by the longest release after the last event
+    return event_list.empty() ? 0 : ms_to_buffer_index(start_ms + event_list.back().time_ms) + ms_to_buffer_index(longest_release_ms);
+  }
+
+  VoicePool::VoicePool(std::shared_ptr<const Score> played, bigint_t start_ms)
+    : score(std::move(played)), start_ms(start_ms), voices(score->voices()) {
+    start_index = score->events().empty() ? 0 : event_index(0);
+    end_index = score->end_index(start_ms);
+    for (const Instrument& i : score->instruments()) {
+      attack_indices.push_back(ms_to_buffer_index(i.attack_ms));
+      release_indices.push_back(ms_to_buffer_index(i.release_ms));
+      tables.push_back(i.table.get());
+    }
+  }
+
+  size_t VoicePool::event_index(size_t event) const {
+    return ms_to_buffer_index(start_ms + score->events()[event].time_ms);
+  }
+
+  void VoicePool::seek(size_t n) {
+    // Which voice plays which note depends on every event before, but nothing else does
+    std::fill(voices.begin(), voices.end(), Voice());
+    next_event = 0;
+    while (next_event < score->events().size() && event_index(next_event) < n) {
+      apply(next_event++);
+    }
+    position = n;
+  }
+
+  void VoicePool::apply(size_t event) {
+    const std::vector<NoteEvent>& events = score->events();
+    const NoteEvent& e = events[event];
+    size_t n = event_index(event);
+    if (e.kind == NoteEventKind::NoteOn) {
+      // The first free voice, or if every voice is busy, the one that started first
+      Voice *voice = &voices[0];
+      for (Voice& v : voices) {
+        if (v.silent <= n) {
+          voice = &v;
+          break;
+        }
+        if (v.on < voice->on) {
+          voice = &v;
+        }
+      }
+      const Instrument& instrument = score->instruments()[e.instrument];
+      double freq_hz = 440.0 * std::pow(2.0, (e.note - 69) / 12.0);
+      const Wavetable *table = tables[e.instrument];
+      voice->on = n;
+      voice->attack_end = n + attack_indices[e.instrument];
+      voice->off = SIZE_MAX;
+      voice->silent = SIZE_MAX;
+      voice->increment = fraction(freq_hz / 44100.0);
+      voice->amp = instrument.amp * e.velocity;
+      voice->release_level = 0.0;
+      voice->level = table != nullptr ? table->level(freq_hz) : nullptr;
+      voice->wave_type = static_cast<WaveType>(instrument.wave_type);
+      voice->note = e.note;
+      voice->instrument = e.instrument;
+    }
+    else {
+      for (Voice& v : voices) {
+        if (v.note == e.note && v.instrument == e.instrument && v.off == SIZE_MAX && v.silent > n) {
+          release(v, n);
+        }
+      }
+    }
+
+    if (event + 1 == events.size()) {
+      for (Voice& v : voices) {
+        if (v.off == SIZE_MAX && v.silent > n) {
+          release(v, n);
+        }
+      }
+    }
+  }
+
+  void VoicePool::release(Voice& voice, size_t n) {
+    voice.release_level = n < voice.attack_end ? static_cast<double>((n - voice.on) / 2) / ((voice.attack_end - voice.on) / 2) : 1.0;
+    voice.off = n;
+    voice.silent = n + release_indices[voice.instrument];
+  }
+
+  void VoicePool::add_voice(Voice& v, size_t n, size_t stop, double *sums) {
+    // The envelope is linear between its corners, so a voice renders in segments between them
+    while (n < stop && n < v.silent) {
+      size_t segment_end = stop;
+      double level;
+      double slope;
+      if (n < v.off && n < v.attack_end) {
+        double frames = static_cast<double>((v.attack_end - v.on) / 2);
+        segment_end = std::min(segment_end, v.attack_end);
+        level = static_cast<double>((n - v.on) / 2) / frames;
+        slope = 1.0 / frames;
+      }
+      else if (n < v.off) {
+        level = 1.0;
+        slope = 0.0;
+      }
+      else {
+        double frames = static_cast<double>((v.silent - v.off) / 2);
+        segment_end = std::min(segment_end, v.silent);
+        level = v.release_level * static_cast<double>((v.silent - n) / 2) / frames;
+        slope = -v.release_level / frames;
+      }
+
+      size_t count = (segment_end - n + 1) / 2;
+      size_t frame = (n - v.on) / 2;
+      double phase = fraction(v.increment * frame);
+      double gain = v.amp * level;
+      double step = v.amp * slope;
+      switch (v.wave_type) {
+        case WaveType::Sine:
+          add_sine_segment(sums, count, phase, v.increment, gain, step);
+          break;
+        case WaveType::Saw:
+          add_segment(sums, count, phase, v.increment, gain, step, [](size_t, double p) { return Synth::saw_shape(p); });
+          break;
+        case WaveType::Square:
+          add_segment(sums, count, phase, v.increment, gain, step, [](size_t, double p) { return Synth::square_shape(p); });
+          break;
+        case WaveType::Triangle:
+          add_segment(sums, count, phase, v.increment, gain, step, [](size_t, double p) { return Synth::triangle_shape(p); });
+          break;
+        case WaveType::Noise: {
+          uint64_t key = static_cast<uint64_t>(v.on) * 131 + static_cast<uint64_t>(v.note);
+          add_segment(sums, count, phase, v.increment, gain, step, [&](size_t i, double) { return noise_at(key, frame + i); });
+          break;
+        }
+        default: {
+          // Band-limited and registered wavetables
+          const float *level_table = v.level;
+          if (level_table != nullptr) {
+            add_segment(sums, count, phase, v.increment, gain, step, [&](size_t, double p) { return Wavetable::sample(level_table, p); });
+          }
+          break;
+        }
+      }
+      Stats::add_wave_samples(static_cast<int>(v.wave_type), count * 2);
+      sums += count;
+      n += count * 2;
+    }
+  }
+
+  void VoicePool::render(std::vector<uint16_t>& b, size_t begin, size_t end) {
+    const size_t first = std::max(begin, start_index);
+    const size_t last = std::min(end, end_index);
+    if (first >= last) {
+      return;
+    }
+    if (first != position) {
+      seek(first);
+    }
+
+    // Blocks lie between the lines of a fixed grid of buffer indices and the events, and a range renders
+    // every block it touches in full. The samples are then the same however the score is split into ranges.
+    const std::vector<NoteEvent>& events = score->events();
+    const size_t grid = block_frames * 2;
+    double sums[block_frames];
+    size_t n = first;
+    while (n < last) {
+      while (next_event < events.size() && event_index(next_event) <= n) {
+        apply(next_event++);
+      }
+      size_t line = n / grid * grid;
+      size_t block = std::max(line, event_index(next_event - 1));
+      size_t stop = std::min(line + grid, end_index);
+      if (next_event < events.size()) {
+        stop = std::min(stop, event_index(next_event));
+      }
+
+      size_t count = (stop - block + 1) / 2;
+      std::fill(sums, sums + count, 0.0);
+      for (Voice& v : voices) {
+        if (v.silent > block) {
+          add_voice(v, block, stop, sums);
+        }
+      }
+      size_t write_end = std::min(stop, last);
+      for (size_t i = (n - block) / 2; block + 2 * i < write_end; ++i) {
+        uint16_t value = static_cast<uint16_t>(static_cast<int32_t>(sums[i]));
+        b[block + 2 * i] += value;
+        b[block + 2 * i + 1] += value;
+      }
+      n = write_end;
+    }
+    position = n;
+  }
+
+  Sequencer::Sequencer(size_t voices)
+    : current(std::make_shared<const Score>(voices, std::vector<Instrument>(), std::vector<NoteEvent>())) {}
+
+  Sequencer::Sequencer(std::shared_ptr<const Score> score) : current(std::move(score)) {}
+
+  int Sequencer::add_instrument(Instrument instrument, const WavetableRegistry& tables) {
+    if (!valid_instrument(instrument, tables)) {
+      return -1;
+    }
+    instrument.table = tables.find(instrument.wave_type);
+    instrument.table_fingerprint = tables.fingerprint(instrument.wave_type);
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<Instrument> instruments = current->instruments();
+    instruments.push_back(std::move(instrument));
+    current = std::make_shared<const Score>(current->voices(), std::move(instruments), current->events());
+    return static_cast<int>(current->instruments().size() - 1);
+  }
+
+  bool Sequencer::set_events(std::vector<NoteEvent> events) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!valid_note_events(events, current->instruments().size())) {
+      return false;
+    }
+    current = std::make_shared<const Score>(current->voices(), current->instruments(), std::move(events));
+    return true;
+  }
+
+  std::shared_ptr<const Score> Sequencer::score() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return current;
+  }
+}
@@ -0,0 +1,159 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension
+* Copyright 2020 Patrick Worthey
+* Source: https://github.com/ptrick/synther
+* LICENSE: MIT
+* See LICENSE and README.md files for more information.
+* *******************************************************
+*/
+
+#ifndef SYNTHER_SEQUENCER_H
+#define SYNTHER_SEQUENCER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Synth.h"
+
+// A polyphonic sequencer: a score of note on and off events, played by instruments on a fixed pool
+// of voices. A whole score renders in one call, a block of frames at a time between events, so a
+// song of thousands of notes costs one command rather than one per note.
+//
+// A note on takes a free voice, or steals the one that started first if every voice is busy. A note
+// off releases every voice playing that note on that instrument. Notes still held when the score
+// ends (at its last event) are released there.
+namespace Synth {
+  class Wavetable;
+  class WavetableRegistry;
+
+  struct Instrument {
+    int wave_type;
+    bigint_t attack_ms;  // From silence to the note's amplitude
+    bigint_t release_ms; // From the note off back to silence
+    double amp;          // In range 0-32767, at velocity 1
+    // Of band-limited and registered wave types, found by Sequencer::add_instrument() along with the
+    // fingerprint of registered ones
+    std::shared_ptr<const Wavetable> table;
+    uint64_t table_fingerprint = 0;
+  };
+
+  enum class NoteEventKind : int {
+    NoteOn  = 0,
+    NoteOff = 1
+  };
+
+  struct NoteEvent {
+    bigint_t time_ms;
+    NoteEventKind kind;
+    int note;        // A MIDI note number, 69 being A4 at 440 hz
+    double velocity; // Scales the instrument's amplitude, usually 0-1. Unused by note offs.
+    int instrument;
+  };
+
+  // Whether an instrument's wave type is built in or registered in tables, and its times aren't negative
+  bool valid_instrument(const Instrument& instrument, const WavetableRegistry& tables);
+  // Whether the events are sorted by time, from 0 on, with notes in 0-127 and instruments below count
+  bool valid_note_events(const std::vector<NoteEvent>& events, size_t instruments);
+
+  // A score to play, which never changes once made
+  class Score {
+   public:
+    // The instruments and events must be valid
+    Score(size_t voices, std::vector<Instrument> instruments, std::vector<NoteEvent> events);
+
+    size_t voices() const { return voice_count; }
+    const std::vector<Instrument>& instruments() const { return instrument_list; }
+    const std::vector<NoteEvent>& events() const { return event_list; }
+
+    // From the start of the score to the end of the longest release after its last event
+    bigint_t duration_ms() const;
+    // The buffer index where the score, started at start_ms, falls silent
+    size_t end_index(bigint_t start_ms) const;
+
+    // A hash of everything the score sounds like. Registered wave types are hashed by their tables.
+    uint64_t fingerprint() const { return digest; }
+
+   private:
+    size_t voice_count;
+    std::vector<Instrument> instrument_list;
+    std::vector<NoteEvent> event_list;
+    bigint_t longest_release_ms = 0;
+    uint64_t digest;
+  };
+
+  // The voices playing a score, allocated up front so that rendering allocates nothing. Ranges render
+  // fastest in order, each starting where the last ended; any other range replays the events before
+  // it first, without rendering them.
+  class VoicePool {
+   public:
+    VoicePool(std::shared_ptr<const Score> score, bigint_t start_ms);
+
+    // The range of buffer indices the score plays in
+    size_t begin() const { return start_index; }
+    size_t end() const { return end_index; }
+
+    // Adds the part of the score that falls within [begin, end) to the buffer, which must already be large enough
+    void render(std::vector<uint16_t>& b, size_t begin, size_t end);
+
+   private:
+    struct Voice {
+      size_t on = 0;              // The buffer index the note started at
+      size_t attack_end = 0;
+      size_t off = SIZE_MAX;      // Where it was released, SIZE_MAX while held
+      size_t silent = 0;          // Where it falls silent, SIZE_MAX while held
+      double increment = 0.0;     // Cycles per frame
+      double amp = 0.0;
+      double release_level = 0.0; // The envelope at the note off
+      const float *level = nullptr;
+      WaveType wave_type = WaveType::Sine;
+      int note = -1;
+      int instrument = -1;
+    };
+
+    size_t event_index(size_t event) const;
+    void seek(size_t n);
+    void apply(size_t event);
+    void release(Voice& voice, size_t n);
+    void add_voice(Voice& voice, size_t n, size_t stop, double *sums);
+
+    std::shared_ptr<const Score> score;
+    bigint_t start_ms;
+    size_t start_index;
+    size_t end_index;
+    std::vector<Voice> voices;
+    // Per instrument: the lengths of its attack and release in buffer indices, and its wavetable
+    std::vector<size_t> attack_indices;
+    std::vector<size_t> release_indices;
+    std::vector<const Wavetable*> tables;
+    size_t next_event = 0;
+    size_t position = SIZE_MAX; // Where the last render ended
+  };
+
+  // A score being written. Safe to use from any number of threads: every change makes a new score,
+  // so scores already handed out (to renders, or queued on a project) are never changed under them.
+  class Sequencer {
+   public:
+    explicit Sequencer(size_t voices);
+    explicit Sequencer(std::shared_ptr<const Score> score);
+
+    Sequencer(const Sequencer&) = delete;
+    Sequencer& operator=(const Sequencer&) = delete;
+
+    // Adds an instrument, playing its wave type from tables, and returns its id, or -1 if it isn't valid
+    int add_instrument(Instrument instrument, const WavetableRegistry& tables);
+    // Replaces the events, unless they aren't valid
+    bool set_events(std::vector<NoteEvent> events);
+
+    std::shared_ptr<const Score> score() const;
+
+   private:
+    mutable std::mutex lock;
+    std::shared_ptr<const Score> current;
+  };
+}
+
+#endif
@@ -0,0 +1,119 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension                         
+* Copyright 2020 Patrick Worthey                         
+* Source: https://github.com/ptrick/synther              
+* LICENSE: MIT                                           
+* See LICENSE and README.md files for more information.  
+* *******************************************************
+*/
+
+#include "Stats.h"
+#include <atomic>
+#include <map>
+#include <utility>
+
+namespace {
+  std::atomic<uint64_t> counters[static_cast<int>(Stats::Counter::Count)];
+  std::atomic<uint64_t> wave_samples[Stats::max_wave_types];
+
+  // An open addressing table keyed by the address of the (string literal) name, which is cheaper
+  // than hashing it on every call. Names are claimed once and never released, so calls from any
+  // number of threads are counted without taking a lock.
+  struct CallSlot {
+    std::atomic<const char*> name;
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> total_ns;
+  };
+  constexpr size_t call_slot_count = 256;
+  CallSlot calls[call_slot_count];
+
+  // The slot of a name, or NULL once the table is full
+  CallSlot* call_slot(const char *name) {
+    size_t start = (reinterpret_cast<uintptr_t>(name) >> 3) % call_slot_count;
+    for (size_t probe = 0; probe < call_slot_count; ++probe) {
+      CallSlot& slot = calls[(start + probe) % call_slot_count];
+      const char *claimed = slot.name.load(std::memory_order_acquire);
+      if (claimed == nullptr && slot.name.compare_exchange_strong(claimed, name, std::memory_order_acq_rel)) {
+        return &slot;
+      }
+      if (claimed == name) {
+        return &slot;
+      }
+    }
+    return nullptr;
+  }
+
+  const char *counter_names[] = {
+    "buffer_resizes",
+    "buffer_reallocations",
+    "mix_bytes",
+    "wav_bytes_read",
+    "wav_bytes_written",
+    "cache_hits",
+    "cache_misses",
+    "note_cache_hits",
+    "note_cache_misses"
+  };
+}
+
+const char* Stats::counter_name(Counter counter) {
+  return counter_names[static_cast<int>(counter)];
+}
+
+void Stats::add(Counter counter, uint64_t n) {
+  counters[static_cast<int>(counter)].fetch_add(n, std::memory_order_relaxed);
+}
+
+void Stats::add_wave_samples(int wave_type, uint64_t n) {
+  int slot = wave_type < 0 ? 0 : (wave_type < max_wave_types ? wave_type : max_wave_types - 1);
+  wave_samples[slot].fetch_add(n, std::memory_order_relaxed);
+}
+
+void Stats::add_call(const char *name, uint64_t duration_ns) {
+  CallSlot *slot = call_slot(name);
+  if (slot != nullptr) {
+    slot->calls.fetch_add(1, std::memory_order_relaxed);
+    slot->total_ns.fetch_add(duration_ns, std::memory_order_relaxed);
+  }
+}
+
+void Stats::snapshot(Snapshot& out) {
+  for (int i = 0; i < static_cast<int>(Counter::Count); ++i) {
+    out.counters[i] = counters[i].load(std::memory_order_relaxed);
+  }
+  for (int i = 0; i < max_wave_types; ++i) {
+    out.wave_samples[i] = wave_samples[i].load(std::memory_order_relaxed);
+  }
+
+  // The same name may have been recorded from more than one translation unit
+  std::map<std::string, std::pair<uint64_t, uint64_t>> by_name;
+  for (auto& call : calls) {
+    const char *name = call.name.load(std::memory_order_acquire);
+    uint64_t count = call.calls.load(std::memory_order_relaxed);
+    if (name == nullptr || count == 0) {
+      continue;
+    }
+    auto& merged = by_name[name];
+    merged.first += count;
+    merged.second += call.total_ns.load(std::memory_order_relaxed);
+  }
+  out.calls.clear();
+  for (auto& call : by_name) {
+    out.calls.push_back(CallTime{call.first, call.second.first, call.second.second});
+  }
+}
+
+void Stats::reset() {
+  for (auto& counter : counters) {
+    counter.store(0, std::memory_order_relaxed);
+  }
+  for (auto& samples : wave_samples) {
+    samples.store(0, std::memory_order_relaxed);
+  }
+  // Names keep their slots, so concurrent calls never see one move
+  for (auto& call : calls) {
+    call.calls.store(0, std::memory_order_relaxed);
+    call.total_ns.store(0, std::memory_order_relaxed);
+  }
+}
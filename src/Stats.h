@@ -0,0 +1,58 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension                         
+* Copyright 2020 Patrick Worthey                         
+* Source: https://github.com/ptrick/synther              
+* LICENSE: MIT                                           
+* See LICENSE and README.md files for more information.  
+* *******************************************************
+*/
+
+#ifndef SYNTHER_STATS_H
+#define SYNTHER_STATS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Stats {
+  // Cumulative event counts, safe to bump from any thread
+  enum class Counter : int {
+    BufferResizes       = 0,
+    BufferReallocations = 1,
+    MixBytes            = 2,
+    WavBytesRead        = 3,
+    WavBytesWritten     = 4,
+    CacheHits           = 5,
+    CacheMisses         = 6,
+    NoteCacheHits       = 7,
+    NoteCacheMisses     = 8,
+    Count               = 9
+  };
+
+  // Samples generated by wave types beyond this are counted under the last one
+  constexpr int max_wave_types = 16;
+
+  struct CallTime {
+    std::string name;
+    uint64_t calls;
+    uint64_t total_ns;
+  };
+
+  struct Snapshot {
+    uint64_t counters[static_cast<int>(Counter::Count)];
+    uint64_t wave_samples[max_wave_types];
+    std::vector<CallTime> calls;
+  };
+
+  const char* counter_name(Counter counter);
+
+  void add(Counter counter, uint64_t n);
+  void add_wave_samples(int wave_type, uint64_t n);
+  void add_call(const char *name, uint64_t duration_ns);
+
+  void snapshot(Snapshot& out);
+  void reset();
+}
+
+#endif
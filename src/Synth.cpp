@@ -0,0 +1,484 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension                         
+* Copyright 2020 Patrick Worthey                         
+* Source: https://github.com/ptrick/synther              
+* LICENSE: MIT                                           
+* See LICENSE and README.md files for more information.  
+* *******************************************************
+*/
+
+#include "Synth.h"
+#include "Stats.h"
+#include "Wavetable.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+
+namespace {
+  double clamp(double val, double low, double high) {
+    if (val < low) {
+      return low;
+    }
+    else if (val > high) {
+      return high;
+    }
+    else {
+      return val;
+    }
+  }
+}
+
+size_t Synth::ms_to_buffer_index(bigint_t ms) {
+  //  ms    sec     44100 samples
+  //  1    1000ms       sec
+  size_t r = static_cast<size_t>(ms / 1000.0 * 44100.0 * 2.0);
+  if (r % 2 == 1) {
+    ++r;
+  }
+  return r;
+
+}
+
+bool Synth::valid_wave_type(int wave_type) {
+  return wave_type >= static_cast<int>(WaveType::Sine) && wave_type <= static_cast<int>(WaveType::TriangleBandLimited);
+}
+
+Synth::WaveOp Synth::make_wave_op(bigint_t attack_start_ms, bigint_t attack_ms, bigint_t sustain_duration_ms, bigint_t decay_ms, double freq_hz, double amp, int wave_type,
+                                  const Wavetable *table) {
+  WaveOp op;
+  op.start_index = ms_to_buffer_index(attack_start_ms);
+  op.attack_end_index = ms_to_buffer_index(attack_start_ms + attack_ms);
+  op.sustain_end_index = ms_to_buffer_index(attack_start_ms + attack_ms + sustain_duration_ms);
+  op.end_index = ms_to_buffer_index(attack_start_ms + attack_ms + sustain_duration_ms + decay_ms);
+  op.freq_hz = freq_hz;
+  op.amp = amp;
+  op.wave_type = static_cast<WaveType>(wave_type);
+  op.table = table;
+  if (op.wave_type >= WaveType::SawBandLimited && op.wave_type <= WaveType::TriangleBandLimited) {
+    op.table = &band_limited_table(op.wave_type);
+  }
+  return op;
+}
+
+double Synth::envelope(const WaveOp& op, size_t n) {
+  double attack_amp = 1.0;
+  if (n < op.attack_end_index) {
+    attack_amp = clamp(static_cast<double>(n - op.start_index) / (op.attack_end_index - op.start_index), 0.0, 1.0);
+  }
+  double decay_amp = 1.0;
+  if (n > op.sustain_end_index) {
+    decay_amp = clamp(1.0 - (static_cast<double>(n - op.sustain_end_index) / (op.end_index - op.sustain_end_index)), 0.0, 1.0);
+  }
+  return attack_amp * decay_amp;
+}
+
+size_t Synth::wave_period(WaveType wave_type, double freq_hz) {
+  if (!(freq_hz > 0.0)) {
+    return 0;
+  }
+  switch (wave_type) {
+    case WaveType::Noise:
+      return 0;
+    default: {
+      // Every other wave is periodic in whole cycles, which a frequency of m millihertz completes every
+      // 44100000 / gcd(44100000, m) frames
+      double mhz = freq_hz * 1000.0;
+      if (mhz > 1e15 || std::fabs(mhz - std::round(mhz)) > 1e-6 * mhz) {
+        return 0;
+      }
+      uint64_t a = 44100000;
+      uint64_t b = static_cast<uint64_t>(std::round(mhz));
+      while (b != 0) {
+        uint64_t r = a % b;
+        a = b;
+        b = r;
+      }
+      return static_cast<size_t>(44100000 / a);
+    }
+  }
+}
+
+namespace {
+  // Computes every sample of a wave in [first, last). The attack and decay ramps are handed to sink one
+  // sample at a time, along with their index. Through the sustain, where the envelope is flat, periodic
+  // waves are only computed for one period, and tile gets the indices [begin, end) to fill from that
+  // cycle (one sample per frame) starting at frame phase of it.
+  template <typename Sink, typename Tile>
+  void synthesize(const Synth::WaveOp& op, Synth::WaveState& state, size_t first, size_t last, Sink sink, Tile tile) {
+    constexpr double two_pi = 6.283185307179586476925286766559;
+    const double freq_hz = op.freq_hz;
+
+    std::function<double (size_t)> wave_fn;
+    switch (op.wave_type) {
+      case Synth::WaveType::Sine: {
+        // Folding the index into one period keeps the phase exact far into a buffer, and makes a note's
+        // samples depend only on where its start falls within the period (see NoteCache.h)
+        const size_t period = Synth::wave_period(op.wave_type, freq_hz) * 2;
+        wave_fn = [=](size_t n) {
+          if (period > 0) {
+            n %= period;
+          }
+          return sin((two_pi * n / 2.0 * freq_hz) / 44100.0);
+        };
+        break;
+      }
+      case Synth::WaveType::Saw:
+      case Synth::WaveType::Square:
+      case Synth::WaveType::Triangle: {
+        // Folded into one period like sines, at the exact phase rather than a whole number of frames per cycle
+        const size_t period = Synth::wave_period(op.wave_type, freq_hz) * 2;
+        double (*shape)(double) = op.wave_type == Synth::WaveType::Saw ? Synth::saw_shape :
+          (op.wave_type == Synth::WaveType::Square ? Synth::square_shape : Synth::triangle_shape);
+        wave_fn = [=](size_t n) {
+          if (period > 0) {
+            n %= period;
+          }
+          double phase = n / 2.0 * freq_hz / 44100.0;
+          return shape(phase - floor(phase));
+        };
+        break;
+      }
+      case Synth::WaveType::Noise:
+        wave_fn = [&](size_t n) {
+          return state.unif(state.re);
+        };
+        break;
+      default: {
+        // Band-limited and registered wavetables, folded into one period like sines
+        const size_t period = Synth::wave_period(op.wave_type, freq_hz) * 2;
+        const float *level = op.table->level(freq_hz);
+        wave_fn = [=](size_t n) {
+          if (period > 0) {
+            n %= period;
+          }
+          double phase = n / 2.0 * freq_hz / 44100.0;
+          return Synth::Wavetable::sample(level, phase - floor(phase));
+        };
+        break;
+      }
+    }
+
+    auto ramp = [&](size_t n) {
+      sink(n, static_cast<uint16_t>(Synth::envelope(op, n) * op.amp * wave_fn(n)));
+    };
+
+    // The flat part of the envelope, on the same parity as first
+    size_t sustain_begin = std::max(first, op.attack_end_index);
+    sustain_begin += (sustain_begin - first) % 2;
+    const size_t sustain_end = std::min(last, op.sustain_end_index + 1);
+    const size_t period = Synth::wave_period(op.wave_type, freq_hz);
+
+    // A cycle costs a period of samples to compute, so it only pays off over a few periods
+    if (period == 0 || sustain_begin % 2 != 0 || sustain_begin >= sustain_end || (sustain_end - sustain_begin) / 2 < period * 2) {
+      for (size_t n = first; n < last; n += 2) {
+        ramp(n);
+      }
+      return;
+    }
+
+    for (size_t n = first; n < sustain_begin; n += 2) {
+      ramp(n);
+    }
+    // Index 2 * j is at frame j of the period, for every periodic wave_fn
+    std::vector<uint16_t> cycle(period);
+    for (size_t j = 0; j < period; ++j) {
+      cycle[j] = static_cast<uint16_t>(op.amp * wave_fn(2 * j));
+    }
+    tile(sustain_begin, sustain_end, cycle, (sustain_begin / 2) % period);
+    for (size_t n = sustain_begin + (sustain_end - sustain_begin + 1) / 2 * 2; n < last; n += 2) {
+      ramp(n);
+    }
+  }
+
+  void count_wave_samples(const Synth::WaveOp& op, size_t first, size_t last) {
+    if (first < last) {
+      Stats::add_wave_samples(static_cast<int>(op.wave_type), (last - first + 1) / 2 * 2);
+    }
+  }
+}
+
+void Synth::render_wave(std::vector<uint16_t>& b, const WaveOp& op, WaveState& state, size_t begin, size_t end) {
+  const size_t first = std::max(op.start_index, begin);
+  const size_t last = std::min(op.end_index, end);
+  count_wave_samples(op, first, last);
+
+  // Additive synthesis
+  synthesize(op, state, first, last, [&](size_t n, uint16_t value) {
+    b[n] += value;
+    b[n+1] += value;
+  }, [&](size_t begin, size_t end, const std::vector<uint16_t>& cycle, size_t phase) {
+    // Laid out as stereo, so each stretch of the tiling is one plain loop of adds
+    std::vector<uint16_t> stereo(cycle.size() * 2);
+    for (size_t j = 0; j < cycle.size(); ++j) {
+      stereo[2 * j] = stereo[2 * j + 1] = cycle[j];
+    }
+    uint16_t *out = &b[begin];
+    size_t count = (end - begin + 1) / 2 * 2;
+    size_t offset = phase * 2;
+    while (count > 0) {
+      size_t run = std::min(count, stereo.size() - offset);
+      const uint16_t *in = &stereo[offset];
+      for (size_t i = 0; i < run; ++i) {
+        out[i] += in[i];
+      }
+      out += run;
+      count -= run;
+      offset = 0;
+    }
+  });
+}
+
+void Synth::render_note(const WaveOp& op, std::vector<uint16_t>& out) {
+  out.assign((op.end_index - op.start_index + 1) / 2, 0);
+  WaveState state;
+  synthesize(op, state, op.start_index, op.end_index, [&](size_t n, uint16_t value) {
+    out[(n - op.start_index) / 2] = value;
+  }, [&](size_t begin, size_t end, const std::vector<uint16_t>& cycle, size_t phase) {
+    size_t frame = (begin - op.start_index) / 2;
+    size_t count = (end - begin + 1) / 2;
+    while (count > 0) {
+      size_t run = std::min(count, cycle.size() - phase);
+      std::copy(cycle.begin() + phase, cycle.begin() + phase + run, out.begin() + frame);
+      frame += run;
+      count -= run;
+      phase = 0;
+    }
+  });
+}
+
+void Synth::mix_note(std::vector<uint16_t>& b, const WaveOp& op, const std::vector<uint16_t>& note, size_t begin, size_t end) {
+  const size_t first = std::max(op.start_index, begin);
+  const size_t last = std::min(op.end_index, end);
+  count_wave_samples(op, first, last);
+
+  for (size_t n = first; n < last; n += 2) {
+    uint16_t value = note[(n - op.start_index) / 2];
+    b[n] += value;
+    b[n+1] += value;
+  }
+}
+
+namespace {
+  // The frames a bank sums before writing them out. Small enough for the voices and the sums to stay in L1.
+  constexpr size_t bank_block_frames = 256;
+
+  // The oscillators of a bank, as structures of arrays padded to a multiple of bank_lanes voices, so
+  // the loops across voices vectorize
+  constexpr size_t bank_lanes = 4;
+
+  struct BankState {
+    std::vector<double> phase;     // In cycles, in [0, 1)
+    std::vector<double> increment; // Cycles per frame, in [0, 1)
+    std::vector<double> amp;
+    std::vector<double> cos_part;  // The sine oscillators, as rotating amp * (cos, sin) pairs
+    std::vector<double> sin_part;
+    std::vector<double> cos_step;
+    std::vector<double> sin_step;
+    std::vector<const float*> levels;
+    size_t voices;
+  };
+
+  double fraction(double x) {
+    return x - floor(x);
+  }
+
+  // Adds the voices' samples of frames [0, count) of a block to sums, from the phases at its start
+  template <typename Shape>
+  void sum_block(BankState& bank, double *sums, size_t count, Shape shape) {
+    double *phase = bank.phase.data();
+    const double *increment = bank.increment.data();
+    const double *amp = bank.amp.data();
+    for (size_t i = 0; i < count; ++i) {
+      double lanes[bank_lanes] = {};
+      for (size_t v = 0; v < bank.voices; v += bank_lanes) {
+        for (size_t l = 0; l < bank_lanes; ++l) {
+          lanes[l] += amp[v + l] * shape(v + l, phase[v + l]);
+        }
+      }
+      for (size_t v = 0; v < bank.voices; ++v) {
+        phase[v] += increment[v];
+        phase[v] -= phase[v] >= 1.0 ? 1.0 : 0.0;
+      }
+      sums[i] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+  }
+
+  // Sines rotate a pair per voice instead, which takes a few multiplies rather than a call to sin().
+  // The pairs start each block from the exact phase, so rounding errors don't build up.
+  void sum_sine_block(BankState& bank, double *sums, size_t count) {
+    constexpr double two_pi = 6.283185307179586476925286766559;
+    double *c = bank.cos_part.data();
+    double *s = bank.sin_part.data();
+    const double *cs = bank.cos_step.data();
+    const double *ss = bank.sin_step.data();
+    for (size_t v = 0; v < bank.voices; ++v) {
+      c[v] = bank.amp[v] * cos(two_pi * bank.phase[v]);
+      s[v] = bank.amp[v] * sin(two_pi * bank.phase[v]);
+      bank.phase[v] = fraction(bank.phase[v] + bank.increment[v] * count);
+    }
+    for (size_t i = 0; i < count; ++i) {
+      double lanes[bank_lanes] = {};
+      for (size_t v = 0; v < bank.voices; v += bank_lanes) {
+        for (size_t l = 0; l < bank_lanes; ++l) {
+          lanes[l] += s[v + l];
+        }
+      }
+      for (size_t v = 0; v < bank.voices; ++v) {
+        double rotated = c[v] * cs[v] - s[v] * ss[v];
+        s[v] = s[v] * cs[v] + c[v] * ss[v];
+        c[v] = rotated;
+      }
+      sums[i] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+  }
+}
+
+void Synth::render_bank(std::vector<uint16_t>& b, const WaveOp& op, const std::vector<BankVoice>& voices, size_t begin, size_t end) {
+  constexpr double two_pi = 6.283185307179586476925286766559;
+  const size_t first = std::max(op.start_index, begin);
+  const size_t last = std::min(op.end_index, end);
+  if (first >= last || voices.empty()) {
+    return;
+  }
+  Stats::add_wave_samples(static_cast<int>(op.wave_type), (last - first + 1) / 2 * 2 * voices.size());
+
+  BankState bank;
+  bank.voices = (voices.size() + bank_lanes - 1) / bank_lanes * bank_lanes;
+  bank.phase.assign(bank.voices, 0.0);
+  bank.increment.assign(bank.voices, 0.0);
+  bank.amp.assign(bank.voices, 0.0);
+  bank.cos_part.assign(bank.voices, 0.0);
+  bank.sin_part.assign(bank.voices, 0.0);
+  bank.cos_step.assign(bank.voices, 1.0);
+  bank.sin_step.assign(bank.voices, 0.0);
+  bank.levels.assign(bank.voices, nullptr);
+  const Wavetable *table = op.table;
+  const size_t first_frame = (first - op.start_index) / 2;
+  for (size_t v = 0; v < voices.size(); ++v) {
+    double freq_hz = voices[v].freq_hz * pow(2.0, voices[v].detune_cents / 1200.0);
+    bank.increment[v] = fraction(freq_hz / 44100.0);
+    bank.phase[v] = fraction(voices[v].phase + bank.increment[v] * first_frame);
+    bank.amp[v] = voices[v].amp * op.amp;
+    bank.cos_step[v] = cos(two_pi * bank.increment[v]);
+    bank.sin_step[v] = sin(two_pi * bank.increment[v]);
+    bank.levels[v] = table != nullptr ? table->level(freq_hz) : nullptr;
+  }
+
+  WaveState state;
+  double sums[bank_block_frames];
+  for (size_t block = first; block < last; block += bank_block_frames * 2) {
+    size_t count = std::min(bank_block_frames, (last - block + 1) / 2);
+    std::fill(sums, sums + count, 0.0);
+    switch (op.wave_type) {
+      case WaveType::Sine:
+        sum_sine_block(bank, sums, count);
+        break;
+      case WaveType::Saw:
+        sum_block(bank, sums, count, [](size_t, double phase) { return saw_shape(phase); });
+        break;
+      case WaveType::Square:
+        sum_block(bank, sums, count, [](size_t, double phase) { return square_shape(phase); });
+        break;
+      case WaveType::Triangle:
+        sum_block(bank, sums, count, [](size_t, double phase) { return triangle_shape(phase); });
+        break;
+      case WaveType::Noise:
+        sum_block(bank, sums, count, [&](size_t, double) { return state.unif(state.re); });
+        break;
+      default:
+        // Band-limited and registered wavetables
+        sum_block(bank, sums, count, [&](size_t v, double phase) {
+          return bank.levels[v] == nullptr ? 0.0 : Wavetable::sample(bank.levels[v], phase);
+        });
+        break;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+      size_t n = block + 2 * i;
+      uint16_t value = static_cast<uint16_t>(static_cast<int32_t>(Synth::envelope(op, n) * sums[i]));
+      b[n] += value;
+      b[n+1] += value;
+    }
+  }
+}
+
+Synth::MixOp Synth::resolve_mix(size_t target_size, size_t source_size, bigint_t source_buffer_start_ms, bigint_t target_buffer_start_ms, bigint_t duration_ms) {
+  MixOp op = { 0, 0, 0, target_size };
+  if (source_size < 2) {
+    return op;
+  }
+
+  size_t src_buf_start_index = ms_to_buffer_index(source_buffer_start_ms);
+  size_t src_buf_end_index = duration_ms == 0 ? 
+    source_size - 2 : 
+    ms_to_buffer_index(source_buffer_start_ms + duration_ms);
+
+  if (src_buf_start_index + 1 >= source_size) {
+    src_buf_start_index = source_size - 2;
+  }
+
+  if (src_buf_end_index + 1 >= source_size) {
+    src_buf_end_index = source_size - 2;
+  }
+
+  size_t tar_buf_start_index = ms_to_buffer_index(target_buffer_start_ms);
+  size_t tar_buf_end_index = src_buf_end_index - src_buf_start_index + tar_buf_start_index;
+
+  if (tar_buf_end_index + 1 >= target_size) {
+    op.target_size = tar_buf_end_index + 1;
+  }
+
+  op.target_start = tar_buf_start_index;
+  op.source_start = src_buf_start_index;
+  op.frames = (src_buf_end_index - src_buf_start_index) / 2;
+  return op;
+}
+
+void Synth::apply_mix(std::vector<uint16_t>& target, const std::vector<uint16_t>& source, const MixOp& op, size_t begin, size_t end) {
+  size_t tar_begin = std::max(begin, op.target_start);
+  size_t tar_end = std::min(end, op.target_start + op.frames * 2);
+  if (tar_begin < tar_end) {
+    Stats::add(Stats::Counter::MixBytes, (tar_end - tar_begin) * sizeof(uint16_t));
+  }
+  for (size_t tar_n = tar_begin; tar_n < tar_end; tar_n += 2) {
+    size_t src_n = tar_n - op.target_start + op.source_start;
+    target[tar_n] += source[src_n];
+    target[tar_n + 1] += source[src_n + 1];
+  }
+}
+
+uint64_t Synth::hash64(const void *bytes, size_t len, uint64_t seed) {
+  const unsigned char *data = static_cast<const unsigned char*>(bytes);
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  uint64_t h = seed ^ (len * m);
+
+  const unsigned char *end = data + (len / 8) * 8;
+  for (; data != end; data += 8) {
+    uint64_t k;
+    std::memcpy(&k, data, 8);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+
+  switch (len & 7) {
+    case 7: h ^= static_cast<uint64_t>(data[6]) << 48; // fall through
+    case 6: h ^= static_cast<uint64_t>(data[5]) << 40; // fall through
+    case 5: h ^= static_cast<uint64_t>(data[4]) << 32; // fall through
+    case 4: h ^= static_cast<uint64_t>(data[3]) << 24; // fall through
+    case 3: h ^= static_cast<uint64_t>(data[2]) << 16; // fall through
+    case 2: h ^= static_cast<uint64_t>(data[1]) << 8;  // fall through
+    case 1: h ^= static_cast<uint64_t>(data[0]);
+            h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
@@ -0,0 +1,120 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension                         
+* Copyright 2020 Patrick Worthey                         
+* Source: https://github.com/ptrick/synther              
+* LICENSE: MIT                                           
+* See LICENSE and README.md files for more information.  
+* *******************************************************
+*/
+
+#ifndef SYNTHER_SYNTH_H
+#define SYNTHER_SYNTH_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// The signal processing kernels behind the module's functions, free of any Python API,
+// so they can be benchmarked and reused on their own.
+namespace Synth {
+  typedef long long bigint_t;
+
+  enum class WaveType : int {
+    Sine     = 0,
+    Saw      = 1,
+    Square   = 2,
+    Triangle = 3,
+    Noise    = 4,
+
+    // Read from band-limited wavetables (see Wavetable.h)
+    SawBandLimited      = 5,
+    SquareBandLimited   = 6,
+    TriangleBandLimited = 7
+  };
+
+  class Wavetable;
+
+  // A note, resolved to buffer indices
+  struct WaveOp {
+    size_t start_index;
+    size_t attack_end_index;
+    size_t sustain_end_index;
+    size_t end_index;
+    double freq_hz;
+    double amp;
+    WaveType wave_type;
+    const Wavetable *table; // Of band-limited and registered wave types
+  };
+
+  // Oscillator state that has to carry over when a wave is rendered one range at a time
+  struct WaveState {
+    std::uniform_real_distribution<double> unif{-1.0, 1.0};
+    std::default_random_engine re;
+  };
+
+  // A mix of one buffer into another, resolved to buffer indices against the buffer sizes at the time of mixing
+  struct MixOp {
+    size_t target_start;
+    size_t source_start;
+    size_t frames;
+    size_t target_size; // The target is grown to this size
+  };
+
+  // Converts a time to an index into an interleaved stereo 44.1 kHz buffer
+  size_t ms_to_buffer_index(bigint_t ms);
+
+  // Whether a wave type is built in. Registered wave types are checked by their engine's WavetableRegistry.
+  bool valid_wave_type(int wave_type);
+  // Band-limited wave types find their own tables, registered ones are given theirs
+  WaveOp make_wave_op(bigint_t attack_start_ms, bigint_t attack_ms, bigint_t sustain_duration_ms, bigint_t decay_ms, double freq_hz, double amp, int wave_type,
+    const Wavetable *table = nullptr);
+
+  // Adds the part of the wave that falls within [begin, end) to the buffer, which must already be large enough.
+  void render_wave(std::vector<uint16_t>& b, const WaveOp& op, WaveState& state, size_t begin, size_t end);
+
+  // The attack and decay ramps of a wave at index n, from 0 to 1
+  double envelope(const WaveOp& op, size_t n);
+
+  // The shapes of the naive periodic waves at a phase in [0, 1), the same for every renderer. Saws rise
+  // from -1, squares start high, and triangles start at 1 and fall to -1 halfway.
+  inline double saw_shape(double phase) { return phase * 2.0 - 1.0; }
+  inline double square_shape(double phase) { return phase < 0.5 ? 1.0 : -1.0; }
+  inline double triangle_shape(double phase) { return std::fabs(phase - 0.5) * 4.0 - 1.0; }
+
+  // The number of frames after which a wave repeats exactly, or 0 if it doesn't (noise, or a periodic
+  // wave whose frequency isn't a whole number of millihertz)
+  size_t wave_period(WaveType wave_type, double freq_hz);
+
+  // Renders a whole wave on its own, one sample per frame from its start. Adding it to a buffer with
+  // mix_note() gives the same result as render_wave().
+  void render_note(const WaveOp& op, std::vector<uint16_t>& out);
+  void mix_note(std::vector<uint16_t>& b, const WaveOp& op, const std::vector<uint16_t>& note, size_t begin, size_t end);
+
+  // One oscillator of a bank. The phase, in cycles, is the voice's phase where the note starts, and the
+  // detune, in cents, shifts its frequency.
+  struct BankVoice {
+    double freq_hz;
+    double amp;
+    double phase;
+    double detune_cents;
+  };
+
+  // Adds the part of a bank of voices that falls within [begin, end) to the buffer, all sharing the
+  // envelope and wave type of op (whose frequency is unused and amplitude scales every voice). The
+  // voices are summed a block at a time, so the buffer is only written once.
+  void render_bank(std::vector<uint16_t>& b, const WaveOp& op, const std::vector<BankVoice>& voices, size_t begin, size_t end);
+
+  // Resolves a mix against the sizes the target and source have at the time of mixing
+  MixOp resolve_mix(size_t target_size, size_t source_size, bigint_t source_buffer_start_ms, bigint_t target_buffer_start_ms, bigint_t duration_ms);
+
+  // Adds the part of the mix that lands within [begin, end) of the target
+  void apply_mix(std::vector<uint16_t>& target, const std::vector<uint16_t>& source, const MixOp& op, size_t begin, size_t end);
+
+  // MurmurHash64A. Fast and well distributed, but not cryptographic.
+  uint64_t hash64(const void *data, size_t len, uint64_t seed);
+}
+
+#endif
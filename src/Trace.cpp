@@ -0,0 +1,78 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension                         
+* Copyright 2020 Patrick Worthey                         
+* Source: https://github.com/ptrick/synther              
+* LICENSE: MIT                                           
+* See LICENSE and README.md files for more information.  
+* *******************************************************
+*/
+
+#include "Trace.h"
+#include "Stats.h"
+#include <map>
+#include <mutex>
+
+std::atomic<bool> Trace::active{false};
+
+namespace {
+  std::mutex trace_mutex; // Guards everything below
+  std::vector<Trace::Event> events;
+  std::map<uint32_t, std::string> thread_names;
+  std::chrono::steady_clock::time_point epoch;
+  uint64_t generation = 0; // Bumped by every start(), so scopes spanning a restart are dropped
+
+  std::atomic<uint32_t> thread_count{0};
+
+  // Small sequential ids read better as track names than native thread ids
+  uint32_t thread_id() {
+    thread_local uint32_t id = ++thread_count;
+    return id;
+  }
+}
+
+void Trace::start() {
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  events.clear();
+  thread_names.clear();
+  epoch = std::chrono::steady_clock::now();
+  ++generation;
+  active.store(true);
+}
+
+void Trace::stop(std::vector<Event>& out_events, std::vector<std::pair<uint32_t, std::string>>& out_threads) {
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  active.store(false);
+  out_events.swap(events);
+  events.clear();
+  out_threads.assign(thread_names.begin(), thread_names.end());
+}
+
+void Trace::name_thread(const char *name) {
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  thread_names[thread_id()] = name;
+}
+
+Trace::Scope::Scope(const char *scope_name) : name(scope_name), trace(0), recording(active.load(std::memory_order_relaxed)) {
+  if (recording) {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    trace = generation;
+  }
+  start = std::chrono::steady_clock::now();
+}
+
+Trace::Scope::~Scope() {
+  auto end = std::chrono::steady_clock::now();
+  uint64_t duration_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+  Stats::add_call(name, duration_ns);
+  if (!recording) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  // Spans that started before a restart would land at a bogus time
+  if (!active.load(std::memory_order_relaxed) || trace != generation) {
+    return;
+  }
+  uint64_t start_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(start - epoch).count());
+  events.push_back(Event{name, start_ns, duration_ns, thread_id(), samples, bytes_read, bytes_written});
+}
@@ -0,0 +1,66 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension                         
+* Copyright 2020 Patrick Worthey                         
+* Source: https://github.com/ptrick/synther              
+* LICENSE: MIT                                           
+* See LICENSE and README.md files for more information.  
+* *******************************************************
+*/
+
+#ifndef SYNTHER_TRACE_H
+#define SYNTHER_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Trace {
+  // One timed span of work, as recorded by a Scope
+  struct Event {
+    const char *name;
+    uint64_t start_ns; // Since tracing started
+    uint64_t duration_ns;
+    uint32_t thread;
+    uint64_t samples;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+  };
+
+  extern std::atomic<bool> active;
+
+  // Starts recording, dropping any events and thread names from an earlier trace
+  void start();
+
+  // Stops recording and hands over the events, along with the names of the threads that were named
+  void stop(std::vector<Event>& out_events, std::vector<std::pair<uint32_t, std::string>>& out_threads);
+
+  // Names the calling thread in traces
+  void name_thread(const char *name);
+
+  // Times the span between construction and destruction. The time is added to the call totals in
+  // Stats, and is recorded as an event while tracing is active.
+  class Scope {
+   public:
+    explicit Scope(const char *name);
+    ~Scope();
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+    uint64_t samples = 0;
+    uint64_t bytes_read = 0;
+    uint64_t bytes_written = 0;
+
+   private:
+    const char *name;
+    std::chrono::steady_clock::time_point start;
+    uint64_t trace;
+    bool recording;
+  };
+}
+
+#endif
@@ -9,6 +9,8 @@
 */
 
 #include "WavIO.h"
+#include "Trace.h"
+#include "Stats.h"
 #include <fstream>
 #include <cstring>
 
@@ -38,6 +40,7 @@ namespace {
 }
 
 bool WavIO::write_wav(const char *filename, const std::vector<uint16_t>& buffer) {
+  Trace::Scope trace("write_wav");
   std::ofstream f( filename, std::ios::binary );
   if (!f.is_open()) {
     return false;
@@ -74,6 +77,10 @@ bool WavIO::write_wav(const char *filename, const std::vector<uint16_t>& buffer)
   write_word( f, 36 + subchunk2Size, 4 ); 
   f.close();
 
+  trace.samples = buffer.size();
+  trace.bytes_written = file_length;
+  Stats::add(Stats::Counter::WavBytesWritten, file_length);
+
   return true;
 }
 
@@ -118,130 +125,153 @@ namespace {
   }
 }
 
-bool WavIO::sample_wav(const char *filename, std::vector<uint16_t>& outBuffer, uint64_t buffer_start_ms, uint64_t sample_start_ms, uint64_t duration_ms) {
+namespace {
+  bool read_wav(const char *filename, std::vector<uint16_t>& outBuffer, bool relative, size_t& outStart, uint64_t buffer_start_ms, uint64_t sample_start_ms, uint64_t duration_ms) {
+    Trace::Scope trace("read_wav");
 
-  std::ifstream f(filename, std::ios::binary);
-  if (!f.is_open()) {
-    return false;
-  }
+    std::ifstream f(filename, std::ios::binary);
+    if (!f.is_open()) {
+      return false;
+    }
 
-  std::vector<char> riff(4);
-  uint32_t chunkSize;
-  std::vector<char> waveFmt(8);
-  uint32_t subChunk1Size;
-  uint16_t encoding_type;
-  uint16_t num_channels;
-  uint32_t samples_per_second;
-  uint32_t bytes_per_second;
-  uint16_t data_block_size;
-  uint16_t bits_per_sample;
-  std::vector<char> data(4);
-  uint32_t subChunk2Size;
-
-  f.read(&riff[0], 4);
-
-  if (riff[0] != 'R' || riff[1] != 'I' || riff[2] != 'F' || riff[3] != 'F') {
-    return false;
-  }
+    std::vector<char> riff(4);
+    uint32_t chunkSize;
+    std::vector<char> waveFmt(8);
+    uint32_t subChunk1Size;
+    uint16_t encoding_type;
+    uint16_t num_channels;
+    uint32_t samples_per_second;
+    uint32_t bytes_per_second;
+    uint16_t data_block_size;
+    uint16_t bits_per_sample;
+    std::vector<char> data(4);
+    uint32_t subChunk2Size;
+
+    f.read(&riff[0], 4);
+
+    if (riff[0] != 'R' || riff[1] != 'I' || riff[2] != 'F' || riff[3] != 'F') {
+      return false;
+    }
 
-  read_word(f, chunkSize, 4);
+    read_word(f, chunkSize, 4);
 
-  f.read(&waveFmt[0], 8);
+    f.read(&waveFmt[0], 8);
 
-  if (std::string(&waveFmt[0], 7) != "WAVEfmt") {
-    return false;
-  }
+    if (std::string(&waveFmt[0], 7) != "WAVEfmt") {
+      return false;
+    }
 
-  read_word(f, subChunk1Size, 4);
-  if (subChunk1Size < 16) {
-    return false;
-  }
+    read_word(f, subChunk1Size, 4);
+    if (subChunk1Size < 16) {
+      return false;
+    }
 
-  read_word(f, encoding_type, 2);
+    read_word(f, encoding_type, 2);
 
-  if (encoding_type != 1) { // TODO: support other formats
-    return false;
-  }
+    if (encoding_type != 1) { // TODO: support other formats
+      return false;
+    }
 
-  read_word(f, num_channels, 2);
+    read_word(f, num_channels, 2);
 
-  if (num_channels > 2) {
-    return false; // TODO: appropriate support
-  }
+    if (num_channels > 2) {
+      return false; // TODO: appropriate support
+    }
 
-  read_word(f, samples_per_second, 4);
-  read_word(f, bytes_per_second, 4);
-  read_word(f, data_block_size, 2);
-  read_word(f, bits_per_sample, 2);
+    read_word(f, samples_per_second, 4);
+    read_word(f, bytes_per_second, 4);
+    read_word(f, data_block_size, 2);
+    read_word(f, bits_per_sample, 2);
 
-  f.seekg(static_cast<size_t>(subChunk1Size) + 20);
-  f.read(&data[0], 4);
+    f.seekg(static_cast<size_t>(subChunk1Size) + 20);
+    f.read(&data[0], 4);
 
-  if (data[0] != 'd' || data[1] != 'a' || data[2] != 't' || data[3] != 'a') {
-    return false;
-  }
+    if (data[0] != 'd' || data[1] != 'a' || data[2] != 't' || data[3] != 'a') {
+      return false;
+    }
 
-  read_word(f, subChunk2Size, 4);
+    read_word(f, subChunk2Size, 4);
 
-  if (duration_ms == 0) {
-    duration_ms = static_cast<uint64_t>(static_cast<double>(subChunk2Size) / bytes_per_second * 1000.0);
-  }
+    if (duration_ms == 0) {
+      duration_ms = static_cast<uint64_t>(static_cast<double>(subChunk2Size) / bytes_per_second * 1000.0);
+    }
 
-  size_t start_byte_index = ms_to_byte_buffer_index(sample_start_ms, samples_per_second, num_channels, bits_per_sample, data_block_size);
-  size_t end_byte_index = ms_to_byte_buffer_index(sample_start_ms + duration_ms, samples_per_second, num_channels, bits_per_sample, data_block_size);
+    size_t start_byte_index = ms_to_byte_buffer_index(sample_start_ms, samples_per_second, num_channels, bits_per_sample, data_block_size);
+    size_t end_byte_index = ms_to_byte_buffer_index(sample_start_ms + duration_ms, samples_per_second, num_channels, bits_per_sample, data_block_size);
 
-  if (start_byte_index > subChunk2Size) {
-    start_byte_index = subChunk2Size;
-  }
+    if (start_byte_index > subChunk2Size) {
+      start_byte_index = subChunk2Size;
+    }
 
-  if (end_byte_index > subChunk2Size) {
-    end_byte_index = subChunk2Size;
-  }
+    if (end_byte_index > subChunk2Size) {
+      end_byte_index = subChunk2Size;
+    }
 
-  std::vector<char> audio_bytes(end_byte_index - start_byte_index);
+    std::vector<char> audio_bytes(end_byte_index - start_byte_index);
 
-  f.seekg(static_cast<size_t>(start_byte_index) + static_cast<size_t>(subChunk1Size) + 28);
-  size_t a = 0;
-  for (size_t n = start_byte_index; n < end_byte_index; ++n) {
-    f.read(&audio_bytes[a++], 1); // TODO: larger chunks for faster reads
-  }
+    f.seekg(static_cast<size_t>(start_byte_index) + static_cast<size_t>(subChunk1Size) + 28);
+    size_t a = 0;
+    size_t bytes_read = 0;
+    for (size_t n = start_byte_index; n < end_byte_index; ++n) {
+      f.read(&audio_bytes[a++], 1); // TODO: larger chunks for faster reads
+      bytes_read += static_cast<size_t>(f.gcount());
+    }
 
-  size_t buffer_start_index = ms_to_byte_buffer_index(buffer_start_ms, 44100, 2, 16, 4) / 2;
-  size_t buffer_end_index = ms_to_byte_buffer_index(buffer_start_ms + duration_ms, 44100, 2, 16, 4) / 2;
+    trace.bytes_read = static_cast<uint64_t>(subChunk1Size) + 28 + bytes_read;
+    Stats::add(Stats::Counter::WavBytesRead, trace.bytes_read);
 
-  if (buffer_end_index > outBuffer.size()) {
-    outBuffer.resize(buffer_end_index, 0);
-  }
+    size_t buffer_start_index = ms_to_byte_buffer_index(buffer_start_ms, 44100, 2, 16, 4) / 2;
+    size_t buffer_end_index = ms_to_byte_buffer_index(buffer_start_ms + duration_ms, 44100, 2, 16, 4) / 2;
 
-  // direct cpy test...
-  /*size_t tmp = 0;
-  for (size_t insert_index = buffer_start_index; insert_index + 1 < buffer_end_index; insert_index += 2) {
-    std::memcpy(&outBuffer[insert_index], &audio_bytes[tmp], 4);
-    tmp += 4;
-  }*/
+    // Relative output is shifted so that it starts at the clip
+    size_t offset = relative ? buffer_start_index : 0;
+    outStart = offset;
 
-  for (size_t insert_index = buffer_start_index; insert_index + 1 < buffer_end_index; insert_index += 2) {
-    // Sample from audio bytes. Method: truncate
-    double round_err_adjust = insert_index % 4 == 0 ? 0.01 : -0.01;
-    double dt_ms = (insert_index - buffer_start_index) / 2 / 44100.0 * 1000.0 + round_err_adjust;
-    if (dt_ms < 0.0) {
-      dt_ms = 0.0;
+    if (buffer_end_index - offset > outBuffer.size()) {
+      outBuffer.resize(buffer_end_index - offset, 0);
     }
 
-    // Find start index
-    // TODO: come up with better sampling method. Sounds a bit tinny when it's not 44100 sample rate + 16 bit depth
-    size_t sample_index = ms_to_byte_buffer_index_highp(dt_ms, samples_per_second, num_channels, bits_per_sample, data_block_size);
-
-    if (sample_index + data_block_size - 1 > audio_bytes.size() - 1) {
-      break;
+    // direct cpy test...
+    /*size_t tmp = 0;
+    for (size_t insert_index = buffer_start_index; insert_index + 1 < buffer_end_index; insert_index += 2) {
+      std::memcpy(&outBuffer[insert_index], &audio_bytes[tmp], 4);
+      tmp += 4;
+    }*/
+
+    for (size_t insert_index = buffer_start_index; insert_index + 1 < buffer_end_index; insert_index += 2) {
+      // Sample from audio bytes. Method: truncate
+      double round_err_adjust = insert_index % 4 == 0 ? 0.01 : -0.01;
+      double dt_ms = (insert_index - buffer_start_index) / 2 / 44100.0 * 1000.0 + round_err_adjust;
+      if (dt_ms < 0.0) {
+        dt_ms = 0.0;
+      }
+
+      // Find start index
+      // TODO: come up with better sampling method. Sounds a bit tinny when it's not 44100 sample rate + 16 bit depth
+      size_t sample_index = ms_to_byte_buffer_index_highp(dt_ms, samples_per_second, num_channels, bits_per_sample, data_block_size);
+
+      if (sample_index + data_block_size - 1 > audio_bytes.size() - 1) {
+        break;
+      }
+
+      uint16_t left_channel, right_channel;
+      get_samples(left_channel, right_channel, audio_bytes, sample_index, data_block_size, bits_per_sample, num_channels);
+
+      outBuffer[insert_index - offset] += left_channel;
+      outBuffer[insert_index + 1 - offset] += right_channel;
+      trace.samples += 2;
     }
 
-    uint16_t left_channel, right_channel;
-    get_samples(left_channel, right_channel, audio_bytes, sample_index, data_block_size, bits_per_sample, num_channels);
-
-    outBuffer[insert_index] += left_channel;
-    outBuffer[insert_index + 1] += right_channel;
+    return true;
   }
+}
+
+bool WavIO::sample_wav(const char *filename, std::vector<uint16_t>& outBuffer, uint64_t buffer_start_ms, uint64_t sample_start_ms, uint64_t duration_ms) {
+  size_t out_start;
+  return read_wav(filename, outBuffer, false, out_start, buffer_start_ms, sample_start_ms, duration_ms);
+}
 
-   return true;
- }
\ No newline at end of file
+bool WavIO::decode_wav(const char *filename, std::vector<uint16_t>& outSamples, size_t& outStart, uint64_t buffer_start_ms, uint64_t sample_start_ms, uint64_t duration_ms) {
+  outSamples.clear();
+  return read_wav(filename, outSamples, true, outStart, buffer_start_ms, sample_start_ms, duration_ms);
+}
\ No newline at end of file
@@ -8,10 +8,21 @@
 * *******************************************************
 */
 
+#ifndef SYNTHER_WAVIO_H
+#define SYNTHER_WAVIO_H
+
 #include <vector>
 #include <cstdint>
+#include <cstddef>
 
 namespace WavIO {
   bool write_wav(const char *filename, const std::vector<uint16_t>& buffer);
   bool sample_wav(const char *filename, std::vector<uint16_t>& outBuffer, uint64_t buffer_start_ms, uint64_t sample_start_ms, uint64_t duration_ms=0);
-}
\ No newline at end of file
+
+  // Decodes exactly the samples sample_wav() would add into a buffer, but into outSamples
+  // with outSamples[0] landing at buffer index outStart. Clips placed late in a song then
+  // do not need to be preceded by a buffer full of silence.
+  bool decode_wav(const char *filename, std::vector<uint16_t>& outSamples, size_t& outStart, uint64_t buffer_start_ms, uint64_t sample_start_ms, uint64_t duration_ms=0);
+}
+
+#endif
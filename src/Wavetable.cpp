@@ -0,0 +1,201 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension
+* Copyright 2020 Patrick Worthey
+* Source: https://github.com/ptrick/synther
+* LICENSE: MIT
+* See LICENSE and README.md files for more information.
+* *******************************************************
+*/
+
+#include "Wavetable.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <mutex>
+
+namespace Synth {
+  namespace {
+    constexpr double pi = 3.14159265358979323846264338327950288;
+
+    // Level 0 holds every harmonic the table can, which is all of them for fundamentals up to 44100 / cycle_samples
+    double level_top_hz(size_t level) {
+      return 44100.0 / Wavetable::cycle_samples * (1 << level);
+    }
+
+    // The Fourier series of the naive waves of render_wave(), each starting its cycle at phase 0
+    Wavetable saw_table() {
+      // Rising from -1 to 1
+      std::vector<double> cos_amps(Wavetable::max_harmonics + 1, 0.0);
+      std::vector<double> sin_amps(Wavetable::max_harmonics + 1, 0.0);
+      for (size_t k = 1; k <= Wavetable::max_harmonics; ++k) {
+        sin_amps[k] = -2.0 / (pi * k);
+      }
+      return Wavetable(cos_amps, sin_amps);
+    }
+
+    Wavetable square_table() {
+      // 1 for the first half of the cycle, -1 for the second
+      std::vector<double> cos_amps(Wavetable::max_harmonics + 1, 0.0);
+      std::vector<double> sin_amps(Wavetable::max_harmonics + 1, 0.0);
+      for (size_t k = 1; k <= Wavetable::max_harmonics; k += 2) {
+        sin_amps[k] = 4.0 / (pi * k);
+      }
+      return Wavetable(cos_amps, sin_amps);
+    }
+
+    Wavetable triangle_table() {
+      // 1 at the start of the cycle, -1 halfway
+      std::vector<double> cos_amps(Wavetable::max_harmonics + 1, 0.0);
+      std::vector<double> sin_amps(Wavetable::max_harmonics + 1, 0.0);
+      for (size_t k = 1; k <= Wavetable::max_harmonics; k += 2) {
+        cos_amps[k] = 8.0 / (pi * pi * k * k);
+      }
+      return Wavetable(cos_amps, sin_amps);
+    }
+  }
+
+  constexpr size_t Wavetable::cycle_samples;
+  constexpr size_t Wavetable::max_harmonics;
+  constexpr size_t Wavetable::levels;
+
+  Wavetable::Wavetable(const std::vector<double>& cos_amps, const std::vector<double>& sin_amps) : tables(levels * (cycle_samples + 1)) {
+    // Harmonic k at entry j is at angle 2 pi k j / cycle_samples, so one table of the cycle serves them all
+    std::vector<double> cosines(cycle_samples);
+    std::vector<double> sines(cycle_samples);
+    for (size_t j = 0; j < cycle_samples; ++j) {
+      cosines[j] = std::cos(2.0 * pi * j / cycle_samples);
+      sines[j] = std::sin(2.0 * pi * j / cycle_samples);
+    }
+
+    size_t harmonics = std::min(std::max(cos_amps.size(), sin_amps.size()), max_harmonics + 1);
+    std::vector<double> cycle(cycle_samples);
+    for (size_t l = 0; l < levels; ++l) {
+      size_t top = std::min(harmonics - 1, static_cast<size_t>(22050.0 / level_top_hz(l)));
+      double dc = cos_amps.empty() ? 0.0 : cos_amps[0];
+      std::fill(cycle.begin(), cycle.end(), dc);
+      for (size_t k = 1; k <= top; ++k) {
+        double a = k < cos_amps.size() ? cos_amps[k] : 0.0;
+        double b = k < sin_amps.size() ? sin_amps[k] : 0.0;
+        if (a == 0.0 && b == 0.0) {
+          continue;
+        }
+        for (size_t j = 0, angle = 0; j < cycle_samples; ++j) {
+          cycle[j] += a * cosines[angle] + b * sines[angle];
+          angle += k;
+          if (angle >= cycle_samples) {
+            angle -= cycle_samples;
+          }
+        }
+      }
+      float *table = &tables[l * (cycle_samples + 1)];
+      std::copy(cycle.begin(), cycle.end(), table);
+      table[cycle_samples] = table[0];
+    }
+  }
+
+  Wavetable Wavetable::from_cycle(const std::vector<double>& cycle) {
+    const size_t length = cycle.size();
+    const size_t harmonics = std::min(max_harmonics, length > 0 ? (length - 1) / 2 : 0);
+    std::vector<double> cosines(length);
+    std::vector<double> sines(length);
+    for (size_t j = 0; j < length; ++j) {
+      cosines[j] = std::cos(2.0 * pi * j / length);
+      sines[j] = std::sin(2.0 * pi * j / length);
+    }
+
+    std::vector<double> cos_amps(harmonics + 1, 0.0);
+    std::vector<double> sin_amps(harmonics + 1, 0.0);
+    for (size_t j = 0; j < length; ++j) {
+      cos_amps[0] += cycle[j] / length;
+    }
+    for (size_t k = 1; k <= harmonics; ++k) {
+      double a = 0.0;
+      double b = 0.0;
+      for (size_t j = 0, angle = 0; j < length; ++j) {
+        a += cycle[j] * cosines[angle];
+        b += cycle[j] * sines[angle];
+        angle += k;
+        if (angle >= length) {
+          angle -= length;
+        }
+      }
+      cos_amps[k] = 2.0 * a / length;
+      sin_amps[k] = 2.0 * b / length;
+    }
+    return Wavetable(cos_amps, sin_amps);
+  }
+
+  const float* Wavetable::level(double freq_hz) const {
+    size_t l = 0;
+    while (l + 1 < levels && freq_hz > level_top_hz(l)) {
+      ++l;
+    }
+    return &tables[l * (cycle_samples + 1)];
+  }
+
+  const Wavetable& band_limited_table(WaveType wave_type) {
+    // Each is built once, on first use, however many threads ask
+    switch (wave_type) {
+      case WaveType::SquareBandLimited: {
+        static const Wavetable square = square_table();
+        return square;
+      }
+      case WaveType::TriangleBandLimited: {
+        static const Wavetable triangle = triangle_table();
+        return triangle;
+      }
+      default: {
+        static const Wavetable saw = saw_table();
+        return saw;
+      }
+    }
+  }
+
+  int WavetableRegistry::add(const std::vector<double>& cycle) {
+    if (cycle.size() < 2) {
+      return -1;
+    }
+    // Built before taking the lock, since it takes a while
+    Entry entry{std::make_shared<const Wavetable>(Wavetable::from_cycle(cycle)), hash64(cycle.data(), cycle.size() * sizeof(double), cycle.size())};
+    std::lock_guard<std::mutex> guard(lock);
+    entries.push_back(std::move(entry));
+    return first_registered_wave_type + static_cast<int>(entries.size() - 1);
+  }
+
+  bool WavetableRegistry::valid(int wave_type) const {
+    if (valid_wave_type(wave_type)) {
+      return true;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    return wave_type >= first_registered_wave_type && static_cast<size_t>(wave_type - first_registered_wave_type) < entries.size();
+  }
+
+  std::shared_ptr<const Wavetable> WavetableRegistry::find(int wave_type) const {
+    switch (static_cast<WaveType>(wave_type)) {
+      case WaveType::SawBandLimited:
+      case WaveType::SquareBandLimited:
+      case WaveType::TriangleBandLimited:
+        // Built-in tables live as long as the process, so nothing owns them
+        return std::shared_ptr<const Wavetable>(std::shared_ptr<const Wavetable>(), &band_limited_table(static_cast<WaveType>(wave_type)));
+      default: {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t index = static_cast<size_t>(wave_type - first_registered_wave_type);
+        if (wave_type < first_registered_wave_type || index >= entries.size()) {
+          return nullptr;
+        }
+        return entries[index].table;
+      }
+    }
+  }
+
+  uint64_t WavetableRegistry::fingerprint(int wave_type) const {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t index = static_cast<size_t>(wave_type - first_registered_wave_type);
+    if (wave_type < first_registered_wave_type || index >= entries.size()) {
+      return 0;
+    }
+    return entries[index].fingerprint;
+  }
+}
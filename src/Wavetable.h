@@ -0,0 +1,94 @@
+/*
+* *******************************************************
+* Synther - Python C++ Extension
+* Copyright 2020 Patrick Worthey
+* Source: https://github.com/ptrick/synther
+* LICENSE: MIT
+* See LICENSE and README.md files for more information.
+* *******************************************************
+*/
+
+#ifndef SYNTHER_WAVETABLE_H
+#define SYNTHER_WAVETABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Synth.h"
+
+// Band-limited oscillators. A wavetable holds one cycle of a wave at a bandwidth per octave of
+// fundamental frequency: each level keeps only the harmonics that stay under the Nyquist frequency
+// for every note of its octave, so no note aliases. Notes read the level for their frequency, with
+// linear interpolation between table entries.
+//
+// Besides the built-in band-limited waves, tables can be registered with an engine from a cycle of
+// samples, each becoming a wave type of its own.
+namespace Synth {
+  class Wavetable {
+   public:
+    static constexpr size_t cycle_samples = 2048;
+    static constexpr size_t max_harmonics = cycle_samples / 2 - 1;
+    static constexpr size_t levels = 11;
+
+    // Builds the levels from the Fourier series of the wave: harmonic k is
+    // cos_amps[k] * cos(2 pi k phase) + sin_amps[k] * sin(2 pi k phase), with the DC offset at index 0
+    Wavetable(const std::vector<double>& cos_amps, const std::vector<double>& sin_amps);
+
+    // Builds the levels from one cycle of a wave, of any length, by its discrete Fourier transform.
+    // Harmonics the cycle is too short to hold, or the table too small, are left out.
+    static Wavetable from_cycle(const std::vector<double>& cycle);
+
+    // The level for a fundamental frequency: cycle_samples + 1 entries, the last one wrapping around
+    const float* level(double freq_hz) const;
+
+    // The wave at a phase in [0, 1), interpolated linearly
+    static double sample(const float *level, double phase) {
+      double position = phase * cycle_samples;
+      size_t i = static_cast<size_t>(position);
+      double t = position - i;
+      return level[i] + (level[i + 1] - level[i]) * t;
+    }
+
+   private:
+    std::vector<float> tables; // levels tables of cycle_samples + 1 entries, back to back
+  };
+
+  // Wave types from here on are the wavetables registered with an engine, in order
+  constexpr int first_registered_wave_type = 8;
+
+  // The shared tables of the band-limited wave types, built the first time each is asked for
+  const Wavetable& band_limited_table(WaveType wave_type);
+
+  // The wavetables registered with one engine. Each engine numbers its own from first_registered_wave_type
+  // on, so interpreters never see each other's. Safe to use from any number of threads.
+  class WavetableRegistry {
+   public:
+    // Registers the wavetable of one cycle of a wave, and returns its wave type, or -1 if the cycle is
+    // shorter than 2 samples. Tables are kept until the registry is destroyed.
+    int add(const std::vector<double>& cycle);
+
+    // Whether a wave type is built in or registered here
+    bool valid(int wave_type) const;
+
+    // The table of a band-limited or registered wave type, or NULL. Holding it keeps it alive.
+    std::shared_ptr<const Wavetable> find(int wave_type) const;
+
+    // A hash of the cycle a wave type was registered with, so builds cached on disk don't mistake one
+    // registered table for another, or 0 if the wave type isn't registered
+    uint64_t fingerprint(int wave_type) const;
+
+   private:
+    struct Entry {
+      std::shared_ptr<const Wavetable> table;
+      uint64_t fingerprint;
+    };
+
+    mutable std::mutex lock;
+    std::vector<Entry> entries;
+  };
+}
+
+#endif
@@ -11,344 +11,1794 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
-#include <functional>
-#include <cmath>
-#include <map>
+#include <memory>
+#include <new>
 #include <vector>
-#include <exception>
-#include <random>
 #include <cstdint>
 #include <string>
+#include <cstring>
+#include <climits>
+#include <cstdarg>
+#include <cmath>
 
-#include "WavIO.h"
+#include "CommandLog.h"
+#include "Engine.h"
+#include "Trace.h"
+#include "Stats.h"
+#include "Wavetable.h"
+
+// The Python binding of the synther_core library: parses arguments, calls the engine and
+// turns its results into Python objects and errors.
 
 typedef long long bigint_t;
 
-static PyObject *SyntherError;
 static const char *synther_doc = "Module for running wave processing.";
 
-static bigint_t buffer_count = 0;
-static std::map<bigint_t, std::vector<uint16_t>> buffers;
+// Everything the module keeps between calls. Each interpreter importing the module gets a state of
+// its own, so subinterpreters have isolated buffer registries and can render at the same time.
+typedef struct {
+  Synth::Engine *engine;
+  PyObject *error;
+  PyTypeObject *stream_type;
+  PyTypeObject *block_type;
+  PyTypeObject *command_log_type;
+  PyTypeObject *sequencer_type;
+} SyntherState;
+
+static SyntherState* get_state(PyObject *module) {
+  return static_cast<SyntherState*>(PyModule_GetState(module));
+}
 
-static void set_buffer_not_found_err(bigint_t buffer) {
+static void set_buffer_not_found_err(SyntherState *state, bigint_t buffer) {
   std::string msg = "Buffer " + std::to_string(buffer)  + " not found.";
-  PyErr_SetString(SyntherError, msg.c_str());
+  PyErr_SetString(state->error, msg.c_str());
 }
 
-static PyObject* gen_buffer(PyObject *self, PyObject *args) {
-  buffers[++buffer_count] = std::vector<uint16_t>();
-  return PyLong_FromUnsignedLongLong(buffer_count);
+// Raises the error matching a failed engine call, and returns NULL
+static PyObject* set_engine_err(SyntherState *state, const Synth::Result& result) {
+  switch (result.status) {
+    case Synth::Status::BufferNotFound:
+      set_buffer_not_found_err(state, result.buffer);
+      break;
+    case Synth::Status::WaveTypeNotFound:
+      PyErr_SetString(state->error, "Wave function not found");
+      break;
+    case Synth::Status::ReadFailed:
+      PyErr_SetString(state->error, "Read failed");
+      break;
+    case Synth::Status::WriteFailed:
+      PyErr_SetString(state->error, "Dump failed");
+      break;
+    case Synth::Status::GraphOpNotFound:
+      PyErr_SetString(state->error, "Graph operation not found");
+      break;
+    case Synth::Status::ThreadFailed:
+      PyErr_SetString(state->error, "Could not start render thread");
+      break;
+    case Synth::Status::InvalidOperator:
+      PyErr_SetString(state->error, "Operator must be modulated by later operators only");
+      break;
+    default:
+      PyErr_SetString(state->error, "Insufficient args");
+      break;
+  }
+  return NULL;
 }
 
-static PyObject* dump_buffer(PyObject *self, PyObject *args) {
-  bigint_t buffer;
-  const char* filename;
+// The signature of a METH_FASTCALL | METH_KEYWORDS binding, fixed at compile time: one code per
+// argument, in the spirit of PyArg_ParseTuple, and the name each argument takes as a keyword.
+// Arguments are read straight from the call's vector, without packing a tuple or dict.
+//   L  long long      i  int        n  Py_ssize_t    d  double
+//   K  unsigned long long, masked like PyArg_ParseTuple's K
+//   s  const char*, from a str without embedded nulls
+//   y  Py_buffer, from any contiguous buffer. Released by the binding once parsing succeeds.
+//   O  PyObject*, which must be a list
+//   o  PyObject*, of any type
+//   |  The arguments from here on are optional, and keep their initial values if not given
+struct FastArgs {
+  const char *format;
+  const char *const *keywords;
+};
 
-  if (!PyArg_ParseTuple(args, "Ls", &buffer, &filename)) {
-    PyErr_SetString(SyntherError, "Insufficient args");
-    return NULL;
+static const int max_fast_args = 16;
+
+static bool convert_fast_arg(char code, PyObject *value, void *dest) {
+  // The integer codes don't take floats, like PyArg_ParseTuple
+  bool integer = code == 'L' || code == 'i' || code == 'n' || code == 'K';
+  if (integer && PyFloat_Check(value)) {
+    return false;
+  }
+
+  switch (code) {
+    case 'L': {
+      long long v = PyLong_AsLongLong(value);
+      *static_cast<long long*>(dest) = v;
+      return !(v == -1 && PyErr_Occurred());
+    }
+    case 'i': {
+      long v = PyLong_AsLong(value);
+      if ((v == -1 && PyErr_Occurred()) || v < INT_MIN || v > INT_MAX) {
+        return false;
+      }
+      *static_cast<int*>(dest) = static_cast<int>(v);
+      return true;
+    }
+    case 'n': {
+      Py_ssize_t v = PyNumber_AsSsize_t(value, PyExc_OverflowError);
+      *static_cast<Py_ssize_t*>(dest) = v;
+      return !(v == -1 && PyErr_Occurred());
+    }
+    case 'K': {
+      unsigned long long v = PyLong_AsUnsignedLongLongMask(value);
+      *static_cast<unsigned long long*>(dest) = v;
+      return !(v == static_cast<unsigned long long>(-1) && PyErr_Occurred());
+    }
+    case 'd': {
+      double v = PyFloat_AsDouble(value);
+      *static_cast<double*>(dest) = v;
+      return !(v == -1.0 && PyErr_Occurred());
+    }
+    case 's': {
+      Py_ssize_t len;
+      const char *v = PyUnicode_Check(value) ? PyUnicode_AsUTF8AndSize(value, &len) : NULL;
+      if (v == NULL || std::strlen(v) != static_cast<size_t>(len)) {
+        return false;
+      }
+      *static_cast<const char**>(dest) = v;
+      return true;
+    }
+    case 'y':
+      return PyObject_GetBuffer(value, static_cast<Py_buffer*>(dest), PyBUF_SIMPLE) == 0;
+    case 'O':
+      if (!PyList_Check(value)) {
+        return false;
+      }
+      *static_cast<PyObject**>(dest) = value;
+      return true;
+    case 'o':
+      *static_cast<PyObject**>(dest) = value;
+      return true;
+  }
+  return false;
+}
+
+// Parses the arguments of a fast call into the pointers that follow, one per code of the
+// signature. Raises the module's usual "Insufficient args" error on anything it can't parse.
+static bool parse_fast_args(SyntherState *state, const FastArgs& sig, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames, ...) {
+  PyObject *values[max_fast_args] = {};
+  Py_ssize_t count = 0;
+  Py_ssize_t required = -1;
+  for (const char *code = sig.format; *code; ++code) {
+    if (*code == '|') {
+      required = count;
+    }
+    else {
+      ++count;
+    }
+  }
+  if (required < 0) {
+    required = count;
+  }
+
+  bool ok = nargs <= count;
+  for (Py_ssize_t i = 0; ok && i < nargs; ++i) {
+    values[i] = args[i];
+  }
+  Py_ssize_t kwcount = kwnames == NULL ? 0 : PyTuple_GET_SIZE(kwnames);
+  for (Py_ssize_t k = 0; ok && k < kwcount; ++k) {
+    PyObject *name = PyTuple_GET_ITEM(kwnames, k);
+    // Keywords are usually given in order, so each one is first looked for where it would be
+    Py_ssize_t i = count;
+    for (Py_ssize_t probe = 0; probe < count; ++probe) {
+      Py_ssize_t at = (nargs + k + probe) % count;
+      if (PyUnicode_CompareWithASCIIString(name, sig.keywords[at]) == 0) {
+        i = at;
+        break;
+      }
+    }
+    ok = i < count && values[i] == NULL;
+    if (ok) {
+      values[i] = args[nargs + k];
+    }
+  }
+
+  Py_buffer *views[max_fast_args];
+  int view_count = 0;
+  va_list out;
+  va_start(out, kwnames);
+  Py_ssize_t i = 0;
+  for (const char *code = sig.format; ok && *code; ++code) {
+    if (*code == '|') {
+      continue;
+    }
+    void *dest = va_arg(out, void*);
+    if (values[i] == NULL) {
+      ok = i >= required;
+    }
+    else {
+      ok = convert_fast_arg(*code, values[i], dest);
+      if (ok && *code == 'y') {
+        views[view_count++] = static_cast<Py_buffer*>(dest);
+      }
+    }
+    ++i;
   }
+  va_end(out);
+
+  if (!ok) {
+    for (int v = 0; v < view_count; ++v) {
+      PyBuffer_Release(views[v]);
+    }
+    PyErr_Clear();
+    PyErr_SetString(state->error, "Insufficient args");
+  }
+  return ok;
+}
 
-  auto bf = buffers.find(buffer);
-  if (bf == buffers.end()) {
-    PyErr_SetString(SyntherError, "Buffer not found");
+// METH_FASTCALL | METH_KEYWORDS functions are stored as a PyCFunction, and cast back when called
+typedef PyObject* (*FastFunction)(PyObject*, PyObject *const*, Py_ssize_t, PyObject*);
+
+static PyCFunction fast_method(FastFunction fn) {
+  return reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)(void)>(fn));
+}
+
+// Like the METH_VARARGS binding it replaced, ignores any positional arguments and takes no keywords
+static PyObject* gen_buffer(PyObject *self, PyObject *const *Py_UNUSED(args), Py_ssize_t Py_UNUSED(nargs), PyObject *kwnames) {
+  SyntherState *state = get_state(self);
+  if (kwnames != NULL && PyTuple_GET_SIZE(kwnames) > 0) {
+    PyErr_SetString(PyExc_TypeError, "gen_buffer() takes no keyword arguments");
     return NULL;
   }
+  Trace::Scope trace("gen_buffer");
+  return PyLong_FromUnsignedLongLong(state->engine->create_buffer());
+}
 
-  if (!WavIO::write_wav(filename, bf->second)) {
-    PyErr_SetString(SyntherError, "Dump failed");
+static PyObject* dump_buffer(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer", "filename"};
+  static const FastArgs signature = {"Ls", keywords};
+  SyntherState *state = get_state(self);
+  bigint_t buffer;
+  const char* filename;
+
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &buffer, &filename)) {
     return NULL;
   }
 
+  Synth::Result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = state->engine->dump_buffer(buffer, filename);
+  Py_END_ALLOW_THREADS
+  if (!result.ok()) {
+    return set_engine_err(state, result);
+  }
+
   Py_RETURN_NONE;
 }
 
-static size_t ms_to_buffer_index(bigint_t ms) {
-  //  ms    sec     44100 samples
-  //  1    1000ms       sec
-  size_t r = static_cast<size_t>(ms / 1000.0 * 44100.0 * 2.0);
-  if (r % 2 == 1) {
-    ++r;
+static PyObject* produce_wave(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer", "attack_start_ms", "attack_ms", "sustain_ms", "decay_ms", "freq_hz", "amp", "wave_type"};
+  static const FastArgs signature = {"LLLLLddi", keywords};
+  SyntherState *state = get_state(self);
+  bigint_t buffer;
+  bigint_t attack_start_ms;
+  bigint_t attack_ms;
+  bigint_t sustain_duration_ms;
+  bigint_t decay_ms;
+  double freq_hz;
+  double amp;
+  int wave_type;
+
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &buffer, &attack_start_ms, &attack_ms, &sustain_duration_ms, &decay_ms, &freq_hz, &amp, &wave_type)) {
+    return NULL;
+  }
+
+  Synth::Result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = state->engine->produce_wave(buffer, attack_start_ms, attack_ms, sustain_duration_ms, decay_ms, freq_hz, amp, wave_type);
+  Py_END_ALLOW_THREADS
+  if (!result.ok()) {
+    return set_engine_err(state, result);
   }
-  return r;
 
+  Py_RETURN_NONE;
 }
 
-static double clamp(double val, double low, double high) {
-  if (val < low) {
-    return low;
+// Parses a sequence of (freq_hz, amp[, phase[, detune_cents]]) tuples
+static bool parse_bank_voices(SyntherState *state, PyObject *voice_list, std::vector<Synth::BankVoice>& voices) {
+  PyObject *items = PySequence_Fast(voice_list, "Insufficient args");
+  if (items == NULL) {
+    return false;
   }
-  else if (val > high) {
-    return high;
-  }
-  else {
-    return val;
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(items);
+  voices.reserve(static_cast<size_t>(count));
+  for (Py_ssize_t i = 0; i < count; ++i) {
+    PyObject *item = PySequence_Fast_GET_ITEM(items, i);
+    Synth::BankVoice voice{0.0, 0.0, 0.0, 0.0};
+    if (!PyTuple_Check(item) || !PyArg_ParseTuple(item, "dd|dd", &voice.freq_hz, &voice.amp, &voice.phase, &voice.detune_cents)) {
+      Py_DECREF(items);
+      PyErr_SetString(state->error, "Insufficient args");
+      return false;
+    }
+    voices.push_back(voice);
   }
+  Py_DECREF(items);
+  return true;
 }
 
-enum class WaveType : int {
-  Sine     = 0,
-  Saw      = 1,
-  Square   = 2,
-  Triangle = 3,
-  Noise    = 4
-};
-
-static PyObject* produce_wave(PyObject *self, PyObject *args) {
+static PyObject* produce_bank(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer", "attack_start_ms", "attack_ms", "sustain_ms", "decay_ms", "voices", "wave_type", "amp"};
+  static const FastArgs signature = {"LLLLLOi|d", keywords};
+  SyntherState *state = get_state(self);
   bigint_t buffer;
   bigint_t attack_start_ms;
   bigint_t attack_ms;
-  bigint_t sustain_duration_ms;
+  bigint_t sustain_ms;
   bigint_t decay_ms;
+  PyObject *voice_list;
+  int wave_type;
+  double amp = 1.0;
+
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &buffer, &attack_start_ms, &attack_ms, &sustain_ms, &decay_ms, &voice_list, &wave_type, &amp)) {
+    return NULL;
+  }
+
+  std::vector<Synth::BankVoice> voices;
+  if (!parse_bank_voices(state, voice_list, voices)) {
+    return NULL;
+  }
+
+  Synth::Result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = state->engine->produce_bank(buffer, attack_start_ms, attack_ms, sustain_ms, decay_ms, voices, amp, wave_type);
+  Py_END_ALLOW_THREADS
+  if (!result.ok()) {
+    return set_engine_err(state, result);
+  }
+
+  Py_RETURN_NONE;
+}
+
+// Parses a sequence of (ratio, level, attack_ms, sustain_ms, decay_ms[, feedback[, modulators]]) tuples
+static bool parse_fm_operators(SyntherState *state, PyObject *operator_list, std::vector<Synth::FMOperator>& operators) {
+  PyObject *items = PySequence_Fast(operator_list, "Insufficient args");
+  if (items == NULL) {
+    return false;
+  }
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(items);
+  operators.resize(static_cast<size_t>(count));
+  bool parsed = true;
+  for (Py_ssize_t i = 0; parsed && i < count; ++i) {
+    PyObject *item = PySequence_Fast_GET_ITEM(items, i);
+    Synth::FMOperator& op = operators[static_cast<size_t>(i)];
+    PyObject *modulators = NULL;
+    op.feedback = 0.0;
+    parsed = PyTuple_Check(item) && PyArg_ParseTuple(item, "ddLLL|dO", &op.ratio, &op.level, &op.attack_ms, &op.sustain_ms, &op.decay_ms, &op.feedback, &modulators);
+    if (parsed && modulators != NULL) {
+      PyObject *indices = PySequence_Fast(modulators, "Insufficient args");
+      parsed = indices != NULL;
+      for (Py_ssize_t m = 0; parsed && m < PySequence_Fast_GET_SIZE(indices); ++m) {
+        Py_ssize_t index = PyNumber_AsSsize_t(PySequence_Fast_GET_ITEM(indices, m), NULL);
+        parsed = !(index == -1 && PyErr_Occurred());
+        // Out of range indices are left for the engine to reject
+        op.modulators.push_back(index < 0 ? SIZE_MAX : static_cast<size_t>(index));
+      }
+      Py_XDECREF(indices);
+    }
+  }
+  Py_DECREF(items);
+  if (!parsed) {
+    PyErr_SetString(state->error, "Insufficient args");
+  }
+  return parsed;
+}
+
+static PyObject* produce_fm(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer", "start_ms", "freq_hz", "operators", "amp"};
+  static const FastArgs signature = {"LLdOd", keywords};
+  SyntherState *state = get_state(self);
+  bigint_t buffer;
+  bigint_t start_ms;
   double freq_hz;
+  PyObject *operator_list;
   double amp;
-  int wave_type;
 
-  if (!PyArg_ParseTuple(args, "LLLLLddi", &buffer, &attack_start_ms, &attack_ms, &sustain_duration_ms, &decay_ms, &freq_hz, &amp, &wave_type)) {
-    PyErr_SetString(SyntherError, "Insufficient args");
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &buffer, &start_ms, &freq_hz, &operator_list, &amp)) {
     return NULL;
   }
 
-  auto bf = buffers.find(buffer);
-  if (bf == buffers.end()) {
-    set_buffer_not_found_err(buffer);
+  std::vector<Synth::FMOperator> operators;
+  if (!parse_fm_operators(state, operator_list, operators)) {
     return NULL;
   }
 
-  WaveType wt = static_cast<WaveType>(wave_type);
+  Synth::Result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = state->engine->produce_fm(buffer, start_ms, freq_hz, operators, amp);
+  Py_END_ALLOW_THREADS
+  if (!result.ok()) {
+    return set_engine_err(state, result);
+  }
 
-  constexpr double two_pi = 6.283185307179586476925286766559;
-  std::uniform_real_distribution<double> unif(-1.0,1.0);
-  std::default_random_engine re;
+  Py_RETURN_NONE;
+}
 
-  std::function<double (size_t)> wave_fn;
-  switch (wt) {
-    case WaveType::Sine:
-      wave_fn = [&](size_t n) { return sin((two_pi * n / 2.0 * freq_hz) / 44100.0); };
-      break; 
-    case WaveType::Saw:
-      wave_fn = [&](size_t n) {
-          // 44100 samples        sec
-          //  sec              freq_hz (iter)
-          size_t samples = static_cast<size_t>(floor(44100.0 / freq_hz));
-          return static_cast<double>((n / 2) % samples) / samples * 2.0 - 1.0;
-      };
-      break;
-    case WaveType::Square:
-      wave_fn = [&](size_t n) {
-        size_t samples = static_cast<size_t>(floor(44100.0 / freq_hz));
-        return (n / 2) % samples < samples / 2 ? 1.0 : -1.0;
-      };
-      break;
-    case WaveType::Triangle:
-      wave_fn = [&](size_t n) {
-        size_t samples = static_cast<size_t>(floor(44100.0 / freq_hz));
-        double saw_output = static_cast<double>((n / 2) % samples) / samples * 2.0 - 1.0;
-        return abs(saw_output) * 2.0 - 1.0;
-      };
-      break;
-    case WaveType::Noise:
-      wave_fn = [&](size_t n) {
-        return unif(re);
-      };
-      break;
-    default:
-      PyErr_SetString(SyntherError, "Wave function not found");
+// A sequencer (see Sequencer.h). Every change makes a new score, so the scores handed to renders and
+// queued on projects never change.
+typedef struct {
+  PyObject_HEAD
+  Synth::Sequencer *sequencer;
+} SequencerObject;
+
+static Synth::Sequencer* sequencer(PyObject *self) {
+  return reinterpret_cast<SequencerObject*>(self)->sequencer;
+}
+
+static void sequencer_dealloc(SequencerObject *self);
+
+static SyntherState* sequencer_state(PyObject *self) {
+  // Subclasses defined in Python (like synther.Sequencer) belong to no module, but the type they extend does
+  PyTypeObject *type = Py_TYPE(self);
+  while (type->tp_dealloc != reinterpret_cast<destructor>(sequencer_dealloc)) {
+    type = type->tp_base;
+  }
+  return get_state(PyType_GetModule(type));
+}
+
+// The score of a sequencer object, or NULL with the module's error raised if it isn't one
+static std::shared_ptr<const Synth::Score> sequencer_score(SyntherState *state, PyObject *obj) {
+  if (!PyObject_TypeCheck(obj, state->sequencer_type)) {
+    PyErr_SetString(state->error, "Insufficient args");
+    return nullptr;
+  }
+  return sequencer(obj)->score();
+}
+
+static PyObject* wrap_score(SyntherState *state, std::shared_ptr<const Synth::Score> score) {
+  SequencerObject *obj = PyObject_New(SequencerObject, state->sequencer_type);
+  if (obj == NULL) {
+    return NULL;
+  }
+  obj->sequencer = new (std::nothrow) Synth::Sequencer(std::move(score));
+  if (obj->sequencer == NULL) {
+    Py_DECREF(obj);
+    return PyErr_NoMemory();
+  }
+  return reinterpret_cast<PyObject*>(obj);
+}
+
+static PyObject* sequencer_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+  static const char *keywords[] = {"voices", NULL};
+  Py_ssize_t voices = 32;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|n", const_cast<char**>(keywords), &voices)) {
+    return NULL;
+  }
+  if (voices <= 0) {
+    PyErr_SetString(get_state(PyType_GetModule(type))->error, "Insufficient args");
+    return NULL;
+  }
+
+  SequencerObject *self = reinterpret_cast<SequencerObject*>(type->tp_alloc(type, 0));
+  if (self == NULL) {
+    return NULL;
+  }
+  self->sequencer = new (std::nothrow) Synth::Sequencer(static_cast<size_t>(voices));
+  if (self->sequencer == NULL) {
+    Py_DECREF(self);
+    return PyErr_NoMemory();
+  }
+  return reinterpret_cast<PyObject*>(self);
+}
+
+static void sequencer_dealloc(SequencerObject *self) {
+  delete self->sequencer;
+  PyTypeObject *type = Py_TYPE(self);
+  type->tp_free(reinterpret_cast<PyObject*>(self));
+  Py_DECREF(type);
+}
+
+static PyObject* sequencer_add_instrument(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"wave_type", "attack_ms", "release_ms", "amp"};
+  static const FastArgs signature = {"iLLd", keywords};
+  SyntherState *state = sequencer_state(self);
+  Synth::Instrument instrument;
+
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &instrument.wave_type, &instrument.attack_ms, &instrument.release_ms, &instrument.amp)) {
+    return NULL;
+  }
+  if (!state->engine->wavetables().valid(instrument.wave_type)) {
+    return set_engine_err(state, Synth::Result{Synth::Status::WaveTypeNotFound, 0});
+  }
+
+  int id = sequencer(self)->add_instrument(instrument, state->engine->wavetables());
+  if (id < 0) {
+    PyErr_SetString(state->error, "Insufficient args");
+    return NULL;
+  }
+  return PyLong_FromLong(id);
+}
+
+// Takes a sequence of (time_ms, kind, note, velocity[, instrument]) tuples
+static PyObject* sequencer_set_events(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"events"};
+  static const FastArgs signature = {"O", keywords};
+  SyntherState *state = sequencer_state(self);
+  PyObject *event_list;
+
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &event_list)) {
+    return NULL;
+  }
+
+  std::vector<Synth::NoteEvent> events(static_cast<size_t>(PyList_GET_SIZE(event_list)));
+  for (size_t i = 0; i < events.size(); ++i) {
+    PyObject *item = PyList_GET_ITEM(event_list, static_cast<Py_ssize_t>(i));
+    Synth::NoteEvent& e = events[i];
+    int kind;
+    e.instrument = 0;
+    if (!PyTuple_Check(item) || !PyArg_ParseTuple(item, "Liid|i", &e.time_ms, &kind, &e.note, &e.velocity, &e.instrument)) {
+      PyErr_Clear();
+      PyErr_SetString(state->error, "Insufficient args");
       return NULL;
+    }
+    e.kind = static_cast<Synth::NoteEventKind>(kind);
+  }
+
+  bool valid;
+  Py_BEGIN_ALLOW_THREADS
+  valid = sequencer(self)->set_events(std::move(events));
+  Py_END_ALLOW_THREADS
+  if (!valid) {
+    PyErr_SetString(state->error, "Events must be sorted by time, with notes 0-127 of known instruments");
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject* sequencer_duration_ms(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+  return PyLong_FromLongLong(sequencer(self)->score()->duration_ms());
+}
+
+static PyObject* sequencer_fingerprint(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+  return PyLong_FromUnsignedLongLong(sequencer(self)->score()->fingerprint());
+}
+
+static Py_ssize_t sequencer_len(PyObject *self) {
+  return static_cast<Py_ssize_t>(sequencer(self)->score()->events().size());
+}
+
+static PyMethodDef sequencer_methods[] = {
+    {"add_instrument", fast_method(sequencer_add_instrument), METH_FASTCALL | METH_KEYWORDS, "Adds an instrument, and returns its id."},
+    {"set_events", fast_method(sequencer_set_events), METH_FASTCALL | METH_KEYWORDS, "Replaces the note events of the score."},
+    {"duration_ms", sequencer_duration_ms, METH_NOARGS, "Gets the time from the start of the score until it falls silent."},
+    {"fingerprint", sequencer_fingerprint, METH_NOARGS, "Gets a hash of the score."},
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyType_Slot sequencer_slots[] = {
+  {Py_tp_new, reinterpret_cast<void*>(sequencer_new)},
+  {Py_tp_dealloc, reinterpret_cast<void*>(sequencer_dealloc)},
+  {Py_sq_length, reinterpret_cast<void*>(sequencer_len)},
+  {Py_tp_methods, sequencer_methods},
+  {Py_tp_doc, const_cast<char*>("A score of note events, played by instruments on a fixed pool of voices.")},
+  {0, NULL}
+};
+
+static PyType_Spec sequencer_spec = {
+  "_synther.Sequencer",
+  sizeof(SequencerObject),
+  0,
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+  sequencer_slots
+};
+
+static PyObject* render_sequence(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer", "sequencer", "start_ms"};
+  static const FastArgs signature = {"Lo|L", keywords};
+  SyntherState *state = get_state(self);
+  bigint_t buffer;
+  PyObject *obj;
+  bigint_t start_ms = 0;
+
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &buffer, &obj, &start_ms)) {
+    return NULL;
+  }
+  std::shared_ptr<const Synth::Score> score = sequencer_score(state, obj);
+  if (!score) {
+    return NULL;
+  }
+
+  Synth::Result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = state->engine->render_sequence(buffer, std::move(score), start_ms);
+  Py_END_ALLOW_THREADS
+  if (!result.ok()) {
+    return set_engine_err(state, result);
   }
 
-  auto& b = bf->second;
-  size_t start_index = ms_to_buffer_index(attack_start_ms);
-  size_t attack_end_index = ms_to_buffer_index(attack_start_ms + attack_ms);
-  size_t sustain_end_index = ms_to_buffer_index(attack_start_ms + attack_ms + sustain_duration_ms);
-  size_t end_index = ms_to_buffer_index(attack_start_ms + attack_ms + sustain_duration_ms + decay_ms);
+  Py_RETURN_NONE;
+}
+
+static PyObject* get_buffer_bytes(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer"};
+  static const FastArgs signature = {"L", keywords};
+  SyntherState *state = get_state(self);
+  Trace::Scope trace("get_buffer_bytes");
+  bigint_t buffer;
 
-  if (b.size() < end_index) {
-    b.resize(end_index, 0);
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &buffer)) {
+    return NULL;
   }
 
-  for (size_t n = start_index; n < end_index; n += 2) {
-    double attack_amp = 1.0;
-    if (n < attack_end_index) {
-      attack_amp = clamp(static_cast<double>(n - start_index) / (attack_end_index - start_index), 0.0, 1.0);
+  // Sized first, then copied straight into the bytes object. Retries if the buffer grows in between.
+  size_t count = 0;
+  Synth::Result result = state->engine->copy_samples(buffer, NULL, 0, count);
+  PyObject *bytes = NULL;
+  while (result.ok()) {
+    size_t capacity = count;
+    Py_XDECREF(bytes);
+    bytes = PyBytes_FromStringAndSize(NULL, static_cast<Py_ssize_t>(capacity * sizeof(uint16_t)));
+    if (bytes == NULL) {
+      return NULL;
     }
-    double decay_amp = 1.0;
-    if (n > sustain_end_index) {
-      decay_amp = clamp(1.0 - (static_cast<double>(n - sustain_end_index) / (end_index - sustain_end_index)), 0.0, 1.0);
+    uint16_t *out = reinterpret_cast<uint16_t *>(PyBytes_AS_STRING(bytes));
+    Py_BEGIN_ALLOW_THREADS
+    result = state->engine->copy_samples(buffer, out, capacity, count);
+    Py_END_ALLOW_THREADS
+    if (result.ok() && count <= capacity) {
+      if (count < capacity && _PyBytes_Resize(&bytes, static_cast<Py_ssize_t>(count * sizeof(uint16_t))) < 0) {
+        return NULL;
+      }
+      trace.samples = count;
+      return bytes;
     }
-    uint16_t value = static_cast<uint16_t>(attack_amp * decay_amp * amp * wave_fn(n));
+  }
+  Py_XDECREF(bytes);
+  return set_engine_err(state, result);
+}
+
+static PyObject* set_buffer_bytes(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer", "data"};
+  static const FastArgs signature = {"Ly", keywords};
+  SyntherState *state = get_state(self);
+  Trace::Scope trace("set_buffer_bytes");
+  bigint_t buffer;
+  Py_buffer data;
+
+  // Any contiguous buffer is accepted (bytes, bytearray, mmap, ...), without an intermediate copy
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &buffer, &data)) {
+    return NULL;
+  }
+
+  // Buffers don't always end on a whole frame, so neither does their byte layout
+  if (data.len % sizeof(uint16_t) != 0) {
+    PyBuffer_Release(&data);
+    PyErr_SetString(state->error, "Byte length must be a whole number of samples");
+    return NULL;
+  }
 
-    // Additive synthesis
-    b[n] += value;
-    b[n+1] += value;
+  size_t samples = static_cast<size_t>(data.len) / sizeof(uint16_t);
+  Synth::Result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = state->engine->set_samples(buffer, static_cast<const uint16_t *>(data.buf), samples);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&data);
+  if (!result.ok()) {
+    return set_engine_err(state, result);
   }
+  trace.samples = samples;
 
   Py_RETURN_NONE;
 }
 
-static PyObject* get_buffer_bytes(PyObject *self, PyObject *args) {
+static PyObject* get_buffer_capacity(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer"};
+  static const FastArgs signature = {"L", keywords};
+  SyntherState *state = get_state(self);
+  Trace::Scope trace("get_buffer_capacity");
   bigint_t buffer;
 
-  if (!PyArg_ParseTuple(args, "L", &buffer)) {
-    PyErr_SetString(SyntherError, "Insufficient args");
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &buffer)) {
     return NULL;
   }
 
-  auto bf = buffers.find(buffer);
-  if (bf == buffers.end()) {
-    set_buffer_not_found_err(buffer);
-    return NULL;
+  size_t bytes = 0;
+  Synth::Result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = state->engine->capacity_bytes(buffer, bytes);
+  Py_END_ALLOW_THREADS
+  if (!result.ok()) {
+    return set_engine_err(state, result);
   }
 
-  return PyBytes_FromStringAndSize((const char *)&(bf->second[0]), bf->second.size() * sizeof(uint16_t));
+  return PyLong_FromSize_t(bytes);
 }
 
-static PyObject* free_buffer(PyObject *self, PyObject *args) {
+static PyObject* clear_buffer(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer"};
+  static const FastArgs signature = {"L", keywords};
+  SyntherState *state = get_state(self);
+  Trace::Scope trace("clear_buffer");
   bigint_t buffer;
 
-  if (!PyArg_ParseTuple(args, "L", &buffer)) {
-    PyErr_SetString(SyntherError, "Insufficient args");
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &buffer)) {
+    return NULL;
+  }
+
+  Synth::Result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = state->engine->clear_buffer(buffer);
+  Py_END_ALLOW_THREADS
+  if (!result.ok()) {
+    return set_engine_err(state, result);
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* hash_bytes(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"data", "seed"};
+  static const FastArgs signature = {"y|K", keywords};
+  SyntherState *state = get_state(self);
+  Trace::Scope trace("hash_bytes");
+  Py_buffer data;
+  unsigned long long seed = 0;
+
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &data, &seed)) {
+    return NULL;
+  }
+
+  uint64_t hash = Synth::hash64(data.buf, static_cast<size_t>(data.len), seed);
+  PyBuffer_Release(&data);
+  return PyLong_FromUnsignedLongLong(hash);
+}
+
+static PyObject* register_wavetable(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"samples"};
+  static const FastArgs signature = {"O", keywords};
+  SyntherState *state = get_state(self);
+  Trace::Scope trace("register_wavetable");
+  PyObject *sample_list;
+
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &sample_list)) {
+    return NULL;
+  }
+
+  PyObject *items = PySequence_Fast(sample_list, "Insufficient args");
+  if (items == NULL) {
     return NULL;
   }
+  std::vector<double> cycle(static_cast<size_t>(PySequence_Fast_GET_SIZE(items)));
+  for (size_t i = 0; i < cycle.size(); ++i) {
+    cycle[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(items, static_cast<Py_ssize_t>(i)));
+    if (cycle[i] == -1.0 && PyErr_Occurred()) {
+      Py_DECREF(items);
+      return NULL;
+    }
+  }
+  Py_DECREF(items);
+
+  int wave_type;
+  Py_BEGIN_ALLOW_THREADS
+  wave_type = state->engine->register_wavetable(cycle);
+  Py_END_ALLOW_THREADS
+  trace.samples = cycle.size();
+  if (wave_type < 0) {
+    PyErr_SetString(state->error, "Insufficient args");
+    return NULL;
+  }
+  return PyLong_FromLong(wave_type);
+}
 
-  auto bf = buffers.find(buffer);
-  if (bf == buffers.end()) {
-    set_buffer_not_found_err(buffer);
+static PyObject* free_buffer(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer"};
+  static const FastArgs signature = {"L", keywords};
+  SyntherState *state = get_state(self);
+  Trace::Scope trace("free_buffer");
+  bigint_t buffer;
+
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &buffer)) {
     return NULL;
   }
 
-  buffers.erase(bf);
+  Synth::Result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = state->engine->free_buffer(buffer);
+  Py_END_ALLOW_THREADS
+  if (!result.ok()) {
+    return set_engine_err(state, result);
+  }
 
   Py_RETURN_NONE;
 }
 
-static PyObject* sample_file(PyObject *self, PyObject *args) {
+static PyObject* sample_file(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer", "filename", "buffer_start_ms", "sample_start_ms", "duration_ms"};
+  static const FastArgs signature = {"LsLLL", keywords};
+  SyntherState *state = get_state(self);
   bigint_t buffer;
   const char* filename;
   bigint_t buffer_start_ms;
   bigint_t sample_start_ms;
   bigint_t duration_ms;
 
-  if (!PyArg_ParseTuple(args, "LsLLL", &buffer, &filename, &buffer_start_ms, &sample_start_ms, &duration_ms)) {
-    PyErr_SetString(SyntherError, "Insufficient args");
-    return NULL;
-  }
-
-  auto bf = buffers.find(buffer);
-  if (bf == buffers.end()) {
-    set_buffer_not_found_err(buffer);
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &buffer, &filename, &buffer_start_ms, &sample_start_ms, &duration_ms)) {
     return NULL;
   }
 
-  if (!WavIO::sample_wav(filename, bf->second, buffer_start_ms, sample_start_ms, duration_ms)) {
-    PyErr_SetString(SyntherError, "Read failed");
-    return NULL;
+  Synth::Result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = state->engine->sample_file(buffer, filename, buffer_start_ms, sample_start_ms, duration_ms);
+  Py_END_ALLOW_THREADS
+  if (!result.ok()) {
+    return set_engine_err(state, result);
   }
 
   Py_RETURN_NONE;
 }
 
-static PyObject* sample_buffer(PyObject *self, PyObject *args) {
+static PyObject* sample_buffer(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"target_buffer", "source_buffer", "source_start_ms", "target_start_ms", "duration_ms"};
+  static const FastArgs signature = {"LLLLL", keywords};
+  SyntherState *state = get_state(self);
   bigint_t target_buffer;
   bigint_t source_buffer;
   bigint_t source_buffer_start_ms;
   bigint_t target_buffer_start_ms;
   bigint_t duration_ms;
 
-  if (!PyArg_ParseTuple(args, "LLLLL", &target_buffer, &source_buffer, &source_buffer_start_ms, &target_buffer_start_ms, &duration_ms)) {
-    PyErr_SetString(SyntherError, "Insufficient args");
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &target_buffer, &source_buffer, &source_buffer_start_ms, &target_buffer_start_ms, &duration_ms)) {
     return NULL;
   }
 
-  auto bf_target = buffers.find(target_buffer);
-  if (bf_target == buffers.end()) {
-    set_buffer_not_found_err(target_buffer);
-    return NULL;
+  Synth::Result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = state->engine->sample_buffer(target_buffer, source_buffer, source_buffer_start_ms, target_buffer_start_ms, duration_ms);
+  Py_END_ALLOW_THREADS
+  if (!result.ok()) {
+    return set_engine_err(state, result);
   }
 
-  auto bf_source = buffers.find(source_buffer);
-  if (bf_source == buffers.end()) {
-    set_buffer_not_found_err(source_buffer);
-    return NULL;
-  }
+  Py_RETURN_NONE;
+}
 
-  if (bf_source->second.size() == 0) {
-    Py_RETURN_NONE;
-  }
+// Parses a list of operation tuples, each starting with its Synth::GraphOpKind and followed by
+// the arguments of the matching module function. Unknown kinds are left for the engine to reject.
+static bool parse_graph_ops(SyntherState *state, PyObject *op_list, std::vector<Synth::GraphOpSpec>& ops) {
+  Py_ssize_t op_count = PyList_Size(op_list);
+  ops.reserve(static_cast<size_t>(op_count));
 
-  size_t src_buf_start_index = ms_to_buffer_index(source_buffer_start_ms);
-  size_t src_buf_end_index = duration_ms == 0 ? 
-    bf_source->second.size() - 2 : 
-    ms_to_buffer_index(source_buffer_start_ms + duration_ms);
+  for (Py_ssize_t i = 0; i < op_count; ++i) {
+    PyObject *item = PyList_GetItem(op_list, i);
+    int kind;
+    if (!PyTuple_Check(item) || PyTuple_Size(item) < 1 || !PyArg_Parse(PyTuple_GetItem(item, 0), "i", &kind)) {
+      PyErr_SetString(state->error, "Insufficient args");
+      return false;
+    }
 
-  if (src_buf_start_index + 1 >= bf_source->second.size()) {
-    src_buf_start_index = bf_source->second.size() - 2;
+    bool parsed = true;
+    bigint_t target = 0, source = 0, start_ms = 0, source_start_ms = 0, attack_ms = 0, sustain_ms = 0, decay_ms = 0, duration_ms = 0;
+    double freq_hz = 0.0, amp = 0.0;
+    int wave_type = 0;
+    const char* filename = "";
+    switch (static_cast<Synth::GraphOpKind>(kind)) {
+      case Synth::GraphOpKind::ProduceWave:
+        parsed = PyArg_ParseTuple(item, "iLLLLLddi", &kind, &target, &start_ms, &attack_ms, &sustain_ms, &decay_ms, &freq_hz, &amp, &wave_type);
+        ops.push_back(Synth::GraphOpSpec::wave(target, start_ms, attack_ms, sustain_ms, decay_ms, freq_hz, amp, wave_type));
+        break;
+      case Synth::GraphOpKind::SampleFile:
+        parsed = PyArg_ParseTuple(item, "iLsLLL", &kind, &target, &filename, &start_ms, &source_start_ms, &duration_ms);
+        ops.push_back(Synth::GraphOpSpec::file(target, filename, start_ms, source_start_ms, duration_ms));
+        break;
+      case Synth::GraphOpKind::SampleBuffer:
+        parsed = PyArg_ParseTuple(item, "iLLLLL", &kind, &target, &source, &source_start_ms, &start_ms, &duration_ms);
+        ops.push_back(Synth::GraphOpSpec::mix(target, source, source_start_ms, start_ms, duration_ms));
+        break;
+      case Synth::GraphOpKind::RenderSequence: {
+        PyObject *obj = NULL;
+        parsed = PyArg_ParseTuple(item, "iLOL", &kind, &target, &obj, &start_ms);
+        std::shared_ptr<const Synth::Score> score = parsed ? sequencer_score(state, obj) : nullptr;
+        if (parsed && !score) {
+          return false;
+        }
+        ops.push_back(Synth::GraphOpSpec::sequence(target, std::move(score), start_ms));
+        break;
+      }
+      default:
+        ops.push_back(Synth::GraphOpSpec());
+        ops.back().kind = static_cast<Synth::GraphOpKind>(kind);
+        break;
+    }
+    if (!parsed) {
+      PyErr_SetString(state->error, "Insufficient args");
+      return false;
+    }
   }
+  return true;
+}
 
-  if (src_buf_end_index + 1 >= bf_source->second.size()) {
-    src_buf_end_index = bf_source->second.size() - 2;
-  }
+static PyObject* render_graph(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"ops", "tile_frames"};
+  static const FastArgs signature = {"On", keywords};
+  SyntherState *state = get_state(self);
+  PyObject *op_list;
+  Py_ssize_t tile_frames;
 
-  size_t tar_buf_start_index = ms_to_buffer_index(target_buffer_start_ms);
-  size_t tar_buf_end_index = src_buf_end_index - src_buf_start_index + tar_buf_start_index;
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &op_list, &tile_frames) || tile_frames <= 0) {
+    PyErr_SetString(state->error, "Insufficient args");
+    return NULL;
+  }
 
-  if (tar_buf_end_index + 1 >= bf_target->second.size()) {
-    bf_target->second.resize(tar_buf_end_index + 1, 0);
+  std::vector<Synth::GraphOpSpec> ops;
+  if (!parse_graph_ops(state, op_list, ops)) {
+    return NULL;
   }
-  
-  for (
-    size_t tar_n = tar_buf_start_index, src_n = src_buf_start_index; 
-    tar_n + 1 < tar_buf_end_index &&
-    src_n + 1 < src_buf_end_index &&
-    tar_n + 1 < bf_target->second.size() &&
-    src_n + 1 < bf_source->second.size();
-    tar_n += 2, src_n += 2
-  ) 
-  {
-    bf_target->second[tar_n] += bf_source->second[src_n];
-    bf_target->second[tar_n + 1] += bf_source->second[src_n + 1];
+
+  Synth::Result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = state->engine->render_graph(ops, static_cast<size_t>(tile_frames));
+  Py_END_ALLOW_THREADS
+  if (!result.ok()) {
+    return set_engine_err(state, result);
   }
 
   Py_RETURN_NONE;
 }
 
-static PyMethodDef SyntherMethods[] = {
-    {"gen_buffer",  gen_buffer, METH_VARARGS, "Generates a new audio buffer."},
-    {"produce_wave", produce_wave, METH_VARARGS, "Produces a wave audio signal in a buffer."},
-    {"dump_buffer", dump_buffer, METH_VARARGS, "Saves the buffer as a .wav file."},
-    {"get_buffer_bytes", get_buffer_bytes, METH_VARARGS, "Grabs the data from buffer memory for analysis in Python."},
-    {"free_buffer", free_buffer, METH_VARARGS, "Frees a buffer from memory."},
-    {"sample_file", sample_file, METH_VARARGS, "Samples waveform from a .wav file, and inserts into a buffer."},
-    {"sample_buffer", sample_buffer, METH_VARARGS, "Samples waveform from a source buffer, and inserts into target buffer."},
+static PyObject* set_lazy(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"enabled", "tile_frames"};
+  static const FastArgs signature = {"i|n", keywords};
+  SyntherState *state = get_state(self);
+  Trace::Scope trace("set_lazy");
+  int enabled;
+  Py_ssize_t tile_frames = 4096;
 
-    {NULL, NULL, 0, NULL}        /* Sentinel */
-};
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &enabled, &tile_frames) || tile_frames <= 0) {
+    PyErr_SetString(state->error, "Insufficient args");
+    return NULL;
+  }
 
-static struct PyModuleDef module = {
-  PyModuleDef_HEAD_INIT,
-  "_synther",   /* name of module */
-  synther_doc, /* module documentation, may be NULL */
-  -1,       /* size of per-interpreter state of the module,
-                or -1 if the module keeps state in global variables. */
-  SyntherMethods
-};
+  Synth::Result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = state->engine->set_lazy(enabled != 0, static_cast<size_t>(tile_frames));
+  Py_END_ALLOW_THREADS
+  if (!result.ok()) {
+    return set_engine_err(state, result);
+  }
 
-PyMODINIT_FUNC
-PyInit__synther(void) {
-  PyObject *m;
+  Py_RETURN_NONE;
+}
 
-  m = PyModule_Create(&module);
-  if (m == NULL)
-    return NULL;
+static PyObject* flush(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer"};
+  static const FastArgs signature = {"|L", keywords};
+  SyntherState *state = get_state(self);
+  bigint_t buffer = 0; // No buffer has id 0, so it stands for all of them
 
-  SyntherError = PyErr_NewException("synther.error", NULL, NULL);
-  Py_XINCREF(SyntherError);
-  if (PyModule_AddObject(m, "error", SyntherError) < 0) {
-    Py_XDECREF(SyntherError);
-    Py_CLEAR(SyntherError);
-    Py_DECREF(m);
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &buffer)) {
     return NULL;
   }
 
-  return m;
+  Synth::Result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = buffer == 0 ? state->engine->flush() : state->engine->flush(buffer);
+  Py_END_ALLOW_THREADS
+  if (!result.ok()) {
+    return set_engine_err(state, result);
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* set_note_cache_limit(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"max_bytes"};
+  static const FastArgs signature = {"n", keywords};
+  SyntherState *state = get_state(self);
+  Trace::Scope trace("set_note_cache_limit");
+  Py_ssize_t max_bytes;
+
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &max_bytes) || max_bytes < 0) {
+    PyErr_SetString(state->error, "Insufficient args");
+    return NULL;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  state->engine->set_note_cache_limit(static_cast<size_t>(max_bytes));
+  Py_END_ALLOW_THREADS
+
+  Py_RETURN_NONE;
+}
+
+typedef struct {
+  PyObject_HEAD
+  Synth::Stream *stream;
+} RenderStreamObject;
+
+// A block handed out by a stream. Exposes its slot of the ring through the buffer protocol, as
+// read-only interleaved signed 16 bit samples, and keeps the stream alive while viewed.
+typedef struct {
+  PyObject_HEAD
+  PyObject *stream;
+  const uint16_t *data;
+  Py_ssize_t samples;
+  Py_ssize_t itemsize;
+} RenderBlockObject;
+
+static void render_stream_close_impl(RenderStreamObject *self) {
+  if (self->stream == NULL) {
+    return;
+  }
+  Synth::Stream *stream = self->stream;
+  Py_BEGIN_ALLOW_THREADS
+  stream->close();
+  Py_END_ALLOW_THREADS
+}
+
+static void render_stream_dealloc(RenderStreamObject *self) {
+  if (self->stream != NULL) {
+    render_stream_close_impl(self);
+    delete self->stream;
+  }
+  PyTypeObject *type = Py_TYPE(self);
+  type->tp_free(reinterpret_cast<PyObject*>(self));
+  Py_DECREF(type);
+}
+
+static PyObject* render_stream_close(RenderStreamObject *self, PyObject *Py_UNUSED(ignored)) {
+  render_stream_close_impl(self);
+  Py_RETURN_NONE;
+}
+
+static int render_block_getbuffer(RenderBlockObject *self, Py_buffer *view, int flags) {
+  if (flags & PyBUF_WRITABLE) {
+    PyErr_SetString(PyExc_BufferError, "Stream blocks are read-only");
+    return -1;
+  }
+  view->obj = reinterpret_cast<PyObject*>(self);
+  Py_INCREF(view->obj);
+  view->buf = const_cast<uint16_t*>(self->data);
+  view->len = self->samples * self->itemsize;
+  view->readonly = 1;
+  view->itemsize = self->itemsize;
+  view->format = (flags & PyBUF_FORMAT) ? const_cast<char*>("h") : NULL;
+  view->ndim = 1;
+  view->shape = (flags & PyBUF_ND) ? &self->samples : NULL;
+  view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &self->itemsize : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  return 0;
+}
+
+static void render_block_dealloc(RenderBlockObject *self) {
+  Py_XDECREF(self->stream);
+  PyTypeObject *type = Py_TYPE(self);
+  type->tp_free(reinterpret_cast<PyObject*>(self));
+  Py_DECREF(type);
+}
+
+static PyType_Slot render_block_slots[] = {
+  {Py_tp_dealloc, reinterpret_cast<void*>(render_block_dealloc)},
+  {Py_bf_getbuffer, reinterpret_cast<void*>(render_block_getbuffer)},
+  {Py_tp_doc, const_cast<char*>("A block of samples from a render stream.")},
+  {0, NULL}
+};
+
+static PyObject* render_stream_next(RenderStreamObject *self) {
+  if (self->stream == NULL) {
+    return NULL;
+  }
+  SyntherState *state = get_state(PyType_GetModule(Py_TYPE(self)));
+
+  // Hands the previous block back to the producer, then waits for the next one
+  Synth::Stream *stream = self->stream;
+  const uint16_t *data = NULL;
+  size_t samples = 0;
+  bool more;
+  Py_BEGIN_ALLOW_THREADS
+  more = stream->next(data, samples);
+  Py_END_ALLOW_THREADS
+
+  if (!more) {
+    if (stream->failed()) {
+      PyErr_SetString(state->error, "Render failed");
+    }
+    return NULL;
+  }
+
+  RenderBlockObject *block = PyObject_New(RenderBlockObject, state->block_type);
+  if (block == NULL) {
+    return NULL;
+  }
+  Py_INCREF(self);
+  block->stream = reinterpret_cast<PyObject*>(self);
+  block->data = data;
+  block->samples = static_cast<Py_ssize_t>(samples);
+  block->itemsize = sizeof(uint16_t);
+  PyObject *view = PyMemoryView_FromObject(reinterpret_cast<PyObject*>(block));
+  Py_DECREF(block);
+  return view;
+}
+
+static PyMethodDef render_stream_methods[] = {
+    {"close", reinterpret_cast<PyCFunction>(render_stream_close), METH_NOARGS, "Stops the render and waits for its thread to exit."},
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyType_Slot render_stream_slots[] = {
+  {Py_tp_dealloc, reinterpret_cast<void*>(render_stream_dealloc)},
+  {Py_tp_iter, reinterpret_cast<void*>(PyObject_SelfIter)},
+  {Py_tp_iternext, reinterpret_cast<void*>(render_stream_next)},
+  {Py_tp_methods, render_stream_methods},
+  {Py_tp_doc, const_cast<char*>("Iterates over the blocks of a render as they are produced.")},
+  {0, NULL}
+};
+
+// Only created by stream_graph() and stream_buffer()
+#ifdef Py_TPFLAGS_DISALLOW_INSTANTIATION
+static const unsigned int native_type_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION;
+#else
+static const unsigned int native_type_flags = Py_TPFLAGS_DEFAULT;
+#endif
+
+static PyType_Spec render_block_spec = {
+  "_synther.RenderBlock",
+  sizeof(RenderBlockObject),
+  0,
+  native_type_flags,
+  render_block_slots
+};
+
+static PyType_Spec render_stream_spec = {
+  "_synther.RenderStream",
+  sizeof(RenderStreamObject),
+  0,
+  native_type_flags,
+  render_stream_slots
+};
+
+// Wraps a started engine stream in a Python iterator
+static PyObject* wrap_stream(SyntherState *state, std::unique_ptr<Synth::Stream> stream) {
+  RenderStreamObject *self = PyObject_New(RenderStreamObject, state->stream_type);
+  if (self == NULL) {
+    return NULL;
+  }
+  self->stream = stream.release();
+  return reinterpret_cast<PyObject*>(self);
+}
+
+static PyObject* stream_graph(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"ops", "output", "block_frames", "slots"};
+  static const FastArgs signature = {"OLn|n", keywords};
+  SyntherState *state = get_state(self);
+  Trace::Scope trace("stream_graph");
+  PyObject *op_list;
+  bigint_t output;
+  Py_ssize_t block_frames;
+  Py_ssize_t slot_count = 8;
+
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &op_list, &output, &block_frames, &slot_count) || block_frames <= 0 || slot_count <= 0) {
+    PyErr_SetString(state->error, "Insufficient args");
+    return NULL;
+  }
+
+  std::vector<Synth::GraphOpSpec> ops;
+  if (!parse_graph_ops(state, op_list, ops)) {
+    return NULL;
+  }
+
+  std::unique_ptr<Synth::Stream> stream;
+  Synth::Result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = state->engine->stream_graph(ops, output, static_cast<size_t>(block_frames), static_cast<size_t>(slot_count), stream);
+  Py_END_ALLOW_THREADS
+  if (!result.ok()) {
+    return set_engine_err(state, result);
+  }
+  return wrap_stream(state, std::move(stream));
+}
+
+static PyObject* stream_buffer(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer", "block_frames", "slots"};
+  static const FastArgs signature = {"Ln|n", keywords};
+  SyntherState *state = get_state(self);
+  Trace::Scope trace("stream_buffer");
+  bigint_t buffer;
+  Py_ssize_t block_frames;
+  Py_ssize_t slot_count = 8;
+
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &buffer, &block_frames, &slot_count) || block_frames <= 0 || slot_count <= 0) {
+    PyErr_SetString(state->error, "Insufficient args");
+    return NULL;
+  }
+
+  std::unique_ptr<Synth::Stream> stream;
+  Synth::Result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = state->engine->stream_buffer(buffer, static_cast<size_t>(block_frames), static_cast<size_t>(slot_count), stream);
+  Py_END_ALLOW_THREADS
+  if (!result.ok()) {
+    return set_engine_err(state, result);
+  }
+  return wrap_stream(state, std::move(stream));
+}
+
+// A project's command log (see CommandLog.h). The build system in synther.py records every queued
+// command here, and reads back the ones it renders.
+typedef struct {
+  PyObject_HEAD
+  Synth::CommandLog *log;
+} CommandLogObject;
+
+static Synth::CommandLog* command_log(PyObject *self) {
+  return reinterpret_cast<CommandLogObject*>(self)->log;
+}
+
+static SyntherState* command_log_state(PyObject *self) {
+  return get_state(PyType_GetModule(Py_TYPE(self)));
+}
+
+static PyObject* command_log_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+  static const char *keywords[] = {"seed", NULL};
+  unsigned long long seed = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|K", const_cast<char**>(keywords), &seed)) {
+    return NULL;
+  }
+
+  CommandLogObject *self = reinterpret_cast<CommandLogObject*>(type->tp_alloc(type, 0));
+  if (self == NULL) {
+    return NULL;
+  }
+  self->log = new (std::nothrow) Synth::CommandLog(seed);
+  if (self->log == NULL) {
+    Py_DECREF(self);
+    return PyErr_NoMemory();
+  }
+  return reinterpret_cast<PyObject*>(self);
+}
+
+static void command_log_dealloc(CommandLogObject *self) {
+  delete self->log;
+  PyTypeObject *type = Py_TYPE(self);
+  type->tp_free(reinterpret_cast<PyObject*>(self));
+  Py_DECREF(type);
+}
+
+static Py_ssize_t command_log_len(PyObject *self) {
+  return static_cast<Py_ssize_t>(command_log(self)->size());
+}
+
+static PyObject* command_log_gen_buffer(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+  return PyLong_FromLongLong(command_log(self)->gen_buffer());
+}
+
+static PyObject* command_log_produce_wave(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer", "attack_start_ms", "attack_ms", "sustain_ms", "decay_ms", "freq_hz", "amp", "wave_type"};
+  static const FastArgs signature = {"LLLLLddi", keywords};
+  bigint_t buffer, attack_start_ms, attack_ms, sustain_ms, decay_ms;
+  double freq_hz, amp;
+  int wave_type;
+
+  if (!parse_fast_args(command_log_state(self), signature, args, nargs, kwnames, &buffer, &attack_start_ms, &attack_ms, &sustain_ms, &decay_ms, &freq_hz, &amp, &wave_type)) {
+    return NULL;
+  }
+
+  command_log(self)->produce_wave(buffer, attack_start_ms, attack_ms, sustain_ms, decay_ms, freq_hz, amp, wave_type,
+                                 command_log_state(self)->engine->wavetables().fingerprint(wave_type));
+  Py_RETURN_NONE;
+}
+
+static PyObject* command_log_sample_file(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer", "filename", "buffer_start_ms", "sample_start_ms", "duration_ms"};
+  static const FastArgs signature = {"LsLLL", keywords};
+  bigint_t buffer, buffer_start_ms, sample_start_ms, duration_ms;
+  const char *filename;
+
+  if (!parse_fast_args(command_log_state(self), signature, args, nargs, kwnames, &buffer, &filename, &buffer_start_ms, &sample_start_ms, &duration_ms)) {
+    return NULL;
+  }
+
+  command_log(self)->sample_file(buffer, filename, buffer_start_ms, sample_start_ms, duration_ms);
+  Py_RETURN_NONE;
+}
+
+static PyObject* command_log_sample_buffer(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"target_buffer", "source_buffer", "target_buffer_start_ms", "source_buffer_start_ms", "duration_ms"};
+  static const FastArgs signature = {"LLLLL", keywords};
+  bigint_t target, source, target_start_ms, source_start_ms, duration_ms;
+
+  if (!parse_fast_args(command_log_state(self), signature, args, nargs, kwnames, &target, &source, &target_start_ms, &source_start_ms, &duration_ms)) {
+    return NULL;
+  }
+
+  command_log(self)->sample_buffer(target, source, target_start_ms, source_start_ms, duration_ms);
+  Py_RETURN_NONE;
+}
+
+static PyObject* command_log_dump_buffer(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer", "filename"};
+  static const FastArgs signature = {"Ls", keywords};
+  bigint_t buffer;
+  const char *filename;
+
+  if (!parse_fast_args(command_log_state(self), signature, args, nargs, kwnames, &buffer, &filename)) {
+    return NULL;
+  }
+
+  command_log(self)->dump_buffer(buffer, filename);
+  Py_RETURN_NONE;
+}
+
+// Queues a score, fixed as the sequencer holds it right now
+static PyObject* command_log_render_sequence(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"buffer", "sequencer", "start_ms"};
+  static const FastArgs signature = {"Lo|L", keywords};
+  SyntherState *state = command_log_state(self);
+  bigint_t buffer;
+  PyObject *obj;
+  bigint_t start_ms = 0;
+
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &buffer, &obj, &start_ms)) {
+    return NULL;
+  }
+  std::shared_ptr<const Synth::Score> score = sequencer_score(state, obj);
+  if (!score) {
+    return NULL;
+  }
+  command_log(self)->render_sequence(buffer, std::move(score), start_ms);
+  Py_RETURN_NONE;
+}
+
+// Reads a command back as (kind, buffer, args, dependencies, fingerprint, file_inputs), with the
+// args as they were queued
+static PyObject* command_log_command(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"id"};
+  static const FastArgs signature = {"n", keywords};
+  SyntherState *state = command_log_state(self);
+  Py_ssize_t id;
+
+  Synth::Command cmd;
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &id)) {
+    return NULL;
+  }
+  if (id < 0 || id >= static_cast<Py_ssize_t>(Synth::no_command) || !command_log(self)->command(static_cast<Synth::CommandId>(id), cmd)) {
+    PyErr_SetString(state->error, "Command not found");
+    return NULL;
+  }
+
+  PyObject *cmd_args = NULL;
+  switch (cmd.kind) {
+    case Synth::CommandKind::GenBuffer:
+      cmd_args = Py_BuildValue("(L)", cmd.buffer);
+      break;
+    case Synth::CommandKind::ProduceWave:
+      cmd_args = Py_BuildValue("(LLLLLddi)", cmd.buffer, cmd.wave.attack_start_ms, cmd.wave.attack_ms, cmd.wave.sustain_ms, cmd.wave.decay_ms,
+        cmd.wave.freq_hz, cmd.wave.amp, static_cast<int>(cmd.wave.wave_type));
+      break;
+    case Synth::CommandKind::SampleFile:
+      cmd_args = Py_BuildValue("(LsLLL)", cmd.buffer, cmd.filename.c_str(), cmd.file.buffer_start_ms, cmd.file.sample_start_ms, cmd.file.duration_ms);
+      break;
+    case Synth::CommandKind::SampleBuffer:
+      cmd_args = Py_BuildValue("(LLLLL)", cmd.buffer, cmd.mix.source, cmd.mix.start_ms[0], cmd.mix.start_ms[1], cmd.mix.duration_ms);
+      break;
+    case Synth::CommandKind::DumpBuffer:
+      cmd_args = Py_BuildValue("(Ls)", cmd.buffer, cmd.filename.c_str());
+      break;
+    case Synth::CommandKind::RenderSequence:
+      // A sequencer of its own, so changes to the one it was queued from don't reach it
+      cmd_args = Py_BuildValue("(LNL)", cmd.buffer, wrap_score(state, cmd.sequence.score), cmd.sequence.start_ms);
+      break;
+  }
+  if (cmd_args == NULL) {
+    return NULL;
+  }
+
+  PyObject *deps;
+  if (cmd.dependency != Synth::no_command && cmd.source_dependency != Synth::no_command) {
+    deps = Py_BuildValue("(II)", cmd.dependency, cmd.source_dependency);
+  }
+  else if (cmd.dependency != Synth::no_command || cmd.source_dependency != Synth::no_command) {
+    deps = Py_BuildValue("(I)", cmd.dependency != Synth::no_command ? cmd.dependency : cmd.source_dependency);
+  }
+  else {
+    deps = PyTuple_New(0);
+  }
+  if (deps == NULL) {
+    Py_DECREF(cmd_args);
+    return NULL;
+  }
+
+  return Py_BuildValue("(iLNNKN)", static_cast<int>(cmd.kind), cmd.buffer, cmd_args, deps,
+    static_cast<unsigned long long>(cmd.fingerprint), PyBool_FromLong(cmd.file_inputs));
+}
+
+static PyObject* command_id_list(const std::vector<Synth::CommandId>& ids) {
+  PyObject *list = PyList_New(static_cast<Py_ssize_t>(ids.size()));
+  if (list == NULL) {
+    return NULL;
+  }
+  for (size_t i = 0; i < ids.size(); ++i) {
+    PyObject *item = PyLong_FromUnsignedLong(ids[i]);
+    if (item == NULL) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, static_cast<Py_ssize_t>(i), item);
+  }
+  return list;
+}
+
+static PyObject* command_log_find(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"kind"};
+  static const FastArgs signature = {"i", keywords};
+  int kind;
+
+  if (!parse_fast_args(command_log_state(self), signature, args, nargs, kwnames, &kind)) {
+    return NULL;
+  }
+
+  return command_id_list(command_log(self)->find(static_cast<Synth::CommandKind>(kind)));
+}
+
+static PyObject* command_log_latest_commands(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+  return command_id_list(command_log(self)->latest_commands());
+}
+
+static PyObject* command_log_mix_sources(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+  return command_id_list(command_log(self)->mix_sources());
+}
+
+static PyObject* command_log_filenames(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+  std::vector<std::string> names = command_log(self)->filenames();
+  PyObject *list = PyList_New(static_cast<Py_ssize_t>(names.size()));
+  if (list == NULL) {
+    return NULL;
+  }
+  for (size_t i = 0; i < names.size(); ++i) {
+    PyObject *item = PyUnicode_FromString(names[i].c_str());
+    if (item == NULL) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, static_cast<Py_ssize_t>(i), item);
+  }
+  return list;
+}
+
+// Takes the modification time of every file name, or None for files that don't exist, and returns
+// a dict of command id to the key of the buffer state, for the commands downstream of sampled files
+static PyObject* command_log_resolve_file_inputs(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"mtimes"};
+  static const FastArgs signature = {"O", keywords};
+  PyObject *mtime_list;
+
+  if (!parse_fast_args(command_log_state(self), signature, args, nargs, kwnames, &mtime_list)) {
+    return NULL;
+  }
+
+  std::vector<double> mtimes(static_cast<size_t>(PyList_GET_SIZE(mtime_list)));
+  for (size_t i = 0; i < mtimes.size(); ++i) {
+    PyObject *mtime = PyList_GET_ITEM(mtime_list, static_cast<Py_ssize_t>(i));
+    mtimes[i] = mtime == Py_None ? NAN : PyFloat_AsDouble(mtime);
+    if (mtimes[i] == -1.0 && PyErr_Occurred()) {
+      return NULL;
+    }
+  }
+
+  std::vector<std::pair<Synth::CommandId, uint64_t>> keys = command_log(self)->resolve_file_inputs(mtimes);
+  PyObject *resolved = PyDict_New();
+  for (size_t i = 0; resolved != NULL && i < keys.size(); ++i) {
+    PyObject *id = PyLong_FromUnsignedLong(keys[i].first);
+    PyObject *key = PyLong_FromUnsignedLongLong(keys[i].second);
+    if (id == NULL || key == NULL || PyDict_SetItem(resolved, id, key) < 0) {
+      Py_CLEAR(resolved);
+    }
+    Py_XDECREF(id);
+    Py_XDECREF(key);
+  }
+  return resolved;
+}
+
+static PyObject* command_log_memory_bytes(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+  return PyLong_FromSize_t(command_log(self)->memory_bytes());
+}
+
+static PyObject* command_log_sizeof(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+  return PyLong_FromSize_t(sizeof(CommandLogObject) + sizeof(Synth::CommandLog) + command_log(self)->memory_bytes());
+}
+
+static PyMethodDef command_log_methods[] = {
+    {"gen_buffer", command_log_gen_buffer, METH_NOARGS, "Queues the creation of a buffer, and returns its handle."},
+    {"produce_wave", fast_method(command_log_produce_wave), METH_FASTCALL | METH_KEYWORDS, "Queues a wave."},
+    {"sample_file", fast_method(command_log_sample_file), METH_FASTCALL | METH_KEYWORDS, "Queues the sampling of a .wav file."},
+    {"sample_buffer", fast_method(command_log_sample_buffer), METH_FASTCALL | METH_KEYWORDS, "Queues the sampling of a buffer."},
+    {"dump_buffer", fast_method(command_log_dump_buffer), METH_FASTCALL | METH_KEYWORDS, "Queues the writing of a buffer to a .wav file."},
+    {"render_sequence", fast_method(command_log_render_sequence), METH_FASTCALL | METH_KEYWORDS, "Queues the playing of a sequencer's score."},
+    {"command", fast_method(command_log_command), METH_FASTCALL | METH_KEYWORDS, "Reads a command back as (kind, buffer, args, dependencies, fingerprint, file_inputs)."},
+    {"find", fast_method(command_log_find), METH_FASTCALL | METH_KEYWORDS, "Lists the commands of a kind, in order."},
+    {"latest_commands", command_log_latest_commands, METH_NOARGS, "Lists the last command on every buffer."},
+    {"mix_sources", command_log_mix_sources, METH_NOARGS, "Lists the commands whose buffer states are sampled by other buffers."},
+    {"filenames", command_log_filenames, METH_NOARGS, "Lists every file name queued, in the order first seen."},
+    {"resolve_file_inputs", fast_method(command_log_resolve_file_inputs), METH_FASTCALL | METH_KEYWORDS, "Folds the modification times of sampled files into the fingerprints that depend on them."},
+    {"memory_bytes", command_log_memory_bytes, METH_NOARGS, "Gets the number of bytes of memory held by the log."},
+    {"__sizeof__", command_log_sizeof, METH_NOARGS, "Gets the size of the log in memory, in bytes."},
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyType_Slot command_log_slots[] = {
+  {Py_tp_new, reinterpret_cast<void*>(command_log_new)},
+  {Py_tp_dealloc, reinterpret_cast<void*>(command_log_dealloc)},
+  {Py_sq_length, reinterpret_cast<void*>(command_log_len)},
+  {Py_tp_methods, command_log_methods},
+  {Py_tp_doc, const_cast<char*>("The commands queued on a project, stored natively in columns.")},
+  {0, NULL}
+};
+
+static PyType_Spec command_log_spec = {
+  "_synther.CommandLog",
+  sizeof(CommandLogObject),
+  0,
+  Py_TPFLAGS_DEFAULT,
+  command_log_slots
+};
+
+static PyObject* start_trace(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+  Trace::start();
+  Trace::name_thread("python");
+  Py_RETURN_NONE;
+}
+
+static PyObject* stop_trace(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+  std::vector<Trace::Event> events;
+  std::vector<std::pair<uint32_t, std::string>> threads;
+  Trace::stop(events, threads);
+
+  PyObject *event_list = PyList_New(static_cast<Py_ssize_t>(events.size()));
+  PyObject *thread_dict = PyDict_New();
+  if (event_list == NULL || thread_dict == NULL) {
+    Py_XDECREF(event_list);
+    Py_XDECREF(thread_dict);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < events.size(); ++i) {
+    const Trace::Event& e = events[i];
+    PyObject *item = Py_BuildValue("(sKKIKKK)", e.name, e.start_ns, e.duration_ns, e.thread, e.samples, e.bytes_read, e.bytes_written);
+    if (item == NULL) {
+      Py_DECREF(event_list);
+      Py_DECREF(thread_dict);
+      return NULL;
+    }
+    PyList_SET_ITEM(event_list, static_cast<Py_ssize_t>(i), item);
+  }
+
+  for (auto& thread : threads) {
+    PyObject *key = PyLong_FromUnsignedLong(thread.first);
+    PyObject *name = PyUnicode_FromString(thread.second.c_str());
+    if (key == NULL || name == NULL || PyDict_SetItem(thread_dict, key, name) < 0) {
+      Py_XDECREF(key);
+      Py_XDECREF(name);
+      Py_DECREF(event_list);
+      Py_DECREF(thread_dict);
+      return NULL;
+    }
+    Py_DECREF(key);
+    Py_DECREF(name);
+  }
+
+  return Py_BuildValue("(NN)", event_list, thread_dict);
+}
+
+static PyObject* stats(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+  SyntherState *state = get_state(self);
+  Stats::Snapshot snapshot;
+  Stats::snapshot(snapshot);
+
+  size_t buffer_bytes;
+  size_t capacity_bytes;
+  size_t note_cache_bytes;
+  Py_BEGIN_ALLOW_THREADS
+  state->engine->memory_usage(buffer_bytes, capacity_bytes);
+  note_cache_bytes = state->engine->note_cache_bytes();
+  Py_END_ALLOW_THREADS
+
+  PyObject *result = Py_BuildValue("{s:n,s:K,s:K,s:K}",
+    "live_buffers", static_cast<Py_ssize_t>(state->engine->buffer_count()),
+    "buffer_bytes", static_cast<unsigned long long>(buffer_bytes),
+    "buffer_capacity_bytes", static_cast<unsigned long long>(capacity_bytes),
+    "note_cache_bytes", static_cast<unsigned long long>(note_cache_bytes));
+  if (result == NULL) {
+    return NULL;
+  }
+
+  auto set_item = [&](PyObject *dict, PyObject *key, PyObject *value) {
+    bool ok = key != NULL && value != NULL && PyDict_SetItem(dict, key, value) == 0;
+    Py_XDECREF(key);
+    Py_XDECREF(value);
+    return ok;
+  };
+
+  for (int i = 0; i < static_cast<int>(Stats::Counter::Count); ++i) {
+    if (!set_item(result, PyUnicode_FromString(Stats::counter_name(static_cast<Stats::Counter>(i))), PyLong_FromUnsignedLongLong(snapshot.counters[i]))) {
+      Py_DECREF(result);
+      return NULL;
+    }
+  }
+
+  PyObject *wave_samples = PyDict_New();
+  PyObject *call_counts = PyDict_New();
+  PyObject *call_times = PyDict_New();
+  bool ok = wave_samples != NULL && call_counts != NULL && call_times != NULL;
+  for (int i = 0; ok && i < Stats::max_wave_types; ++i) {
+    if (snapshot.wave_samples[i] > 0) {
+      ok = set_item(wave_samples, PyLong_FromLong(i), PyLong_FromUnsignedLongLong(snapshot.wave_samples[i]));
+    }
+  }
+  for (size_t i = 0; ok && i < snapshot.calls.size(); ++i) {
+    const Stats::CallTime& call = snapshot.calls[i];
+    ok = set_item(call_counts, PyUnicode_FromString(call.name.c_str()), PyLong_FromUnsignedLongLong(call.calls)) &&
+      set_item(call_times, PyUnicode_FromString(call.name.c_str()), PyLong_FromUnsignedLongLong(call.total_ns));
+  }
+  ok = ok && PyDict_SetItemString(result, "wave_samples", wave_samples) == 0 &&
+    PyDict_SetItemString(result, "calls", call_counts) == 0 &&
+    PyDict_SetItemString(result, "call_time_ns", call_times) == 0;
+  Py_XDECREF(wave_samples);
+  Py_XDECREF(call_counts);
+  Py_XDECREF(call_times);
+  if (!ok) {
+    Py_DECREF(result);
+    return NULL;
+  }
+  return result;
+}
+
+static PyObject* reset_stats(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+  Stats::reset();
+  Py_RETURN_NONE;
+}
+
+static PyObject* record_cache_lookups(PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"hits", "misses"};
+  static const FastArgs signature = {"KK", keywords};
+  SyntherState *state = get_state(self);
+  unsigned long long hits;
+  unsigned long long misses;
+
+  if (!parse_fast_args(state, signature, args, nargs, kwnames, &hits, &misses)) {
+    return NULL;
+  }
+
+  Stats::add(Stats::Counter::CacheHits, hits);
+  Stats::add(Stats::Counter::CacheMisses, misses);
+  Py_RETURN_NONE;
+}
+
+static PyMethodDef SyntherMethods[] = {
+    {"gen_buffer", fast_method(gen_buffer), METH_FASTCALL | METH_KEYWORDS, "Generates a new audio buffer."},
+    {"produce_wave", fast_method(produce_wave), METH_FASTCALL | METH_KEYWORDS, "Produces a wave audio signal in a buffer."},
+    {"produce_bank", fast_method(produce_bank), METH_FASTCALL | METH_KEYWORDS, "Produces a bank of waves sharing one envelope in a buffer, in one pass."},
+    {"produce_fm", fast_method(produce_fm), METH_FASTCALL | METH_KEYWORDS, "Produces an FM note from a graph of operators in a buffer."},
+    {"render_sequence", fast_method(render_sequence), METH_FASTCALL | METH_KEYWORDS, "Plays a sequencer's score into a buffer, in one pass."},
+    {"register_wavetable", fast_method(register_wavetable), METH_FASTCALL | METH_KEYWORDS, "Registers one cycle of a wave as a new wave type, and returns it."},
+    {"dump_buffer", fast_method(dump_buffer), METH_FASTCALL | METH_KEYWORDS, "Saves the buffer as a .wav file."},
+    {"get_buffer_bytes", fast_method(get_buffer_bytes), METH_FASTCALL | METH_KEYWORDS, "Grabs the data from buffer memory for analysis in Python."},
+    {"set_buffer_bytes", fast_method(set_buffer_bytes), METH_FASTCALL | METH_KEYWORDS, "Replaces the data in buffer memory with raw bytes from Python."},
+    {"get_buffer_capacity", fast_method(get_buffer_capacity), METH_FASTCALL | METH_KEYWORDS, "Gets the number of bytes of memory held by a buffer."},
+    {"clear_buffer", fast_method(clear_buffer), METH_FASTCALL | METH_KEYWORDS, "Empties a buffer while keeping its memory allocated for reuse."},
+    {"hash_bytes", fast_method(hash_bytes), METH_FASTCALL | METH_KEYWORDS, "Computes a fast 64 bit (non-cryptographic) hash of a byte array."},
+    {"free_buffer", fast_method(free_buffer), METH_FASTCALL | METH_KEYWORDS, "Frees a buffer from memory."},
+    {"sample_file", fast_method(sample_file), METH_FASTCALL | METH_KEYWORDS, "Samples waveform from a .wav file, and inserts into a buffer."},
+    {"sample_buffer", fast_method(sample_buffer), METH_FASTCALL | METH_KEYWORDS, "Samples waveform from a source buffer, and inserts into target buffer."},
+    {"render_graph", fast_method(render_graph), METH_FASTCALL | METH_KEYWORDS, "Runs a list of buffer operations one cache-sized tile at a time."},
+    {"set_lazy", fast_method(set_lazy), METH_FASTCALL | METH_KEYWORDS, "Turns lazy mode on or off, where waves and mixes only run once the buffers they touch are needed."},
+    {"flush", fast_method(flush), METH_FASTCALL | METH_KEYWORDS, "Runs the operations recorded in lazy mode, for one buffer or all of them."},
+    {"set_note_cache_limit", fast_method(set_note_cache_limit), METH_FASTCALL | METH_KEYWORDS, "Caps the memory kept for rendered notes that repeat. 0 turns the cache off."},
+    {"stream_graph", fast_method(stream_graph), METH_FASTCALL | METH_KEYWORDS, "Renders a list of buffer operations on a background thread, as an iterator over blocks of one buffer."},
+    {"stream_buffer", fast_method(stream_buffer), METH_FASTCALL | METH_KEYWORDS, "Iterates over a snapshot of a buffer in blocks."},
+    {"start_trace", start_trace, METH_NOARGS, "Starts recording the time spent in each native call."},
+    {"stop_trace", stop_trace, METH_NOARGS, "Stops recording, and returns the recorded events and thread names."},
+    {"stats", stats, METH_NOARGS, "Gets the cumulative runtime statistics of the module as a dict."},
+    {"reset_stats", reset_stats, METH_NOARGS, "Resets the cumulative runtime statistics."},
+    {"record_cache_lookups", fast_method(record_cache_lookups), METH_FASTCALL | METH_KEYWORDS, "Adds buffer cache hits and misses (counted by the Python build system) to the statistics."},
+
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static int synther_traverse(PyObject *m, visitproc visit, void *arg) {
+  SyntherState *state = get_state(m);
+  if (state == NULL) {
+    return 0;
+  }
+  Py_VISIT(state->error);
+  Py_VISIT(state->stream_type);
+  Py_VISIT(state->block_type);
+  Py_VISIT(state->command_log_type);
+  Py_VISIT(state->sequencer_type);
+  return 0;
+}
+
+static int synther_clear(PyObject *m) {
+  SyntherState *state = get_state(m);
+  if (state == NULL) {
+    return 0;
+  }
+  Py_CLEAR(state->error);
+  Py_CLEAR(state->stream_type);
+  Py_CLEAR(state->block_type);
+  Py_CLEAR(state->command_log_type);
+  Py_CLEAR(state->sequencer_type);
+  return 0;
+}
+
+static void synther_free(void *m) {
+  synther_clear(static_cast<PyObject*>(m));
+  SyntherState *state = get_state(static_cast<PyObject*>(m));
+  if (state != NULL) {
+    delete state->engine;
+    state->engine = NULL;
+  }
+}
+
+static int synther_exec(PyObject *m) {
+  SyntherState *state = get_state(m);
+
+  state->engine = new (std::nothrow) Synth::Engine();
+  if (state->engine == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  state->block_type = reinterpret_cast<PyTypeObject*>(PyType_FromModuleAndSpec(m, &render_block_spec, NULL));
+  if (state->block_type == NULL)
+    return -1;
+
+  state->stream_type = reinterpret_cast<PyTypeObject*>(PyType_FromModuleAndSpec(m, &render_stream_spec, NULL));
+  if (state->stream_type == NULL)
+    return -1;
+
+  state->command_log_type = reinterpret_cast<PyTypeObject*>(PyType_FromModuleAndSpec(m, &command_log_spec, NULL));
+  if (state->command_log_type == NULL || PyModule_AddType(m, state->command_log_type) < 0)
+    return -1;
+
+  state->sequencer_type = reinterpret_cast<PyTypeObject*>(PyType_FromModuleAndSpec(m, &sequencer_spec, NULL));
+  if (state->sequencer_type == NULL || PyModule_AddType(m, state->sequencer_type) < 0)
+    return -1;
+
+  state->error = PyErr_NewException("synther.error", NULL, NULL);
+  if (state->error == NULL)
+    return -1;
+  Py_INCREF(state->error);
+  if (PyModule_AddObject(m, "error", state->error) < 0) {
+    Py_DECREF(state->error);
+    return -1;
+  }
+
+  return 0;
+}
+
+static PyModuleDef_Slot synther_slots[] = {
+  {Py_mod_exec, reinterpret_cast<void*>(synther_exec)},
+#ifdef Py_mod_multiple_interpreters
+  // Nothing is shared between interpreters but the native statistics and trace, which are thread-safe
+  {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+  // The engine does its own locking (see Engine.h), so free-threaded builds can run calls in parallel
+  {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+  {0, NULL}
+};
+
+static struct PyModuleDef module = {
+  PyModuleDef_HEAD_INIT,
+  "_synther",   /* name of module */
+  synther_doc, /* module documentation, may be NULL */
+  sizeof(SyntherState), /* size of per-interpreter state of the module */
+  SyntherMethods,
+  synther_slots,
+  synther_traverse,
+  synther_clear,
+  synther_free
+};
+
+PyMODINIT_FUNC
+PyInit__synther(void) {
+  return PyModuleDef_Init(&module);
 }
@@ -9,8 +9,13 @@ import _synther as syn
 from os import path
 import os
 from enum import IntEnum
-import hashlib
+import bisect
 import json
+import mmap
+import shutil
+import struct
+import tempfile
+import time
 
 __author__ = 'Patrick Worthey'
 __version__ = '1.0.0'
@@ -21,6 +26,9 @@ __docformat__ = 'reStructuredText'
 # new installation of the library
 _lib_version = __version__
 
+# Seeds every fingerprint, so a new installation of the library invalidates all of them
+_hash_seed = syn.hash_bytes(_lib_version.encode('utf-8'))
+
 class LogLvl(IntEnum):
   """Enum class that specifies the verbosity of the console output."""
 
@@ -54,6 +62,82 @@ class WaveType(IntEnum):
   NOISE = 4
   """Produces random white noise. Great for sweeps and general atomosphere."""
 
+  SAW_BL = 5
+  """Produces a band-limited saw wave, which unlike SAW stays clean at high frequencies instead of aliasing."""
+
+  SQUARE_BL = 6
+  """Produces a band-limited square wave, which unlike SQUARE stays clean at high frequencies instead of aliasing."""
+
+  TRIANGLE_BL = 7
+  """Produces a band-limited triangle wave, which unlike TRIANGLE stays clean at high frequencies instead of aliasing."""
+
+class NoteEvent(IntEnum):
+  """Enum class for the kinds of events in the score of a Sequencer."""
+
+  NOTE_ON = 0
+  """Starts a note on a free voice, or on the voice that started first if every voice is busy."""
+
+  NOTE_OFF = 1
+  """Releases every voice playing the note on the instrument."""
+
+class Sequencer(syn.Sequencer):
+  """A polyphonic sequencer: a score of note events, played by instruments on a fixed pool of voices.
+
+  A whole score renders natively in one call (see render_sequence() and SyntherProject.queue_render_sequence()),
+  a short block at a time between events, with every voice allocated up front. A song of thousands of notes is
+  then a single command rather than one per note. For example, an A4 and a C5 played one after the other::
+
+    seq = Sequencer(voices=16)
+    lead = seq.add_instrument(WaveType.SAW_BL, 5, 200, 8000)
+    seq.set_events([
+      (0, NoteEvent.NOTE_ON, 69, 1.0, lead),
+      (500, NoteEvent.NOTE_OFF, 69, 0.0, lead),
+      (500, NoteEvent.NOTE_ON, 72, 0.8, lead),
+      (1000, NoteEvent.NOTE_OFF, 72, 0.0, lead)
+    ])
+
+  Notes still held at the last event of the score are released there. Every change makes a new score, so a
+  score that has been queued on a project is not changed by later calls.
+
+  :param voices: The number of notes that can sound at once. Defaults to 32.
+  """
+
+  def add_instrument(self, wave_type: WaveType, attack_ms: int, release_ms: int, amp: float) -> int:
+    """Adds an instrument to play notes with.
+
+    :param wave_type: The type of wave of the instrument's notes. Examples: WaveType.SINE, WaveType.SAW_BL, etc.
+
+    :param attack_ms: The duration (in milliseconds) over which a note [linearly] rises to its amplitude.
+
+    :param release_ms: The duration (in milliseconds) over which a note [linearly] falls back to silence once released.
+
+    :param amp: A value in range 0-32767 which defines the amplitude of the instrument's notes at velocity 1.
+
+    :returns: The instrument's id, to use in events.
+
+    :rtype: int
+    """
+
+    return super().add_instrument(wave_type, attack_ms, release_ms, amp)
+
+  def set_events(self, events: list) -> None:
+    """Replaces the events of the score.
+
+    :param events: A list of (time_ms, kind, note, velocity, instrument) tuples, sorted by time. The kind is a NoteEvent, the note a MIDI note number in range 0-127 (69 being A4 at 440 hz), and the velocity scales the instrument's amplitude (usually 0-1, unused by NOTE_OFF). The instrument defaults to 0.
+    """
+
+    super().set_events(events if isinstance(events, list) else list(events))
+
+  def duration_ms(self) -> int:
+    """Gets the length of the score, from its start until its last note falls silent.
+
+    :returns: The duration in milliseconds.
+
+    :rtype: int
+    """
+
+    return super().duration_ms()
+
 _log_level = LogLvl.INFO
 
 def set_log_level(log_level: LogLvl) -> None:
@@ -195,6 +279,252 @@ def produce_wave(buffer: int, attack_start_ms: int, attack_ms: int, sustain_ms:
 
   syn.produce_wave(buffer, attack_start_ms, attack_ms, sustain_ms, decay_ms, freq_hz, amp, wave_type)
 
+def produce_bank(buffer: int, attack_start_ms: int, attack_ms: int, sustain_ms: int, decay_ms: int, voices: list, wave_type: WaveType, amp: float = 1.0) -> None:
+  """Inserts a bank of generated waves that share one envelope into a memory buffer, such as a chord, a detuned
+  unison or the partials of an additive sound.
+
+  The voices are summed together a short block at a time before being added to the buffer, so the buffer is only
+  written once however many voices there are. Unlike produce_wave(), each voice's phase is set relative to the start
+  of the note.
+
+  :param buffer: A direct handle to the low-level buffer.
+
+  :param attack_start_ms: The time (in milliseconds) where the waves start.
+
+  :param attack_ms: The duration (in milliseconds) of the attack phase.
+
+  :param sustain_ms: The duration (in milliseconds) of the sustain phase.
+
+  :param decay_ms: The duration (in milliseconds) of the decay phase.
+
+  :param voices: A list of (freq_hz, amp, phase, detune_cents) tuples, one per wave. The phase (in cycles, 0-1) and detune (in cents) are optional, and default to 0.
+
+  :param wave_type: The type of wave of every voice.
+
+  :type wave_type: WaveType
+
+  :param amp: A factor applied to the amplitude of every voice.
+  """
+
+  syn.produce_bank(buffer, attack_start_ms, attack_ms, sustain_ms, decay_ms, voices, wave_type, amp)
+
+def produce_fm(buffer: int, start_ms: int, freq_hz: float, operators: list, amp: float) -> None:
+  """Inserts an FM (phase modulation) note into a memory buffer.
+
+  A note is a graph of sine operators. Each operator runs at a ratio of the note's frequency, has its own envelope
+  and level, and may feed its output back into its own phase. The output of a modulator is added to the phase of
+  the operators it modulates, in radians. Operators that modulate no other operator are carriers, and the note is
+  the sum of their outputs, scaled by amp. For example, a classic two operator sound, with a modulator at twice
+  the frequency of its carrier::
+
+    produce_fm(buffer, 0, 220, [(1, 1.0, 5, 400, 100, 0.0, [1]), (2, 3.0, 5, 200, 300)], 8000)
+
+  Operators must only be modulated by operators that come after them, so the graph has no cycles. The note renders
+  a short block at a time, and is added to the buffer once.
+
+  :param buffer: A direct handle to the low-level buffer.
+
+  :param start_ms: The time (in milliseconds) where the note starts.
+
+  :param freq_hz: The frequency of the note in hz.
+
+  :param operators: A list of (ratio, level, attack_ms, sustain_ms, decay_ms, feedback, modulators) tuples, one per operator. The level is an amplitude (usually 0-1) for carriers, and a modulation index (in radians) for modulators. The feedback (a factor, defaulting to 0) and the indices of the modulating operators (defaulting to none) are optional. Envelopes start with the note.
+
+  :param amp: A value in range 0-32767 which scales the carriers' output.
+  """
+
+  syn.produce_fm(buffer, start_ms, freq_hz, operators, amp)
+
+def render_sequence(buffer: int, sequencer: Sequencer, start_ms: int = 0) -> None:
+  """Plays the score of a sequencer into a memory buffer with additive synthesis, in one pass.
+
+  :param buffer: A direct handle to the low-level buffer.
+
+  :param sequencer: The sequencer whose score to play.
+
+  :param start_ms: The time (in milliseconds) in the buffer where the score starts.
+  """
+
+  syn.render_sequence(buffer, sequencer, start_ms)
+
+def register_wavetable(samples: list) -> int:
+  """Registers a custom wave shape, and returns a new wave type to play it with.
+
+  The samples are one cycle of the wave, of any length, usually in the range -1 to 1. The cycle is turned into a
+  band-limited wavetable like those of WaveType.SAW_BL, stored once in native memory and shared by every note,
+  which reads it with interpolated phase accumulation. The wave type works wherever a WaveType does, e.g. with
+  produce_wave(), produce_bank(), render_graph() and SyntherProject.queue_produce_wave(). Wave types are only valid
+  in the interpreter that registered them, and each interpreter numbers its own.
+
+  :param samples: The samples of one cycle, at least 2 of them.
+
+  :returns: The wave type of the table.
+
+  :rtype: int
+  """
+
+  return syn.register_wavetable(samples)
+
+def set_buffer_bytes(buffer: int, data: bytes) -> None:
+  """Replace the contents of a memory buffer with a raw byte array.
+
+  The byte layout is the same one returned by get_buffer_bytes(), so the two can be used to save and restore a buffer.
+
+  :param buffer: A direct handle to the low-level buffer.
+
+  :param data: A raw byte list-like object (bytes, bytearray, memoryview, mmap, ...). Its length must be a multiple of 2 (one 16-bit sample).
+  """
+
+  syn.set_buffer_bytes(buffer, data)
+
+def get_buffer_capacity(buffer: int) -> int:
+  """Get the amount of memory held by a memory buffer.
+
+  This can be larger than the length of get_buffer_bytes(), since buffers keep spare memory to grow into.
+
+  :param buffer: A direct handle to the low-level buffer.
+
+  :returns: The number of bytes of memory held by the buffer.
+  """
+
+  return syn.get_buffer_capacity(buffer)
+
+def clear_buffer(buffer: int) -> None:
+  """Empties a memory buffer, but keeps its memory allocated.
+
+  This is cheaper than freeing the buffer and generating a new one when the new audio is about the same length.
+
+  :param buffer: A direct handle to the low-level buffer.
+  """
+
+  syn.clear_buffer(buffer)
+
+def render_graph(ops: list, tile_frames: int = 4096) -> None:
+  """Runs a list of buffer operations one tile at a time, rather than one operation at a time.
+
+  Every operation writing to the first tile of audio runs, then every operation writing to the second tile,
+  and so on. This keeps intermediate audio in the CPU cache while it is mixed onwards. The result is the same
+  as running the operations one after the other. If an operation reads audio that a later operation is still
+  going to change, the whole list runs as a single tile instead.
+
+  Operations are tuples, starting with an operation code followed by the arguments of the matching function:
+
+  - (0, buffer, attack_start_ms, attack_ms, sustain_ms, decay_ms, freq_hz, amp, wave_type) for produce_wave()
+  - (1, buffer, filename, buffer_start_ms, sample_start_ms, duration_ms) for sample_file()
+  - (2, target_buffer, source_buffer, source_start_ms, target_start_ms, duration_ms) for sample_buffer()
+  - (3, buffer, sequencer, start_ms) for render_sequence()
+
+  :param ops: The list of operation tuples, in the order they would otherwise run.
+
+  :param tile_frames: The number of stereo samples per tile.
+  """
+
+  syn.render_graph(ops, tile_frames)
+
+def set_lazy(enabled: bool, tile_frames: int = 4096) -> None:
+  """Turns lazy mode on or off.
+
+  In lazy mode, produce_wave() and sample_buffer() only record what they are asked to do. Everything recorded
+  against a buffer runs at once when the buffer is needed, e.g. by dump_buffer(), get_buffer_bytes() or flush(),
+  fused into a single render_graph() pass: overlapping notes and mixes fill the buffer one tile at a time, instead
+  of each one sweeping its whole range. The results are the same as without lazy mode.
+
+  Errors such as a missing buffer are still raised by the call itself. Turning lazy mode off flushes every buffer.
+
+  :param enabled: Whether to record waves and mixes rather than running them right away.
+
+  :param tile_frames: The number of stereo samples per tile, when recorded operations run.
+  """
+
+  syn.set_lazy(enabled, tile_frames)
+
+def flush(buffer: int = None) -> None:
+  """Runs the operations recorded in lazy mode (see set_lazy()).
+
+  :param buffer: A direct handle to the low-level buffer to bring up to date, along with whatever it was mixed from. Defaults to every buffer.
+  """
+
+  if buffer == None:
+    syn.flush()
+  else:
+    syn.flush(buffer)
+
+def set_note_cache_limit(max_bytes: int) -> None:
+  """Caps the memory kept for rendered notes.
+
+  A note played again with the same wave type, frequency, amplitude and envelope is mixed in from a copy rendered
+  the first time round, instead of being synthesized again. Since a wave's phase follows its position in the buffer,
+  the copy is only reused where the note starts at the same point of the wave's period, which for most notes on a
+  beat grid is often. Noise, and sines whose frequency isn't a whole number of millihertz, are always synthesized.
+
+  The least recently used notes are dropped to stay under the cap, which defaults to 64 MiB.
+
+  :param max_bytes: The most memory to keep, in bytes. 0 turns the cache off.
+  """
+
+  syn.set_note_cache_limit(max_bytes)
+
+def stats() -> dict:
+  """Gets statistics of the native module, cumulative since it was loaded or since reset_stats().
+
+  The dict holds:
+
+  - live_buffers, buffer_bytes, buffer_capacity_bytes: The buffers allocated right now, the bytes of audio they hold, and the bytes of memory they hold
+  - note_cache_bytes: The bytes of rendered notes kept right now (see set_note_cache_limit())
+  - buffer_resizes, buffer_reallocations: How often a buffer changed size, and how often that took a new allocation
+  - wave_samples: The number of samples generated for each wave type, keyed by WaveType
+  - mix_bytes: The bytes of audio mixed from one buffer into another
+  - wav_bytes_read, wav_bytes_written: The bytes of .wav files read and written
+  - cache_hits, cache_misses: How often the build system found a buffer state in its cache, or had to render it
+  - note_cache_hits, note_cache_misses: How often a wave that can be cached was mixed in from a rendered note, or had to be synthesized
+  - calls, call_time_ns: The number of calls to each native function, and the time (in nanoseconds) spent in them. Calls that read or reset the statistics and traces aren't counted.
+
+  :returns: The statistics.
+
+  :rtype: dict
+  """
+
+  return syn.stats()
+
+def reset_stats() -> None:
+  """Resets the cumulative statistics returned by stats() to zero. The live buffer figures are unaffected."""
+
+  syn.reset_stats()
+
+def start_trace() -> None:
+  """Starts recording the time spent in every native call, e.g. produce_wave() or the reading of a .wav file.
+
+  Any events recorded by an earlier trace that wasn't stopped are dropped.
+  """
+
+  syn.start_trace()
+
+def stop_trace(filename: str) -> None:
+  """Stops recording, and writes the recorded calls to a file in the Chrome trace event format.
+
+  The file can be opened in Perfetto (https://ui.perfetto.dev) or chrome://tracing. Every thread gets its own track. Each
+  call records how many samples it produced or consumed, and how many bytes of .wav files it read or wrote.
+
+  :param filename: The name of the .json file to write.
+  """
+
+  events, threads = syn.stop_trace()
+  pid = os.getpid()
+  trace_events = [{'name': 'thread_name', 'ph': 'M', 'pid': pid, 'tid': tid, 'args': {'name': name}} for tid, name in threads.items()]
+  for name, start_ns, duration_ns, tid, samples, bytes_read, bytes_written in events:
+    trace_events.append({
+      'name': name,
+      'cat': 'synther',
+      'ph': 'X',
+      'pid': pid,
+      'tid': tid,
+      'ts': start_ns / 1000.0,
+      'dur': duration_ns / 1000.0,
+      'args': {'samples': samples, 'bytes_read': bytes_read, 'bytes_written': bytes_written}
+    })
+  with open(filename, 'w') as fp:
+    json.dump({'traceEvents': trace_events, 'displayTimeUnit': 'ms'}, fp)
+
 def free_buffer(buffer: int) -> None:
   """Frees the low-level memory buffer.
 
@@ -213,26 +543,460 @@ class _CmdType(IntEnum):
   GEN_BUFFER       = 2
   PRODUCE_WAVE     = 3
   SAMPLE_BUFFER    = 4
+  LOAD_BUFFER      = 5 # Only created by the build system, restores a buffer from the buffer cache
+  RENDER_SEQUENCE  = 6
+
+_build_db_file = '.synther-cache'
+_buffer_cache_dir = '.synther-buffers'
+_buffer_cache_default_limit = 1 << 30 # 1 GiB
+
+def _name_hash(name):
+  # Zero marks an empty slot in the build database
+  return syn.hash_bytes(name.encode('utf-8')) or 1
+
+class _BuildDatabase():
+  # Binary build database. The file is a header followed by two open addressing hash tables:
+  #
+  # - outputs: name hash, fingerprint, render time (ns), build time (ns)
+  # - buffers: cache key, size (bytes), last use (ns)
+  #
+  # Output lookups probe the memory mapped file directly, so nothing is parsed up front.
+  # The buffer table is small (bounded by the buffer cache cap) and is read in whole.
+  # Saving writes a fresh file next to the old one and swaps it in atomically.
+
+  _header = struct.Struct('<4sIQQQQ') # magic, format version, hash seed, output slots, output count, buffer slots
+  _output_record = struct.Struct('<QQQQ')
+  _buffer_record = struct.Struct('<QQQ')
+  _magic = b'SYDB'
+  _format_version = 1
+
+  def __init__(self, filename):
+    self._filename = filename
+    self._file = None
+    self._map = None
+    self._output_slots = 0
+    self._output_count = 0
+    self._outputs = {}
+    self._dirty = False
+    self.buffers = {}
+    self.valid = False
+
+  def load(self):
+    if not path.exists(self._filename) or path.getsize(self._filename) < self._header.size:
+      return
+    self._file = open(self._filename, 'rb')
+    self._map = mmap.mmap(self._file.fileno(), 0, access=mmap.ACCESS_READ)
+    magic, version, seed, output_slots, output_count, buffer_slots = self._header.unpack_from(self._map, 0)
+    expected_size = self._header.size + output_slots * self._output_record.size + buffer_slots * self._buffer_record.size
+    if magic != self._magic or version != self._format_version or seed != _hash_seed or len(self._map) != expected_size:
+      self.close()
+      return
+    self._output_slots = output_slots
+    self._output_count = output_count
+    buffers_start = self._header.size + output_slots * self._output_record.size
+    for key, size, last_use in self._buffer_record.iter_unpack(self._map[buffers_start:]):
+      if key != 0:
+        self.buffers[key] = [size, last_use]
+    self.valid = True
+
+  def close(self):
+    if self._map != None:
+      self._map.close()
+      self._map = None
+    if self._file != None:
+      self._file.close()
+      self._file = None
+
+  def find_output(self, name_hash):
+    """Returns the (name hash, fingerprint, render_ns, build_ns) record of an output, or None."""
+    record = self._outputs.get(name_hash)
+    if record != None:
+      return record
+    if self._output_slots == 0:
+      return None
+    mask = self._output_slots - 1
+    slot = name_hash & mask
+    while True:
+      record = self._output_record.unpack_from(self._map, self._header.size + slot * self._output_record.size)
+      if record[0] == name_hash:
+        return record
+      if record[0] == 0:
+        return None
+      slot = (slot + 1) & mask
+
+  def keep_output(self, record):
+    self._outputs[record[0]] = record
+
+  def set_output(self, name_hash, fingerprint, render_ns):
+    self._outputs[name_hash] = (name_hash, fingerprint, render_ns, time.time_ns())
+    self._dirty = True
+
+  def mark_dirty(self):
+    self._dirty = True
+
+  @staticmethod
+  def _table_slots(count):
+    # Power of two, at most half full
+    slots = 8
+    while slots < count * 2:
+      slots *= 2
+    return slots
+
+  @staticmethod
+  def _pack_table(record_struct, slots, records, data, offset):
+    mask = slots - 1
+    for record in records:
+      slot = record[0] & mask
+      while record_struct.unpack_from(data, offset + slot * record_struct.size)[0] != 0:
+        slot = (slot + 1) & mask
+      record_struct.pack_into(data, offset + slot * record_struct.size, *record)
+
+  def save(self):
+    # Only the outputs recorded during this build are kept. If they are exactly the ones
+    # on disk, unchanged, there is nothing to write.
+    if self.valid and not self._dirty and len(self._outputs) == self._output_count:
+      self.close()
+      return
+
+    output_slots = self._table_slots(len(self._outputs))
+    buffer_slots = self._table_slots(len(self.buffers))
+    data = bytearray(self._header.size + output_slots * self._output_record.size + buffer_slots * self._buffer_record.size)
+    self._header.pack_into(data, 0, self._magic, self._format_version, _hash_seed, output_slots, len(self._outputs), buffer_slots)
+    self._pack_table(self._output_record, output_slots, self._outputs.values(), data, self._header.size)
+    self._pack_table(self._buffer_record, buffer_slots, [(k, v[0], v[1]) for k, v in self.buffers.items()], data, self._header.size + output_slots * self._output_record.size)
+
+    self.close()
+    with open(self._filename + '.tmp', 'wb') as fp:
+      fp.write(data)
+    os.replace(self._filename + '.tmp', self._filename)
+
+class _BufferCache():
+  # Content-addressed store of intermediate buffer states. Each entry holds the raw
+  # bytes of a buffer, named by the Merkle key of the command that produced that state.
+  # Entry sizes and last use times (the LRU clock) are tracked in the build database.
+
+  def __init__(self, directory, max_bytes):
+    self._dir = directory
+    self.max_bytes = max_bytes
+    self._pinned = set()
+    self._db = None
+    self._entries = {}
+
+  def entries(self):
+    return self._entries
+
+  def attach(self, db):
+    self._db = db
+    self._entries = db.buffers
+    if not db.valid and path.exists(self._dir):
+      self._rescan()
+
+  def _rescan(self):
+    # Without a build database, fall back on what is on disk
+    for name in os.listdir(self._dir):
+      if name.endswith('.buf'):
+        st = os.stat(path.join(self._dir, name))
+        self._entries[int(name[:-len('.buf')], 16)] = [st.st_size, int(st.st_mtime * 1e9)]
+    self._db.mark_dirty()
+
+  def _path(self, key):
+    return path.join(self._dir, '%016x.buf' % (key))
+
+  def enabled(self):
+    return self.max_bytes > 0
+
+  def contains(self, key):
+    return self.enabled() and key in self._entries and path.exists(self._path(key))
+
+  def pin(self, key):
+    # Pinned entries are about to be loaded, so they must survive eviction
+    self._pinned.add(key)
+
+  def unpin_all(self):
+    self._pinned = set()
+
+  def load(self, key):
+    with open(self._path(key), 'rb') as fp:
+      data = fp.read()
+    self._entries[key][1] = time.time_ns() # Mark as recently used
+    self._db.mark_dirty()
+    return data
+
+  def store(self, key, data):
+    if not self.enabled() or len(data) > self.max_bytes:
+      return
+    if not path.exists(self._dir):
+      os.makedirs(self._dir)
+    filename = self._path(key)
+    with open(filename + '.tmp', 'wb') as fp:
+      fp.write(data)
+    os.replace(filename + '.tmp', filename)
+    self._entries[key] = [len(data), time.time_ns()]
+    self._db.mark_dirty()
+    self._evict()
+
+  def _evict(self):
+    total = sum(e[0] for e in self._entries.values())
+    if total <= self.max_bytes:
+      return
+    for key in sorted(self._entries, key=lambda k: self._entries[k][1]):
+      if total <= self.max_bytes:
+        break
+      if key in self._pinned:
+        continue
+      _log_verbose('Evicting cached buffer "%016x".' % (key))
+      if path.exists(self._path(key)):
+        os.remove(self._path(key))
+      total -= self._entries[key][0]
+      del self._entries[key]
+
+  def clear(self):
+    self._entries.clear()
+    if path.exists(self._dir):
+      shutil.rmtree(self._dir)
+
+class _ScratchFile():
+  # Memory mapped temporary file holding spilled buffers. Freed regions are reused first fit.
+
+  def __init__(self):
+    self._file = tempfile.TemporaryFile()
+    self._map = None
+    self._size = 0
+    self._free = [] # (offset, size)
+
+  def _grow(self, size):
+    if self._map != None:
+      self._map.close()
+    self._file.truncate(size)
+    self._map = mmap.mmap(self._file.fileno(), size)
+    self._size = size
+
+  def write(self, data):
+    size = len(data)
+    for i, (offset, free_size) in enumerate(self._free):
+      if free_size >= size:
+        if free_size == size:
+          del self._free[i]
+        else:
+          self._free[i] = (offset + size, free_size - size)
+        break
+    else:
+      offset = self._size
+      self._grow(max(self._size * 2, self._size + size, 1 << 20))
+      self._free.append((offset + size, self._size - offset - size))
+    if size > 0:
+      self._map[offset:offset + size] = data
+    return (offset, size)
+
+  def view(self, region):
+    # Only valid until the next write
+    return memoryview(self._map)[region[0]:region[0] + region[1]]
+
+  def release(self, region):
+    self._free.append(region)
+
+  def close(self):
+    if self._map != None:
+      self._map.close()
+    self._file.close()
+
+_reorder_window = 64 # How many ready renders the memory planner weighs against each other
+
+def _ms_to_bytes(ms):
+  # Mirrors ms_to_buffer_index() in the extension: 44100 stereo 16 bit samples per second
+  return int(ms / 1000.0 * 44100.0 * 2.0) * 2
+
+def _cmd_buffers(cmd):
+  # Sample buffer reads from a second buffer
+  if cmd['cmd_type'] == _CmdType.SAMPLE_BUFFER:
+    return [cmd['buffer'], cmd['args'][1]]
+  return [cmd['buffer']]
+
+class _MemoryPlan():
+  # Register allocation over a render queue, with virtual buffers as the values and
+  # runtime buffers ("slots") as the registers. The plan:
+  #
+  # - Predicts the final size of every virtual buffer from its commands
+  # - Reorders independent renders, greedily keeping the live bytes low
+  # - Computes the live interval of every virtual buffer over the reordered commands
+  # - Hands every new virtual buffer a slot freed earlier (best fit first), so storage
+  #   is recycled instead of reallocated, and frees a slot once nothing will reuse it
+
+  def __init__(self, render_queue, cache_entries, memory_budget):
+    self.memory_budget = memory_budget
+    self.sizes = self._estimate_sizes(render_queue, cache_entries)
+    self.queue = self._reorder(render_queue)
+    self._assign_slots()
+
+  @staticmethod
+  def _estimate_sizes(render_queue, cache_entries):
+    sizes = {}
+    peaks = {}
+    for render in render_queue:
+      for cmd in render['stack']:
+        argv = cmd['args']
+        cmd_type = cmd['cmd_type']
+        size = sizes.get(cmd['buffer'], 0)
+        if cmd_type == _CmdType.GEN_BUFFER:
+          size = 0
+        elif cmd_type == _CmdType.LOAD_BUFFER:
+          size = cache_entries[argv[1]][0] if argv[1] in cache_entries else 0
+        elif cmd_type == _CmdType.PRODUCE_WAVE:
+          size = max(size, _ms_to_bytes(argv[1] + argv[2] + argv[3] + argv[4]))
+        elif cmd_type == _CmdType.SAMPLE_FILE:
+          length = 0
+          if argv[4] > 0:
+            length = _ms_to_bytes(argv[4])
+          elif path.exists(argv[1]):
+            length = max(0, path.getsize(argv[1]) - 44) # Exact for 44100 hz 16 bit stereo, close enough otherwise
+          size = max(size, _ms_to_bytes(argv[2]) + length)
+        elif cmd_type == _CmdType.SAMPLE_BUFFER:
+          length = _ms_to_bytes(argv[4]) if argv[4] > 0 else sizes.get(argv[1], 0)
+          size = max(size, _ms_to_bytes(max(argv[2], argv[3])) + length)
+        elif cmd_type == _CmdType.RENDER_SEQUENCE:
+          size = max(size, _ms_to_bytes(argv[2] + argv[1].duration_ms()))
+        sizes[cmd['buffer']] = size
+        peaks[cmd['buffer']] = max(peaks.get(cmd['buffer'], 0), size)
+    return peaks
+
+  def _reorder(self, render_queue):
+    # Renders touching the same buffer keep their relative order. That also pins down
+    # which render allocates each buffer (the first) and which frees it (the last).
+    count = len(render_queue)
+    successors = [set() for _ in range(count)]
+    pending = [0] * count
+    first_render = {}
+    last_render = {}
+    for g, render in enumerate(render_queue):
+      for cmd in render['stack']:
+        for b in _cmd_buffers(cmd):
+          if b in last_render and last_render[b] != g and not g in successors[last_render[b]]:
+            successors[last_render[b]].add(g)
+            pending[g] += 1
+          last_render[b] = g
+          first_render.setdefault(b, g)
+    allocated = [0] * count
+    freed = [0] * count
+    for b, g in first_render.items():
+      allocated[g] += self.sizes.get(b, 0)
+    for b, g in last_render.items():
+      freed[g] += self.sizes.get(b, 0)
+
+    order = []
+    ready = [g for g in range(count) if pending[g] == 0]
+    live = 0
+    while len(ready) > 0:
+      if self.memory_budget > 0:
+        # Anything within the budget, preferring whatever leaves the most headroom
+        best = min(ready[:_reorder_window], key=lambda g: (live + allocated[g] > self.memory_budget, allocated[g] - freed[g], g))
+      else:
+        # Lowest peak first, then the most memory handed back
+        best = min(ready[:_reorder_window], key=lambda g: (live + allocated[g], allocated[g] - freed[g], g))
+      ready.remove(best)
+      order.append(render_queue[best])
+      live += allocated[best] - freed[best]
+      for g in successors[best]:
+        pending[g] -= 1
+        if pending[g] == 0:
+          bisect.insort(ready, g)
+    return order
+
+  def _assign_slots(self):
+    commands = [cmd for render in self.queue for cmd in render['stack']]
+    births = {}
+    deaths = {}
+    self.uses = {}
+    for i, cmd in enumerate(commands):
+      for b in _cmd_buffers(cmd):
+        if not b in births:
+          births[b] = i
+        deaths[b] = i
+        self.uses.setdefault(b, []).append(i)
+    born_at = {}
+    died_at = {}
+    for b, i in births.items():
+      born_at.setdefault(i, []).append(b)
+    for b, i in deaths.items():
+      died_at.setdefault(i, []).append(b)
+
+    self.slot_of = {}
+    occupants = []
+    capacity = []
+    free_slots = []
+    for i in range(len(commands)):
+      for b in born_at.get(i, []):
+        size = self.sizes.get(b, 0)
+        fitting = [slot for slot in free_slots if capacity[slot] >= size]
+        if len(fitting) > 0:
+          slot = min(fitting, key=lambda s: capacity[s])
+        elif len(free_slots) > 0:
+          slot = max(free_slots, key=lambda s: capacity[s])
+        else:
+          slot = len(occupants)
+          occupants.append([])
+          capacity.append(0)
+          free_slots.append(slot)
+        free_slots.remove(slot)
+        capacity[slot] = max(capacity[slot], size)
+        occupants[slot].append(b)
+        self.slot_of[b] = slot
+      for b in died_at.get(i, []):
+        free_slots.append(self.slot_of[b])
+
+    # Which buffers to release after each command, and whether their slot's storage is kept for a later occupant
+    self.release = {}
+    for i, cmd in enumerate(commands):
+      for b in died_at.get(i, []):
+        keep = occupants[self.slot_of[b]][-1] != b
+        self.release.setdefault(cmd['id'], []).append((b, keep))
+
+    # Predict the peak, counting storage that slots hold on to between occupants
+    held = {}
+    self.peak_bytes = 0
+    self.peak_live_bytes = 0
+    live = 0
+    for i in range(len(commands)):
+      for b in born_at.get(i, []):
+        slot = self.slot_of[b]
+        held[slot] = max(held.get(slot, 0), self.sizes.get(b, 0))
+        live += self.sizes.get(b, 0)
+      self.peak_bytes = max(self.peak_bytes, sum(held.values()))
+      self.peak_live_bytes = max(self.peak_live_bytes, live)
+      for b in died_at.get(i, []):
+        live -= self.sizes.get(b, 0)
+        if occupants[self.slot_of[b]][-1] == b:
+          del held[self.slot_of[b]]
+    self.buffer_count = len(births)
+    self.slot_count = len(occupants)
 
 class SyntherProject():
   """This class provides utilities for creating command queues (rather than maniuplating low-level buffers in realtime).
 
   The main purpose of this class is to reduce the amount of compute time in a music production pipeline by:
   
-  - Storing command queue thumbprints in a file: '.synther-cache'
+  - Storing command queue thumbprints in a binary build database file: '.synther-cache'
   - Assessing whether changes have been made to the command queue since the last run
   - Only executing a command queue if changes have been made to the pipeline concerning that render.
+  - Caching intermediate buffer states in the directory '.synther-buffers', so unchanged stems are reused rather than re-rendered.
 
   The build process will take care of many things such as watching for file changes that the pipeline is dependent on.
-  It will also free any memory buffers as soon as they are no longer in use.
+  It will also free any memory buffers as soon as they are no longer in use, recycle their memory for buffers created later,
+  and order independent renders so that as little memory as possible is in use at once.
   """
 
   def __init__(self):
-    self._id_count = 0
-    self._history = {}
-    self._latest_buffer_history = {}
-    self._buffer_count = 0
+    # Every queued command, held natively. Commands are only read back into dicts
+    # (see _command()) when a build or stream needs them.
+    self._log = syn.CommandLog(_hash_seed)
     self._buffer_map = {}
+    self._slot_of = {}
+    self._slot_runtimes = {}
+    self._memory_budget = 0
+    self._resident = {}    # virtual buffer -> bytes held (only tracked with a memory budget)
+    self._idle_slots = {}  # slot -> bytes held between occupants (only tracked with a memory budget)
+    self._spilled = {}     # virtual buffer -> scratch file region
+    self._scratch = None
+    self._buffer_cache = _BufferCache(_buffer_cache_dir, _buffer_cache_default_limit)
     self._cmd_executions = {
       _CmdType.GEN_BUFFER: {
         'cmdname': 'gen_buffer',
@@ -253,74 +1017,115 @@ class SyntherProject():
       _CmdType.SAMPLE_BUFFER: {
         'cmdname': 'sample_buffer',
         'func': self._execute_sample_buffer
+      },
+      _CmdType.LOAD_BUFFER: {
+        'cmdname': 'load_buffer',
+        'func': self._execute_load_buffer
+      },
+      _CmdType.RENDER_SEQUENCE: {
+        'cmdname': 'render_sequence',
+        'func': self._execute_render_sequence
       }
     }
 
-  def _find_last_buffer_history(self, buffer):
-    if buffer in self._latest_buffer_history:
-      return self._latest_buffer_history[buffer]
-    else:
-      return None
-
-  def _push_history(self, cmd_type, buffer, *argv):
-    deps = []
-
-    args = list(argv)
-    if buffer != None:
-      last_buffer_history = self._find_last_buffer_history(buffer)
-      if last_buffer_history != None:
-        deps = [last_buffer_history]
-      args = [buffer] + args
-
-      # Since sample buffer pulls from another buffer, that also counts as dependency
-      # Thus, when the renderer walks the dependency tree, both are rendered prior to
-      # sampling and continuing with the render
-      if cmd_type == _CmdType.SAMPLE_BUFFER:
-        last_source_buffer_history = self._find_last_buffer_history(args[1])
-        if last_source_buffer_history != None:
-          deps.append(last_source_buffer_history)
-
-    this_id = self._id_count
-    self._history[self._id_count] = {
-      'id':this_id,
-      'dependencies':deps,
+  def _command(self, cmd_id):
+    cmd_type, buffer, args, deps, fingerprint, file_inputs = self._log.command(cmd_id)
+    return {
+      'id': cmd_id,
+      'dependencies': list(deps),
       'cmd_type': cmd_type,
       'args': args,
-      'buffer': buffer
+      'buffer': buffer,
+      # Merkle fingerprint of the buffer state this command leaves behind, from the command's
+      # own arguments and its dependencies' fingerprints
+      'fingerprint': fingerprint,
+      # Whether the state depends on .wav files, whose modification times are only known at build time
+      'file_inputs': file_inputs
     }
-    self._id_count = self._id_count + 1
-
-    if buffer != None:
-      self._latest_buffer_history[buffer] = this_id
-
-  def _needs_render(self, filename, fingerprint):
-    if not path.exists(filename):
-      return True
-    if not path.exists('.synther-cache'):
-      return True
-    cache = None
-    with open('.synther-cache') as fp:
-      cache = json.load(fp)
-
-    if cache['lib-version'] != _lib_version:
-      return True
-    for r in cache['renders']:
-      if r['file'] == filename:
-        return r['fingerprint'] != fingerprint
-    return True
-
-  def _generate_history_fingerprint(self, command_stack):
-    m = hashlib.md5()
-    m.update(str(len(command_stack)).encode('utf-8'))
-    for cmd in command_stack:
-      m.update(str(len(cmd['dependencies'])).encode('utf-8'))
-      m.update(str(cmd['cmd_type']).encode('utf-8'))
-      argv = cmd['args']
-      for arg in argv:
-        m.update(str(arg).encode('utf-8'))
-      if cmd['cmd_type'] == _CmdType.SAMPLE_FILE and len(argv) > 0:
-        m.update(str(os.path.getmtime(argv[0])).encode('utf-8'))
-    return m.hexdigest()
+
+  def _dumps(self):
+    return [self._command(cmd_id) for cmd_id in self._log.find(_CmdType.DUMP_BUFFER)]
+
+  def _resolve_file_inputs(self):
+    # Folds the modification times of sampled .wav files into the fingerprints that depend on them
+    mtimes = [os.path.getmtime(name) if path.exists(name) else None for name in self._log.filenames()]
+    return self._log.resolve_file_inputs(mtimes)
+
+  def _state_key(self, cmd, resolved):
+    if cmd['file_inputs']:
+      return resolved[cmd['id']]
+    return cmd['fingerprint']
+
+  def _find_cacheable_commands(self):
+    # Buffer states worth caching: the final state of every buffer, and every state
+    # that another buffer samples from
+    return set(self._log.latest_commands()).union(self._log.mix_sources())
+
+  def _find_render_work(self, render, resolved, commands_traversed):
+    # Collects the commands a render needs that no earlier render has claimed. Every command
+    # is visited at most once per build. Subgraphs whose resulting buffer state is cached are
+    # replaced by a single load.
+    work = [(render['id'], render)]
+    commands_traversed.add(render['id'])
+    dependency_stack = list(render['dependencies'])
+    hits = 0
+    misses = 0
+    while len(dependency_stack) > 0:
+      dep_id = dependency_stack.pop(len(dependency_stack) - 1)
+      if dep_id in commands_traversed:
+        continue
+      commands_traversed.add(dep_id)
+      dep_his = self._command(dep_id)
+      key = self._state_key(dep_his, resolved)
+      if self._buffer_cache.contains(key):
+        hits += 1
+        self._buffer_cache.pin(key)
+        work.append((dep_id, {
+          'id': 'load:%d' % (dep_id),
+          'dependencies': [],
+          'cmd_type': _CmdType.LOAD_BUFFER,
+          'args': [dep_his['buffer'], key],
+          'buffer': dep_his['buffer']
+        }))
+      else:
+        if self._buffer_cache.enabled():
+          misses += 1
+        work.append((dep_id, dep_his))
+        dependency_stack.extend(dep_his['dependencies'])
+    syn.record_cache_lookups(hits, misses)
+    # Dependencies always have lower ids than the commands depending on them
+    work.sort(key=lambda w: w[0])
+    return [cmd for _, cmd in work]
+
+  def _stream_graph(self, output):
+    # The whole subgraph behind a dump, as graph operations on the virtual buffers themselves.
+    # Streams render into private buffers, so neither the build database nor the cache is involved.
+    renders = [cmd for cmd in self._dumps() if output == None or cmd['args'][1] == output]
+    if len(renders) == 0:
+      raise ValueError('No dump queued for "%s"' % (output))
+    render = renders[-1]
+    needed = set()
+    dependency_stack = list(render['dependencies'])
+    while len(dependency_stack) > 0:
+      dep_id = dependency_stack.pop(len(dependency_stack) - 1)
+      if not dep_id in needed:
+        needed.add(dep_id)
+        dependency_stack.extend(self._command(dep_id)['dependencies'])
+    ops = []
+    for cmd in map(self._command, sorted(needed)):
+      if cmd['cmd_type'] in (_CmdType.PRODUCE_WAVE, _CmdType.SAMPLE_FILE, _CmdType.SAMPLE_BUFFER, _CmdType.RENDER_SEQUENCE):
+        ops.append(self._graph_op(cmd, lambda virtual: virtual))
+    return ops, render['buffer']
+
+  def set_buffer_cache_limit(self, max_bytes: int) -> None:
+    """Sets the size cap of the intermediate buffer cache stored in '.synther-buffers'.
+
+    When the cache grows past the cap, the least recently used buffer states are evicted.
+
+    :param max_bytes: The maximum total size (in bytes) of the cache. Set to 0 to disable the cache. Defaults to 1 GiB.
+    """
+
+    self._buffer_cache.max_bytes = max_bytes
 
   def queue_sample_buffer(self, target_buffer: int, source_buffer: int, target_buffer_start_ms: int, source_buffer_start_ms: int, duration_ms: int = 0) -> None:
     """Queues the sampling of a source buffer which will be additively combined with a target memory buffer.
@@ -336,7 +1141,7 @@ class SyntherProject():
     :param duration_ms: The duration (in milliseconds) of the sample. Set to 0 to sample to the end of the source buffer.
     """
 
-    self._push_history(_CmdType.SAMPLE_BUFFER, target_buffer, source_buffer, target_buffer_start_ms, source_buffer_start_ms, duration_ms)
+    self._log.sample_buffer(target_buffer, source_buffer, target_buffer_start_ms, source_buffer_start_ms, duration_ms)
 
   def queue_gen_buffer(self) -> int:
     """Queues the creation of a memory buffer, and returns a virtual handle to that buffer-to-be.
@@ -352,9 +1157,7 @@ class SyntherProject():
     :returns: A virtual handle to a buffer-to-be.
     """
 
-    self._buffer_count = self._buffer_count + 1
-    self._push_history(_CmdType.GEN_BUFFER, self._buffer_count)
-    return self._buffer_count
+    return self._log.gen_buffer()
 
   def queue_produce_wave(self, buffer: int, attack_start_ms: int, attack_ms: int, sustain_ms: int, decay_ms: int, freq_hz: float, amp: float, wave_type: WaveType) -> None:
     """Queues the insertion of a generated wave into a memory buffer with additive synthesis.
@@ -389,7 +1192,7 @@ class SyntherProject():
     :type wave_type: WaveType
     """
 
-    self._push_history(_CmdType.PRODUCE_WAVE, buffer, attack_start_ms, attack_ms, sustain_ms, decay_ms, freq_hz, amp, wave_type)
+    self._log.produce_wave(buffer, attack_start_ms, attack_ms, sustain_ms, decay_ms, freq_hz, amp, wave_type)
 
   def queue_dump_buffer(self, buffer: int, filename: str):
     """Queues the writing of a memory buffer to a .wav file.
@@ -399,7 +1202,7 @@ class SyntherProject():
     :param filename: The file name (preferably with extension '.wav') to output to.
     """
 
-    self._push_history(_CmdType.DUMP_BUFFER, buffer, filename)
+    self._log.dump_buffer(buffer, filename)
 
   def queue_sample_file(self, buffer: int, filename: str, buffer_start_ms: int, sample_start_ms: int, duration_ms: int) -> None:
     """Queues the sampling of a .wav file which will be additively combined with a memory buffer.
@@ -422,7 +1225,22 @@ class SyntherProject():
     :param duration_ms: The time (in milliseconds) to copy from the file to the buffer.
     """
 
-    self._push_history(_CmdType.SAMPLE_FILE, buffer, filename, buffer_start_ms, sample_start_ms, duration_ms)
+    self._log.sample_file(buffer, filename, buffer_start_ms, sample_start_ms, duration_ms)
+
+  def queue_render_sequence(self, buffer: int, sequencer: Sequencer, start_ms: int = 0) -> None:
+    """Queues the playing of a sequencer's score into a memory buffer with additive synthesis.
+
+    The whole score is a single command, however many notes it holds, and its fingerprint covers every event
+    and instrument. The score is queued as it is now: later changes to the sequencer do not affect this command.
+
+    :param buffer: A virtual handle to a buffer-to-be.
+
+    :param sequencer: The sequencer whose score to play.
+
+    :param start_ms: The time (in milliseconds) in the buffer where the score starts.
+    """
+
+    self._log.render_sequence(buffer, sequencer, start_ms)
 
   def _get_runtime_buffer(self, buffer):
     return self._buffer_map[buffer]
@@ -436,8 +1254,83 @@ class SyntherProject():
       cmd['args'][3] # duration_ms
     )
 
+  def _acquire_runtime_buffer(self, buffer):
+    # Recycles the storage of the buffer's memory plan slot, if a previous occupant left it behind
+    slot = self._slot_of[buffer]
+    if slot in self._slot_runtimes:
+      runtime = self._slot_runtimes[slot]
+      _log_verbose('Recycling buffer (Virtual: %d, Runtime: %d).' % (buffer, runtime))
+      clear_buffer(runtime)
+      self._idle_slots.pop(slot, None)
+    else:
+      runtime = gen_buffer()
+      self._slot_runtimes[slot] = runtime
+    self._buffer_map[buffer] = runtime
+
+  def _release_runtime_buffer(self, buffer, keep_storage):
+    runtime = self._buffer_map.pop(buffer)
+    held = self._resident.pop(buffer, 0)
+    if keep_storage and self._memory_budget > 0:
+      self._idle_slots[self._slot_of[buffer]] = held
+    if not keep_storage:
+      _log_verbose('Freeing buffer (Virtual: %d, Runtime: %d).' % (buffer, runtime))
+      free_buffer(runtime)
+      del self._slot_runtimes[self._slot_of[buffer]]
+
+  def _fault_in(self, cmd):
+    # Spilled buffers come back into memory right before a command uses them
+    for virtual in _cmd_buffers(cmd):
+      if virtual in self._spilled:
+        region = self._spilled.pop(virtual)
+        runtime = gen_buffer()
+        with self._scratch.view(region) as data:
+          set_buffer_bytes(runtime, data)
+        self._scratch.release(region)
+        self._buffer_map[virtual] = runtime
+        self._slot_runtimes[self._slot_of[virtual]] = runtime
+        _log_verbose('Restoring spilled buffer (Virtual: %d, Runtime: %d).' % (virtual, runtime))
+
+  def _spill(self, virtual):
+    runtime = self._buffer_map.pop(virtual)
+    if self._scratch == None:
+      self._scratch = _ScratchFile()
+    self._spilled[virtual] = self._scratch.write(get_buffer_bytes(runtime))
+    _log_verbose('Spilling buffer (Virtual: %d, Runtime: %d).' % (virtual, runtime))
+    free_buffer(runtime)
+    del self._slot_runtimes[self._slot_of[virtual]]
+    del self._resident[virtual]
+
+  def _enforce_memory_budget(self, cmds, step, plan):
+    in_use = set(virtual for cmd in cmds for virtual in _cmd_buffers(cmd))
+    for virtual in in_use:
+      if virtual in self._buffer_map:
+        self._resident[virtual] = get_buffer_capacity(self._buffer_map[virtual])
+    if sum(self._resident.values()) + sum(self._idle_slots.values()) <= self._memory_budget:
+      return
+
+    # Storage that slots hold on to for later occupants is the cheapest to give back
+    for slot in list(self._idle_slots.keys()):
+      free_buffer(self._slot_runtimes.pop(slot))
+      del self._idle_slots[slot]
+    if sum(self._resident.values()) <= self._memory_budget:
+      return
+
+    # Then spill the buffers whose next use is the furthest away
+    def next_use(virtual):
+      uses = plan.uses[virtual]
+      i = bisect.bisect_right(uses, step)
+      return uses[i] if i < len(uses) else float('inf')
+    total = sum(self._resident.values())
+    for virtual in sorted(self._resident.keys(), key=next_use, reverse=True):
+      if total <= self._memory_budget:
+        break
+      if virtual in in_use:
+        continue
+      total -= self._resident[virtual]
+      self._spill(virtual)
+
   def _execute_gen_buffer(self, cmd):
-    self._buffer_map[cmd['args'][0]] = gen_buffer()
+    self._acquire_runtime_buffer(cmd['args'][0])
 
   def _execute_produce_wave(self, cmd):
     produce_wave(
@@ -451,6 +1344,13 @@ class SyntherProject():
       cmd['args'][7] # wave_type
     )
 
+  def _execute_render_sequence(self, cmd):
+    render_sequence(
+      self._get_runtime_buffer(cmd['args'][0]), # buffer
+      cmd['args'][1], # sequencer
+      cmd['args'][2] # start_ms
+    )
+
   def _execute_dump_buffer(self, cmd):
     dump_buffer(
       self._get_runtime_buffer(cmd['args'][0]), # buffer
@@ -466,19 +1366,101 @@ class SyntherProject():
       cmd['args'][4] # duration_ms
     )
 
+  def _execute_load_buffer(self, cmd):
+    virtual = cmd['args'][0]
+    # A buffer that is already live is simply overwritten with its newer state
+    if not virtual in self._buffer_map:
+      self._acquire_runtime_buffer(virtual)
+    set_buffer_bytes(self._get_runtime_buffer(virtual), self._buffer_cache.load(cmd['args'][1]))
+
   def _execute_command(self, cmd):
     execution = self._cmd_executions[cmd['cmd_type']]
     _log_verbose('Executing "%s"' % (execution['cmdname']))
     execution['func'](cmd)
 
-  def build(self) -> None:
+  def _graph_op(self, cmd, buffer_of):
+    argv = cmd['args']
+    if cmd['cmd_type'] == _CmdType.PRODUCE_WAVE:
+      return (0, buffer_of(argv[0]), argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7])
+    if cmd['cmd_type'] == _CmdType.SAMPLE_FILE:
+      return (1, buffer_of(argv[0]), argv[1], argv[2], argv[3], argv[4])
+    if cmd['cmd_type'] == _CmdType.RENDER_SEQUENCE:
+      return (3, buffer_of(argv[0]), argv[1], argv[2])
+    # Same arguments as _execute_sample_buffer()
+    return (2, buffer_of(argv[0]), buffer_of(argv[1]), argv[2], argv[3], argv[3])
+
+  def _execute_batch(self, batch, tile_frames):
+    if len(batch) == 1:
+      self._execute_command(batch[0])
+      return
+    # Buffers are generated up front, the rest goes to the graph executor in one go
+    ops = []
+    for cmd in batch:
+      if cmd['cmd_type'] == _CmdType.GEN_BUFFER:
+        self._execute_command(cmd)
+      else:
+        ops.append(cmd)
+    _log_verbose('Executing "render_graph" (%d commands)' % (len(ops)))
+    render_graph([self._graph_op(cmd, self._get_runtime_buffer) for cmd in ops], tile_frames)
+
+  def _batch_commands(self, stack, cacheable):
+    # Splits a render's commands into runs that the graph executor can take at once. A run holds
+    # audio commands and the buffers they generate, and ends wherever the exact state of a buffer
+    # is needed mid-way: dumps, loads, or a cacheable state that a later command would change.
+    batch = []
+    batch_slots = set()
+    pending_stores = set()
+    for cmd in stack:
+      cmd_type = cmd['cmd_type']
+      batchable = cmd_type in (_CmdType.PRODUCE_WAVE, _CmdType.SAMPLE_FILE, _CmdType.SAMPLE_BUFFER, _CmdType.RENDER_SEQUENCE, _CmdType.GEN_BUFFER)
+      if cmd_type == _CmdType.GEN_BUFFER:
+        # Generating early must not recycle storage a buffer in the run is still using
+        batchable = not self._slot_of[cmd['buffer']] in batch_slots
+      if not batchable or cmd['buffer'] in pending_stores:
+        if len(batch) > 0:
+          yield batch
+        batch = []
+        batch_slots = set()
+        pending_stores = set()
+      if not batchable:
+        yield [cmd]
+        continue
+      batch.append(cmd)
+      batch_slots.update(self._slot_of[virtual] for virtual in _cmd_buffers(cmd))
+      if cmd['id'] in cacheable:
+        pending_stores.add(cmd['buffer'])
+    if len(batch) > 0:
+      yield batch
+
+  def build(self, memory_budget: int = 0, tiled: bool = False, tile_frames: int = 4096, trace_file: str = None) -> None:
     """Renders all of the dumped memory buffers, but only if there have been changes to the pipeline since the last session.
+
+    :param memory_budget: The amount of memory (in bytes) the buffers may take up at once. Renders are ordered to fit within it, and when they do not, buffers that are not needed soon are spilled to a temporary file until they are. Set to 0 (the default) for no limit.
+
+    :param tiled: Whether to render with the tile-at-a-time graph executor (see render_graph()) instead of one command at a time. The output is the same, but long mixes with many stages render with fewer trips to main memory.
+
+    :param tile_frames: The number of stereo samples per tile, when rendering tiled.
+
+    :param trace_file: If set, the time spent in every native call of the build is written to this file, as a Chrome trace (see stop_trace()).
     """
 
+    if trace_file != None:
+      start_trace()
+      try:
+        self._run_build(memory_budget, tiled, tile_frames)
+      finally:
+        stop_trace(trace_file)
+    else:
+      self._run_build(memory_budget, tiled, tile_frames)
+
+  def _run_build(self, memory_budget, tiled, tile_frames):
     _log_info('Starting build.')
     self._buffer_map = {} # Fresh render context
-    renders = [h for h in self._history.values() if h['cmd_type'] == _CmdType.DUMP_BUFFER]
-    cachedRenders = []
+    db = _BuildDatabase(_build_db_file)
+    db.load()
+    self._buffer_cache.attach(db)
+    resolved = self._resolve_file_inputs()
+    renders = self._dumps()
     rendersFound = False
     commands_traversed = set()
     render_queue = []
@@ -489,75 +1471,102 @@ class SyntherProject():
         continue
       rendersFound = True
       filename = r['args'][1]
-      # Find the work required to complete the render
-      command_stack = [r]
-      dependency_stack = r['dependencies'].copy()
-      while len(dependency_stack) > 0:
-        dep_id = dependency_stack.pop(len(dependency_stack) - 1)
-        dep_his = self._history[dep_id]
-        command_stack.append(dep_his)
-        dependency_stack.extend(dep_his['dependencies'])
       # Assess the cache to see if there are any pipeline changes since last render
-      fingerprint = self._generate_history_fingerprint(command_stack)
-      needs_rerender = self._needs_render(filename, fingerprint)
+      fingerprint = syn.hash_bytes(filename.encode('utf-8'), self._state_key(r, resolved))
+      name_hash = _name_hash(filename)
+      record = db.find_output(name_hash)
+      needs_rerender = record == None or record[1] != fingerprint or not path.exists(filename)
       # Queue render
       if needs_rerender:
-        filtered_command_stack = []
-        for cmd in reversed(command_stack):
-          if not cmd['id'] in commands_traversed:
-            commands_traversed.add(cmd['id'])
-            filtered_command_stack.append(cmd)
         render_queue.append({
           'file': filename,
-          'stack': filtered_command_stack
+          'name_hash': name_hash,
+          'fingerprint': fingerprint,
+          'stack': self._find_render_work(r, resolved, commands_traversed)
         })
       else:
         _log_info('Pipeline up to date. Skipping "%s"' % (filename))
-      # Queue cache update
-      cachedRenders.append({
-        'file': filename,
-        'fingerprint': fingerprint
-      })
-
-    # Analyize our renders to find when it would be appropriate to free each buffer
-    last_buffer_uses = {}
-    for render in render_queue:
-      for cmd in render['stack']:
-        if cmd['buffer'] != None:
-          last_buffer_uses[cmd['buffer']] = cmd['id']
-        if cmd['cmd_type'] == _CmdType.SAMPLE_BUFFER: # sample buffer has 2 buffers
-          last_buffer_uses[cmd['args'][1]] = cmd['id']
+        db.keep_output(record)
+
+    # Analyize our renders to find when it would be appropriate to free or recycle each buffer
+    plan = _MemoryPlan(render_queue, self._buffer_cache.entries(), memory_budget)
+    render_queue = plan.queue
+    self._slot_of = plan.slot_of
+    self._slot_runtimes = {}
+    self._memory_budget = memory_budget
+    self._resident = {}
+    self._idle_slots = {}
+    self._spilled = {}
+    if len(render_queue) > 0:
+      _log_info('Predicted peak memory: %.1f MiB (%.1f MiB live), %d buffers in %d slots.' % (
+        plan.peak_bytes / (1 << 20), plan.peak_live_bytes / (1 << 20), plan.buffer_count, plan.slot_count))
+      if memory_budget > 0 and plan.peak_live_bytes > memory_budget:
+        _log_info('Memory budget of %.1f MiB exceeded, buffers will be spilled to disk.' % (memory_budget / (1 << 20)))
+
+    cacheable = self._find_cacheable_commands() if len(render_queue) > 0 else set()
 
     # Execute renders
     if not rendersFound:
       _log_warning('Found nothing to render.')
     else:
+      step = 0
       for render in render_queue:
         _log_info('Rendering "%s".' % (render['file']))
-        for cmd in render['stack']:
-          self._execute_command(cmd)
-          if cmd['buffer'] != None and last_buffer_uses[cmd['buffer']] == cmd['id']:
-            virtual = cmd['buffer']
-            runtime = self._get_runtime_buffer(cmd['buffer'])
-            _log_verbose('Freeing buffer (Virtual: %d, Runtime: %d).' % (virtual, runtime))
-            free_buffer(runtime)
+        render_start = time.perf_counter_ns()
+        batches = self._batch_commands(render['stack'], cacheable) if tiled else ([cmd] for cmd in render['stack'])
+        for batch in batches:
+          if memory_budget > 0:
+            for cmd in batch:
+              self._fault_in(cmd)
+          self._execute_batch(batch, tile_frames)
+          for cmd in batch:
+            if cmd['id'] in cacheable and self._buffer_cache.enabled() and not self._buffer_cache.contains(self._state_key(cmd, resolved)):
+              _log_verbose('Caching buffer state (Virtual: %d).' % (cmd['buffer']))
+              self._buffer_cache.store(self._state_key(cmd, resolved), get_buffer_bytes(self._get_runtime_buffer(cmd['buffer'])))
+            for virtual, keep_storage in plan.release.get(cmd['id'], []):
+              self._release_runtime_buffer(virtual, keep_storage)
+          step += len(batch)
+          if memory_budget > 0:
+            self._enforce_memory_budget(batch, step - 1, plan)
+        db.set_output(render['name_hash'], render['fingerprint'], time.perf_counter_ns() - render_start)
+    self._buffer_cache.unpin_all()
+    if self._scratch != None:
+      self._scratch.close()
+      self._scratch = None
     
     # Save cache
-    with open('.synther-cache', 'w') as fp:
-      json.dump({'lib-version': _lib_version, 'renders': cachedRenders}, fp, indent=2)
+    db.save()
     _log_info('Build finished.')
 
+  def render_times(self) -> dict:
+    """Looks up how long each render of this project took the last time it was actually rendered.
+
+    :returns: A dictionary of output file name to render time in seconds. Outputs that have never been rendered are left out.
+    """
+
+    db = _BuildDatabase(_build_db_file)
+    db.load()
+    times = {}
+    for r in self._dumps():
+      if len(r['args']) == 2:
+        record = db.find_output(_name_hash(r['args'][1]))
+        if record != None:
+          times[r['args'][1]] = record[2] / 1e9
+    db.close()
+    return times
+
   def clean(self) -> None:
-    """Deletes the build cache and all .wav files that would be rendered in a subsequent build.
+    """Deletes the build cache, the intermediate buffer cache, and all .wav files that would be rendered in a subsequent build.
 
     .. warning:: Any file names passed into queue_dump_buffer() will be deleted.
     """
 
     _log_info('Starting clean.')
-    if path.exists('.synther-cache'):
-      os.remove('.synther-cache')
+    if path.exists(_build_db_file):
+      os.remove(_build_db_file)
+    self._buffer_cache.clear()
 
-    renders = [h for h in self._history.values() if h['cmd_type'] == _CmdType.DUMP_BUFFER]
+    renders = self._dumps()
     for r in renders:
       if len(r['args']) != 2:
         continue
@@ -566,17 +1575,48 @@ class SyntherProject():
         os.remove(filename)
     _log_info('Clean finished.')
 
-  def rebuild(self) -> None:
+  def rebuild(self, memory_budget: int = 0, tiled: bool = False, tile_frames: int = 4096, trace_file: str = None) -> None:
     """Cleans and builds the project.
 
     .. warning:: any file names passed into queue_dump_buffer() will be deleted.
+
+    :param memory_budget: See build().
+
+    :param tiled: See build().
+
+    :param tile_frames: See build().
+
+    :param trace_file: See build().
     """
     
     _log_info('Starting rebuild.')
     self.clean()
-    self.build()
+    self.build(memory_budget, tiled, tile_frames, trace_file)
     _log_info('Rebuild finished.')
 
+def render_stream(project_or_buffer, block_frames: int = 4096, output: str = None):
+  """Renders on a background thread, handing over the audio one block at a time as soon as each block is ready.
+
+  Blocks are read-only memoryviews of interleaved stereo samples (signed 16 bit PCM, laid out like get_buffer_bytes()),
+  that point straight into the stream's memory. They can be wrapped without copying, e.g. with numpy.asarray(). A block
+  is only valid until the next block is requested, so copy it to keep it. The last block may be shorter than the rest.
+
+  Rendering runs ahead of the consumer by a few blocks at most, so Python code working on one block overlaps with the
+  rendering of the next ones.
+
+  :param project_or_buffer: Either a project, whose dumped output is rendered from scratch (nothing is written to disk), or a buffer, whose current contents are streamed. A buffer is free to change while its stream is consumed.
+
+  :param block_frames: The number of stereo samples per block.
+
+  :param output: The filename of the project's dump to render. Defaults to the last dump queued.
+
+  :returns: An iterator over the blocks. Calling close() on it stops the render early.
+  """
+  if isinstance(project_or_buffer, SyntherProject):
+    ops, buffer = project_or_buffer._stream_graph(output)
+    return syn.stream_graph(ops, buffer, block_frames)
+  return syn.stream_buffer(project_or_buffer, block_frames)
+
 def gen_project() -> SyntherProject:
   """Generates a build project.
   
@@ -7,6 +7,7 @@
 
 # This file contains basic tests for synther library
 
+import math
 import pytest
 
 def test_c_api_buffer_not_found():
@@ -53,11 +54,599 @@ def test_c_api_commands():
   byt2 = synther.get_buffer_bytes(buf2)
   assert len(byt2) > 1000
 
+  # Whatever get_buffer_bytes() returns can be restored, even when it doesn't end on a whole frame
+  synther.set_buffer_bytes(buf1, byt2[:6])
+  assert synther.get_buffer_bytes(buf1) == byt2[:6]
+  synther.set_buffer_bytes(buf1, byt2)
+  assert synther.get_buffer_bytes(buf1) == byt2
+
   synther.free_buffer(buf1)
   synther.free_buffer(buf2)
 
   os.remove('test_c_api_commands.wav')
 
+def test_c_api_arguments():
+  import _synther
+
+  buf = _synther.gen_buffer()
+
+  # Keywords are taken by the names of the Python wrappers, in any order
+  _synther.produce_wave(buf, 0, 10, 100, 10, 440.0, 30000.0, 0)
+  data = _synther.get_buffer_bytes(buffer=buf)
+  _synther.clear_buffer(buf)
+  _synther.produce_wave(buf, 0, 10, 100, 10, wave_type=0, amp=30000.0, freq_hz=440.0)
+  assert _synther.get_buffer_bytes(buf) == data
+  assert _synther.hash_bytes(b'abc', seed=7) == _synther.hash_bytes(bytearray(b'abc'), 7)
+
+  # Bad input raises the module's error, whichever way the arguments are passed
+  bad_calls = [
+    lambda: _synther.produce_wave(buf, 0, 10, 100, 10, 440.0, 30000.0),
+    lambda: _synther.produce_wave(buf, 0, 10, 100, 10, 440.0, 30000.0, 0, 1),
+    lambda: _synther.produce_wave(buf, 0.5, 10, 100, 10, 440.0, 30000.0, 0),
+    lambda: _synther.produce_wave(buf, 0, 10, 100, 10, 'a', 30000.0, 0),
+    lambda: _synther.produce_wave(buf, 0, 10, 100, 10, 440.0, 30000.0, 2 ** 40),
+    lambda: _synther.produce_wave(buf, 0, 10, 100, 10, 440.0, 30000.0, buffer=buf),
+    lambda: _synther.produce_wave(buf, 0, 10, 100, 10, 440.0, 30000.0, wave=0),
+    lambda: _synther.dump_buffer(buf, 'a\0b.wav'),
+    lambda: _synther.set_buffer_bytes(buf, 'not bytes'),
+    lambda: _synther.render_graph((), 16),
+    lambda: _synther.render_graph([], 0),
+    lambda: _synther.stream_buffer(buf, 16, slots=0),
+  ]
+  for call in bad_calls:
+    with pytest.raises(_synther.error, match="Insufficient args"):
+      call()
+
+  _synther.free_buffer(buf)
+
+  # As before the move to keyword arguments, gen_buffer() ignores whatever it's passed
+  _synther.free_buffer(_synther.gen_buffer(1))
+  with pytest.raises(TypeError):
+    _synther.gen_buffer(size=1)
+
+def test_c_api_stats():
+  import synther
+  import _synther
+  import os
+
+  synther.set_log_level(synther.LogLvl.VERBOSE)
+
+  synther.reset_stats()
+  live_buffers = synther.stats()['live_buffers']
+  target = synther.gen_buffer()
+  source = synther.gen_buffer()
+  synther.produce_wave(source, 0, 0, 100, 0, 440, 8000, synther.WaveType.SQUARE)
+  synther.sample_buffer(target, source, 0, 0, 0)
+  synther.dump_buffer(target, 'test_stats.wav')
+  synther.sample_file(target, 'test_stats.wav', 0, 0, 0)
+
+  stats = synther.stats()
+  size = len(synther.get_buffer_bytes(target))
+  assert stats['live_buffers'] == live_buffers + 2
+  assert stats['buffer_bytes'] >= 2 * size and stats['buffer_capacity_bytes'] >= stats['buffer_bytes']
+  assert stats['wave_samples'] == {int(synther.WaveType.SQUARE): size // 2}
+  assert 0 < stats['mix_bytes'] <= size
+  assert stats['wav_bytes_written'] > 44
+  assert stats['wav_bytes_read'] == stats['wav_bytes_written']
+  assert stats['buffer_resizes'] >= 2 and stats['buffer_reallocations'] >= 2
+  assert stats['calls']['produce_wave'] == 1 and stats['call_time_ns']['produce_wave'] > 0
+  assert stats['calls']['read_wav'] == 1 and stats['calls']['write_wav'] == 1
+  os.remove('test_stats.wav')
+
+  # Every binding is counted, down to the cheap bookkeeping ones
+  synther.reset_stats()
+  synther.clear_buffer(target)
+  synther.get_buffer_capacity(target)
+  _synther.hash_bytes(b'abc')
+  synther.free_buffer(synther.gen_buffer())
+  for block in _synther.stream_buffer(source, 4096):
+    pass
+  calls = synther.stats()['calls']
+  for name in ['clear_buffer', 'get_buffer_capacity', 'hash_bytes', 'gen_buffer', 'free_buffer', 'stream_buffer']:
+    assert calls[name] == 1 and synther.stats()['call_time_ns'][name] > 0
+
+  synther.reset_stats()
+  stats = synther.stats()
+  assert stats['mix_bytes'] == 0 and stats['wave_samples'] == {} and stats['calls'] == {}
+  assert stats['live_buffers'] == live_buffers + 2
+  synther.free_buffer(target)
+  synther.free_buffer(source)
+
+def test_c_api_lazy():
+  import synther
+
+  def render(lazy):
+    synther.set_lazy(lazy, 256)
+    stem = synther.gen_buffer()
+    mix = synther.gen_buffer()
+    scratch = synther.gen_buffer()
+    for n in range(40):
+      synther.produce_wave(stem, 7 * n, 2, 20 + n % 5, 3, 110 * (1 + n % 7), 2000, synther.WaveType(n % 5))
+    synther.sample_buffer(mix, stem, 0, 10, 0)
+    # Later changes to the source must not leak into the mix
+    synther.produce_wave(stem, 0, 0, 400, 0, 55, 9000, synther.WaveType.SQUARE)
+    synther.sample_buffer(mix, mix, 5, 0, 100)
+    synther.produce_wave(scratch, 0, 1, 50, 1, 880, 4000, synther.WaveType.SAW)
+    synther.sample_buffer(mix, scratch, 0, 30, 0)
+    synther.free_buffer(scratch)
+    stem_bytes = synther.get_buffer_bytes(stem)
+    synther.produce_wave(mix, 100, 1, 50, 1, 660, 3000, synther.WaveType.TRIANGLE)
+    mix_bytes = synther.get_buffer_bytes(mix)
+    synther.free_buffer(stem)
+    synther.free_buffer(mix)
+    synther.set_lazy(False)
+    return stem_bytes, mix_bytes
+
+  assert render(True) == render(False)
+
+  # Recorded operations run when asked for, all at once
+  synther.set_lazy(True)
+  buffer = synther.gen_buffer()
+  synther.reset_stats()
+  for n in range(10):
+    synther.produce_wave(buffer, 10 * n, 1, 100, 1, 440, 1000, synther.WaveType.SINE)
+  assert synther.stats()['wave_samples'] == {}
+  with pytest.raises(Exception, match="Wave"):
+    synther.produce_wave(buffer, 0, 1, 1, 1, 440, 1000, 500)
+  with pytest.raises(Exception, match="Buffer"):
+    synther.sample_buffer(buffer, 500, 0, 0, 0)
+  synther.flush(buffer)
+  assert synther.stats()['wave_samples'][int(synther.WaveType.SINE)] > 0
+  assert synther.stats()['buffer_resizes'] == 1
+  synther.produce_wave(buffer, 0, 1, 100, 1, 440, 1000, synther.WaveType.SINE)
+  synther.set_lazy(False)
+  assert synther.stats()['calls']['flush'] == 2
+  synther.free_buffer(buffer)
+
+def test_c_api_note_cache():
+  import synther
+
+  def render(limit):
+    synther.set_note_cache_limit(limit)
+    buffer = synther.gen_buffer()
+    # Repeats on a beat grid, with starts at different points of each wave's period
+    for n in range(60):
+      synther.produce_wave(buffer, 25 * (n // 4) + n % 3, 2, 30, 5, [440, 261.63, 110, 55.5][n % 4], 1500, synther.WaveType(n % 4))
+    synther.produce_wave(buffer, 0, 1, 200, 1, 220, 500, synther.WaveType.NOISE)
+    samples = synther.get_buffer_bytes(buffer)
+    synther.free_buffer(buffer)
+    return samples
+
+  synther.reset_stats()
+  uncached = render(0)
+  assert synther.stats()['note_cache_hits'] == 0
+  assert synther.stats()['note_cache_bytes'] == 0
+  assert render(1 << 20) == uncached
+  assert synther.stats()['note_cache_hits'] > 0
+  assert 0 < synther.stats()['note_cache_bytes'] <= 1 << 20
+
+  # The render graph looks notes up too, and the cache never outgrows its cap
+  synther.set_note_cache_limit(4096)
+  assert synther.stats()['note_cache_bytes'] <= 4096
+  graph = synther.gen_buffer()
+  synther.render_graph([(0, graph, 25 * n, 2, 30, 5, 440, 1500, 0) for n in range(8)], 256)
+  assert synther.stats()['note_cache_bytes'] <= 4096
+  eager = synther.gen_buffer()
+  for n in range(8):
+    synther.produce_wave(eager, 25 * n, 2, 30, 5, 440, 1500, synther.WaveType.SINE)
+  assert synther.get_buffer_bytes(graph) == synther.get_buffer_bytes(eager)
+  synther.free_buffer(graph)
+  synther.free_buffer(eager)
+  synther.set_note_cache_limit(64 << 20)
+
+def test_c_api_sustain_tiling():
+  import synther
+  synther.set_note_cache_limit(0)
+
+  # A long sustain is tiled from one period, while small render graph tiles compute every sample
+  ops = [(0, None, 3 * n, 7, 1500, 20, [440, 110, 261.63, 55.5][n % 4], 1200, n % 4) for n in range(8)]
+  tiled = synther.gen_buffer()
+  for op in ops:
+    synther.produce_wave(tiled, *op[2:])
+  computed = synther.gen_buffer()
+  synther.render_graph([(0, computed) + op[2:] for op in ops], 64)
+  assert synther.get_buffer_bytes(tiled) == synther.get_buffer_bytes(computed)
+  synther.free_buffer(tiled)
+  synther.free_buffer(computed)
+  synther.set_note_cache_limit(64 << 20)
+
+def test_c_api_band_limited():
+  import synther
+  import array
+
+  def render(wave_type, freq_hz):
+    buffer = synther.gen_buffer()
+    synther.produce_wave(buffer, 0, 0, 200, 0, freq_hz, 10000, wave_type)
+    samples = array.array('h')
+    samples.frombytes(synther.get_buffer_bytes(buffer))
+    synther.free_buffer(buffer)
+    return samples[::2]
+
+  # At low frequencies the band-limited waves follow the naive ones, but for the ringing at their edges
+  triangle = [round((4 * abs(n % 400 / 400 - 0.5) - 1) * 10000) for n in range(8820)]
+  for expected, band_limited in [(render(synther.WaveType.SAW, 110.25), synther.WaveType.SAW_BL), (render(synther.WaveType.SQUARE, 110.25), synther.WaveType.SQUARE_BL), (triangle, synther.WaveType.TRIANGLE_BL)]:
+    actual = render(band_limited, 110.25)
+    assert len(actual) == len(expected)
+    assert sum(abs(a - b) for a, b in zip(actual, expected)) / len(expected) < 300
+
+  # Near the Nyquist frequency only the fundamental is left
+  assert max(render(synther.WaveType.SQUARE_BL, 15000)) <= 4 / math.pi * 10000 + 1
+
+  with pytest.raises(Exception, match="Wave"):
+    render(8, 440)
+
+def test_c_api_produce_bank():
+  import synther
+  import array
+
+  def samples(buffer):
+    data = array.array('h')
+    data.frombytes(synther.get_buffer_bytes(buffer))
+    synther.free_buffer(buffer)
+    return data
+
+  # A chord in one pass sounds like its notes one after the other, but for rounding each voice separately
+  chord = [(261.63, 3000), (329.63, 2000, 0.0), (392.0, 1000, 0.0, 0.0)]
+  separate = synther.gen_buffer()
+  for freq_hz, amp, *_ in chord:
+    synther.produce_wave(separate, 0, 20, 300, 20, freq_hz, amp, synther.WaveType.SINE)
+  bank = synther.gen_buffer()
+  synther.reset_stats()
+  synther.produce_bank(bank, 0, 20, 300, 20, chord, synther.WaveType.SINE)
+  assert synther.stats()['wave_samples'] == {int(synther.WaveType.SINE): 3 * len(synther.get_buffer_bytes(bank)) // 2}
+  expected, actual = samples(separate), samples(bank)
+  assert len(actual) == len(expected)
+  assert max(abs(a - b) for a, b in zip(actual, expected)) <= len(chord)
+
+  # Phases are relative to the note, and detuning by an octave doubles the frequency
+  shifted = synther.gen_buffer()
+  synther.produce_bank(shifted, 0, 0, 100, 0, [(220, 1000, 0.25, 1200)], synther.WaveType.SINE, amp=2.0)
+  cosine = samples(shifted)[::2]
+  assert abs(cosine[0] - 2000) <= 1
+  assert abs(cosine[50] + 2000) <= 1
+
+  # The naive waves match produce_wave, save for the odd edge that rounds the other way
+  for wave_type in [synther.WaveType.SAW, synther.WaveType.SQUARE, synther.WaveType.TRIANGLE]:
+    for freq_hz in [441, 261.63]:
+      wave = synther.gen_buffer()
+      synther.produce_wave(wave, 0, 0, 200, 0, freq_hz, 8000, wave_type)
+      bank = synther.gen_buffer()
+      synther.produce_bank(bank, 0, 0, 200, 0, [(freq_hz, 8000)], wave_type)
+      expected, actual = samples(wave), samples(bank)
+      assert len(actual) == len(expected)
+      assert sum(abs(a - b) > 2 for a, b in zip(actual, expected)) <= len(expected) // 100
+
+  buffer = synther.gen_buffer()
+  with pytest.raises(Exception, match="Wave"):
+    synther.produce_bank(buffer, 0, 0, 100, 0, chord, 500)
+  with pytest.raises(Exception, match="args"):
+    synther.produce_bank(buffer, 0, 0, 100, 0, [(440,)], synther.WaveType.SINE)
+  synther.free_buffer(buffer)
+
+def test_c_api_produce_fm():
+  import synther
+  import array
+
+  def render(operators, freq_hz=220, amp=8000):
+    buffer = synther.gen_buffer()
+    synther.produce_fm(buffer, 0, freq_hz, operators, amp)
+    samples = array.array('h')
+    samples.frombytes(synther.get_buffer_bytes(buffer))
+    synther.free_buffer(buffer)
+    return samples[::2]
+
+  # A carrier with a modulator at twice its frequency, against the formula, with linear envelopes
+  actual = render([(1, 1.0, 0, 40, 10, 0.0, [1]), (2, 1.5, 10, 30, 0)])
+  assert len(actual) == 2205
+  expected = []
+  for n in range(2205):
+    t = n / 44100
+    carrier_env = 1.0 if n <= 1764 else max(0.0, 1.0 - (n - 1764) / 441)
+    modulator_env = min(n / 441, 1.0) if n <= 1764 else 0.0
+    expected.append(8000 * carrier_env * math.sin(2 * math.pi * 220 * t + 1.5 * modulator_env * math.sin(2 * math.pi * 440 * t)))
+  assert max(abs(a - b) for a, b in zip(actual, expected)) <= 2
+
+  # Only carriers are heard, and feedback changes the timbre
+  assert len(render([(1, 1.0, 0, 10, 0, 0.0, [1]), (1, 1.0, 0, 50, 0)])) == 441
+  assert render([(1, 1.0, 0, 10, 0, 0.5)]) != render([(1, 1.0, 0, 10, 0)])
+
+  # Operators can only be modulated by later ones
+  with pytest.raises(Exception, match="Operator"):
+    render([(1, 1.0, 0, 10, 0, 0.0, [0])])
+  with pytest.raises(Exception, match="Operator"):
+    render([(1, 1.0, 0, 10, 0, 0.0, [2]), (1, 1.0, 0, 10, 0)])
+  with pytest.raises(Exception, match="Operator"):
+    render([])
+  with pytest.raises(Exception, match="args"):
+    render([(1, 1.0)])
+
+def test_c_api_render_sequence():
+  import synther
+  import array
+
+  ON = synther.NoteEvent.NOTE_ON
+  OFF = synther.NoteEvent.NOTE_OFF
+
+  def render(seq, tile_frames=None):
+    buffer = synther.gen_buffer()
+    if tile_frames == None:
+      synther.render_sequence(buffer, seq, 10)
+    else:
+      synther.render_graph([(3, buffer, seq, 10)], tile_frames)
+    samples = array.array('h')
+    samples.frombytes(synther.get_buffer_bytes(buffer))
+    synther.free_buffer(buffer)
+    return samples[::2]
+
+  def frame(ms):
+    # Like ms_to_buffer_index() in the extension, rounded up to a whole frame
+    index = int(ms / 1000.0 * 44100.0 * 2.0)
+    return (index + index % 2) // 2
+
+  def expected(notes, frames):
+    # (on_ms, off_ms, note, velocity) of a sine instrument with a 10 ms attack and 20 ms release
+    out = [0.0] * frames
+    for on_ms, off_ms, note, velocity in notes:
+      freq_hz = 440 * 2 ** ((note - 69) / 12)
+      on, off = frame(10 + on_ms), frame(10 + off_ms)
+      release_level = min(1.0, (off - on) / 441)
+      for n in range(on, min(frames, off + 882)):
+        env = min(1.0, (n - on) / 441) if n < off else release_level * (1 - (n - off) / 882)
+        out[n] += 8000 * velocity * env * math.sin(2 * math.pi * freq_hz * (n - on) / 44100)
+    return out
+
+  # Overlapping notes, one released during its attack, and one held until the last event
+  seq = synther.Sequencer(voices=4)
+  sine = seq.add_instrument(synther.WaveType.SINE, 10, 20, 8000)
+  seq.set_events([(0, ON, 69, 1.0, sine), (5, ON, 76, 0.5, sine), (8, OFF, 76, 0.0, sine), (50, ON, 60, 0.7, sine), (100, OFF, 69, 0.0, sine)])
+  assert len(seq) == 5 and seq.duration_ms() == 120
+  actual = render(seq)
+  assert len(actual) == 5733
+  notes = [(0, 100, 69, 1.0), (5, 8, 76, 0.5), (50, 100, 60, 0.7)]
+  assert max(abs(a - b) for a, b in zip(actual, expected(notes, len(actual)))) <= 2
+
+  # Rendered a tile at a time, the samples are the same
+  assert render(seq, tile_frames=100) == actual
+  assert render(seq, tile_frames=4096) == actual
+  dense = synther.Sequencer(voices=8)
+  dense.add_instrument(synther.WaveType.SQUARE, 3, 30, 3000)
+  dense.set_events([(t * 7, t % 2, 60 + t // 2 % 12, 0.8) for t in range(200)])
+  # Square waves flip sign on the slightest rounding, at tiles that cut the grid of blocks anywhere
+  tiled = synther.gen_buffer()
+  synther.render_graph([(3, tiled, dense, 3), (0, tiled, 0, 0, 10, 0, 440, 0, synther.WaveType.SINE)], 64)
+  whole = synther.gen_buffer()
+  synther.render_sequence(whole, dense, 3)
+  assert synther.get_buffer_bytes(tiled) == synther.get_buffer_bytes(whole)
+  synther.free_buffer(tiled)
+  synther.free_buffer(whole)
+
+  # With a single voice, each note takes the voice from the last
+  mono = synther.Sequencer(voices=1)
+  mono.add_instrument(synther.WaveType.SINE, 10, 20, 8000)
+  mono.set_events([(0, ON, 69, 1.0), (50, ON, 72, 1.0), (100, OFF, 72, 0.0)])
+  actual = render(mono)
+  assert max(abs(a - b) for a, b in zip(actual[:2646], expected([(0, 50, 69, 1.0)], 2646))) <= 2
+  assert max(abs(a - b) for a, b in zip(actual[2646:], expected([(50, 100, 72, 1.0)], len(actual))[2646:])) <= 2
+
+  # Every wave type plays
+  for wave_type in synther.WaveType:
+    other = synther.Sequencer()
+    other.add_instrument(wave_type, 0, 0, 8000)
+    other.set_events([(0, ON, 69, 1.0), (20, OFF, 69, 0.0)])
+    assert any(render(other))
+
+  # A held naive wave starting the buffer plays just like produce_wave, at the same pitch and phase
+  for wave_type in [synther.WaveType.SAW, synther.WaveType.SQUARE, synther.WaveType.TRIANGLE]:
+    held = synther.Sequencer()
+    held.add_instrument(wave_type, 0, 0, 8000)
+    held.set_events([(0, ON, 60, 1.0), (100, OFF, 60, 0.0)])
+    actual = synther.gen_buffer()
+    synther.render_sequence(actual, held, 0)
+    wave = synther.gen_buffer()
+    synther.produce_wave(wave, 0, 0, 100, 0, 440 * 2 ** (-9 / 12), 8000, wave_type)
+    pairs = list(zip(synther.get_buffer_bytes(actual), synther.get_buffer_bytes(wave)))
+    synther.free_buffer(actual)
+    synther.free_buffer(wave)
+    assert len(pairs) > 17000 and sum(a != b for a, b in pairs) <= len(pairs) // 50
+
+  # Events must be sorted, of notes 0-127 on known instruments
+  with pytest.raises(Exception, match="Events"):
+    seq.set_events([(10, ON, 69, 1.0), (5, OFF, 69, 0.0)])
+  with pytest.raises(Exception, match="Events"):
+    seq.set_events([(0, ON, 128, 1.0)])
+  with pytest.raises(Exception, match="Events"):
+    seq.set_events([(0, ON, 69, 1.0, 1)])
+  with pytest.raises(Exception, match="Wave"):
+    seq.add_instrument(99, 0, 0, 1000)
+  buffer = synther.gen_buffer()
+  with pytest.raises(Exception, match="args"):
+    synther.render_sequence(buffer, [])
+  synther.free_buffer(buffer)
+  assert len(seq) == 5
+
+  # A whole score is one command of a project, queued as it was at the time
+  def build(seq, **build_args):
+    proj = synther.gen_project()
+    proj.set_buffer_cache_limit(0)
+    buffer = proj.queue_gen_buffer()
+    proj.queue_render_sequence(buffer, seq, 10)
+    proj.queue_dump_buffer(buffer, 'test_sequence.wav')
+    assert len(proj._log) == 3
+    fingerprint = proj._log.command(1)[4]
+    seq.set_events([])
+    proj.rebuild(**build_args)
+    samples = array.array('h')
+    with open('test_sequence.wav', 'rb') as fp:
+      samples.frombytes(fp.read()[44:])
+    proj.clean()
+    return samples[::2], fingerprint
+
+  events = [(0, ON, 69, 1.0, sine), (5, ON, 76, 0.5, sine), (8, OFF, 76, 0.0, sine), (50, ON, 60, 0.7, sine), (100, OFF, 69, 0.0, sine)]
+  seq.set_events(events)
+  built, fingerprint = build(seq)
+  seq.set_events(events)
+  assert built == render(seq)
+  seq.set_events(events)
+  assert build(seq, tiled=True, tile_frames=64) == (built, fingerprint)
+  seq.set_events(events[:-1])
+  assert build(seq)[1] != fingerprint
+
+def test_c_api_register_wavetable():
+  import synther
+  import array
+  from os import path
+
+  def render(wave_type, freq_hz):
+    buffer = synther.gen_buffer()
+    synther.produce_wave(buffer, 0, 0, 100, 0, freq_hz, 10000, wave_type)
+    samples = array.array('h')
+    samples.frombytes(synther.get_buffer_bytes(buffer))
+    synther.free_buffer(buffer)
+    return samples[::2]
+
+  # A registered cycle plays like the built-in wave of the same shape, but for the sampling of its edges
+  saw = synther.register_wavetable([(n + 0.5) / 128 - 1 for n in range(256)])
+  sine = synther.register_wavetable([math.sin(2 * math.pi * n / 1000) for n in range(1000)])
+  assert saw >= 8 and sine == saw + 1
+  expected, actual = render(synther.WaveType.SAW_BL, 441), render(saw, 441)
+  assert sum(abs(a - b) for a, b in zip(actual, expected)) / len(expected) < 300
+  assert max(abs(a - b) for a, b in zip(render(sine, 441), render(synther.WaveType.SINE, 441))) <= 2
+
+  # Including in banks and queued projects
+  buffer = synther.gen_buffer()
+  synther.produce_bank(buffer, 0, 0, 100, 0, [(441, 10000)], sine)
+  bank = array.array('h')
+  bank.frombytes(synther.get_buffer_bytes(buffer))
+  synther.free_buffer(buffer)
+  assert max(abs(a - b) for a, b in zip(bank[::2], render(synther.WaveType.SINE, 441))) <= 2
+  proj = synther.gen_project()
+  buffer = proj.queue_gen_buffer()
+  proj.queue_produce_wave(buffer, 0, 0, 100, 0, 441, 10000, saw)
+  proj.queue_dump_buffer(buffer, 'test_register_wavetable.wav')
+  proj.build()
+  assert path.exists('test_register_wavetable.wav')
+  proj.clean()
+
+  with pytest.raises(Exception, match="args"):
+    synther.register_wavetable([0.5])
+  with pytest.raises(Exception, match="Wave"):
+    render(sine + 1, 441)
+
+  # Every interpreter registers tables of its own, numbered from the first registered wave type
+  try:
+    import _xxsubinterpreters as interpreters
+  except ImportError:
+    return
+  import sys
+  interp = interpreters.create()
+  try:
+    interpreters.run_string(interp, """
+import sys
+sys.path[:] = %r
+import _synther
+buf = _synther.gen_buffer()
+try:
+  _synther.produce_wave(buf, 0, 0, 100, 0, 441, 10000, %d)
+  assert False
+except _synther.error:
+  pass
+assert _synther.register_wavetable([0.0, 1.0, 0.0, -1.0]) == 8
+_synther.produce_wave(buf, 0, 0, 100, 0, 441, 10000, 8)
+""" % (sys.path, sine))
+  finally:
+    interpreters.destroy(interp)
+  assert synther.register_wavetable([0.0, 1.0, 0.0, -1.0]) == sine + 1
+  assert max(abs(a - b) for a, b in zip(render(sine, 441), render(synther.WaveType.SINE, 441))) <= 2
+
+def test_c_api_subinterpreters():
+  import synther
+  import sys
+  interpreters = pytest.importorskip('_xxsubinterpreters')
+
+  synther.gen_buffer()
+
+  # Every interpreter gets a registry of its own, starting over at buffer 1
+  interp = interpreters.create()
+  try:
+    interpreters.run_string(interp, """
+import sys
+sys.path[:] = %r
+import _synther
+buf = _synther.gen_buffer()
+assert buf == 1
+_synther.produce_wave(buf, 0, 10, 100, 10, 440, 30000, 0)
+assert _synther.stats()['live_buffers'] == 1
+assert sum(len(block) for block in _synther.stream_buffer(buf, 256)) == len(_synther.get_buffer_bytes(buf)) // 2
+try:
+  _synther.free_buffer(500)
+  assert False
+except _synther.error:
+  pass
+""" % (sys.path,))
+  finally:
+    interpreters.destroy(interp)
+
+  assert synther.stats()['live_buffers'] > 0
+
+def test_c_api_threads():
+  import synther
+  import threading
+
+  # Renders a buffer on its own, as a reference for the renders made under contention
+  def render(wave_type):
+    buf = synther.gen_buffer()
+    synther.produce_wave(buf, 0, 10, 200, 10, 220 + 110 * wave_type, 8000, synther.WaveType(wave_type))
+    synther.render_graph([(0, buf, 0, 10, 200, 10, 330.0, 4000.0, wave_type)], 256)
+    data = synther.get_buffer_bytes(buf)
+    return buf, data
+
+  expected = []
+  for wave_type in range(5):
+    buf, data = render(wave_type)
+    synther.free_buffer(buf)
+    expected.append(data)
+
+  mix = synther.gen_buffer()
+  errors = []
+  thread_count = 8
+  rounds = 40
+  start = threading.Barrier(thread_count + 1)
+
+  def worker(n):
+    try:
+      start.wait()
+      for i in range(rounds):
+        wave_type = (n + i) % 5
+        buf, data = render(wave_type)
+        assert data == expected[wave_type]
+        synther.sample_buffer(mix, buf, 0, 0, 0)
+        synther.sample_buffer(buf, mix, 0, 0, 0)
+        synther.free_buffer(buf)
+        with pytest.raises(Exception, match="Buffer"):
+          synther.produce_wave(buf, 0, 10, 100, 10, 440, 30000, synther.WaveType.SINE)
+    except Exception as e:
+      errors.append(e)
+
+  def observer():
+    start.wait()
+    while any(t.is_alive() for t in threads):
+      synther.stats()
+      synther.get_buffer_capacity(mix)
+
+  threads = [threading.Thread(target=worker, args=(n,)) for n in range(thread_count)]
+  for t in threads:
+    t.start()
+  watch = threading.Thread(target=observer)
+  watch.start()
+  for t in threads:
+    t.join()
+  watch.join()
+
+  assert errors == []
+  # Mixes cover whole frames, so the mix may end a sample short of the longest render
+  assert 0 < len(synther.get_buffer_bytes(mix)) <= max(len(data) for data in expected)
+  synther.free_buffer(mix)
+
 def test_build_system():
   import synther
   import os
@@ -95,6 +684,7 @@ def test_build_system():
   assert path.exists('test_build_system.wav')
   assert path.exists('test_build_system2.wav')
   assert path.exists('test_build_system3.wav')
+  assert sorted(proj.render_times().keys()) == ['test_build_system.wav', 'test_build_system2.wav', 'test_build_system3.wav']
 
   os.remove('test_build_system.wav')
 
@@ -122,3 +712,302 @@ def test_build_system():
   assert not path.exists('test_build_system.wav')
   assert not path.exists('test_build_system2.wav')
   assert not path.exists('test_build_system3.wav')
+
+def test_build_system_buffer_cache():
+  import synther
+  from os import path
+
+  synther.set_log_level(synther.LogLvl.VERBOSE)
+
+  def make_project(freq_hz):
+    proj = synther.gen_project()
+    stem1 = proj.queue_gen_buffer()
+    stem2 = proj.queue_gen_buffer()
+    master = proj.queue_gen_buffer()
+    proj.queue_produce_wave(stem1, 0, 10, 100, 10, 440, 10000, synther.WaveType.SINE)
+    proj.queue_produce_wave(stem2, 0, 10, 100, 10, freq_hz, 10000, synther.WaveType.SAW)
+    proj.queue_sample_buffer(master, stem1, 0, 0, 0)
+    proj.queue_sample_buffer(master, stem2, 0, 0, 0)
+    proj.queue_dump_buffer(master, 'test_buffer_cache.wav')
+    return proj
+
+  proj = make_project(220)
+  proj.clean()
+  proj.build()
+  assert path.exists('.synther-buffers')
+
+  # Only the edited stem and the mix are re-rendered, the result must not change
+  proj = make_project(330)
+  synther.reset_stats()
+  proj.build()
+  assert synther.stats()['cache_hits'] == 1
+  with open('test_buffer_cache.wav', 'rb') as fp:
+    cached_render = fp.read()
+
+  proj.rebuild()
+  with open('test_buffer_cache.wav', 'rb') as fp:
+    assert fp.read() == cached_render
+
+  proj.clean()
+  assert not path.exists('.synther-buffers')
+  assert not path.exists('test_buffer_cache.wav')
+
+def test_build_system_command_log():
+  import synther
+
+  def make_project(notes, last_freq_hz):
+    proj = synther.gen_project()
+    stem = proj.queue_gen_buffer()
+    master = proj.queue_gen_buffer()
+    for n in range(notes):
+      proj.queue_produce_wave(stem, 10 * n, 1, 5, 1, last_freq_hz if n == notes - 1 else 440, 1000, synther.WaveType.SQUARE)
+    proj.queue_sample_file(stem, 'test_command_log_clip.wav', 0, 0, 0)
+    proj.queue_sample_buffer(master, stem, 0, 5, 0)
+    proj.queue_dump_buffer(master, 'test_command_log.wav')
+    return proj
+
+  # Queued commands are held natively, in tens of bytes each
+  notes = 20000
+  proj = make_project(notes, 440)
+  log = proj._log
+  assert len(log) == notes + 5
+  assert log.memory_bytes() / len(log) < 200
+
+  # And read back as they were queued
+  kind, buffer, args, deps, fingerprint, file_inputs = log.command(2)
+  assert (kind, buffer, args, deps, file_inputs) == (3, 1, (1, 0, 1, 5, 1, 440.0, 1000.0, 2), (0,), False)
+  kind, buffer, args, deps, fingerprint, file_inputs = log.command(len(log) - 2)
+  assert (kind, buffer, args, deps, file_inputs) == (4, 2, (2, 1, 0, 5, 0), (1, len(log) - 3), True)
+  assert log.find(0) == [len(log) - 1]
+  assert log.command(len(log) - 1)[4] == log.command(len(log) - 2)[4]
+  with pytest.raises(Exception, match="Command"):
+    log.command(len(log))
+
+  # Fingerprints follow the content of a command and everything upstream of it, not the handles
+  same = make_project(notes, 440)._log
+  edited = make_project(notes, 441)._log
+  assert same.command(notes)[4] == log.command(notes)[4]
+  assert edited.command(notes)[4] == log.command(notes)[4]
+  assert edited.command(notes + 1)[4] != log.command(notes + 1)[4]
+  assert edited.command(len(log) - 1)[4] != log.command(len(log) - 1)[4]
+
+def test_build_system_recycles_buffers():
+  import synther
+  import os
+
+  synther.set_log_level(synther.LogLvl.VERBOSE)
+
+  proj = synther.gen_project()
+  proj.set_buffer_cache_limit(0)
+  for n in range(4):
+    buf = proj.queue_gen_buffer()
+    proj.queue_produce_wave(buf, 0, 10, 100 * (4 - n), 10, 220 * (n + 1), 10000, synther.WaveType.SQUARE)
+    proj.queue_dump_buffer(buf, 'test_recycle%d.wav' % (n))
+  proj.rebuild()
+
+  # Buffers that took over recycled storage must not carry over old audio
+  for n in range(4):
+    buf = synther.gen_buffer()
+    synther.produce_wave(buf, 0, 10, 100 * (4 - n), 10, 220 * (n + 1), 10000, synther.WaveType.SQUARE)
+    synther.dump_buffer(buf, 'test_recycle_direct.wav')
+    synther.free_buffer(buf)
+    with open('test_recycle%d.wav' % (n), 'rb') as built, open('test_recycle_direct.wav', 'rb') as direct:
+      assert built.read() == direct.read()
+
+  os.remove('test_recycle_direct.wav')
+  proj.clean()
+
+def test_build_system_memory_budget():
+  import synther
+
+  synther.set_log_level(synther.LogLvl.VERBOSE)
+
+  def make_project():
+    proj = synther.gen_project()
+    proj.set_buffer_cache_limit(0)
+    master = proj.queue_gen_buffer()
+    for n in range(3):
+      stem = proj.queue_gen_buffer()
+      proj.queue_produce_wave(stem, 50 * n, 10, 100, 10, 220 * (n + 1), 8000, synther.WaveType.TRIANGLE)
+      proj.queue_dump_buffer(stem, 'test_budget_stem%d.wav' % (n))
+      proj.queue_sample_buffer(master, stem, 0, 0, 0)
+    proj.queue_dump_buffer(master, 'test_budget_master.wav')
+    return proj
+
+  proj = make_project()
+  proj.rebuild()
+  with open('test_budget_master.wav', 'rb') as fp:
+    unlimited = fp.read()
+
+  # A budget this small forces every idle buffer out to disk
+  proj = make_project()
+  proj.rebuild(memory_budget=1)
+  with open('test_budget_master.wav', 'rb') as fp:
+    assert fp.read() == unlimited
+
+  proj.clean()
+
+def test_build_system_tiled():
+  import synther
+
+  synther.set_log_level(synther.LogLvl.VERBOSE)
+
+  def render(**build_args):
+    proj = synther.gen_project()
+    proj.set_buffer_cache_limit(0)
+    clip = proj.queue_gen_buffer()
+    proj.queue_produce_wave(clip, 0, 10, 200, 10, 330, 8000, synther.WaveType.SAW)
+    proj.queue_dump_buffer(clip, 'test_tiled_clip.wav')
+    previous = proj.queue_gen_buffer()
+    for wave_type in synther.WaveType:
+      proj.queue_produce_wave(previous, 20 * wave_type, 10, 100, 10, 440 + 10 * wave_type, 6000, wave_type)
+    proj.queue_sample_file(previous, 'test_tiled_clip.wav', 30, 0, 0)
+    for stage in range(5):
+      # Mixes reading back in time can be tiled, mixes reading ahead can not
+      mix = proj.queue_gen_buffer()
+      proj.queue_sample_buffer(mix, previous, 0, 0, 0)
+      proj.queue_sample_buffer(mix, previous, 0, 15 * (stage % 2), 0)
+      proj.queue_produce_wave(mix, 5 * stage, 10, 50, 10, 110 * (stage + 1), 4000, synther.WaveType.SQUARE)
+      previous = mix
+    proj.queue_dump_buffer(previous, 'test_tiled.wav')
+    proj.rebuild(**build_args)
+    with open('test_tiled.wav', 'rb') as fp:
+      output = fp.read()
+    proj.clean()
+    return output
+
+  op_by_op = render()
+  assert render(tiled=True, tile_frames=64) == op_by_op
+  assert render(tiled=True) == op_by_op
+
+  # Seconds of dense notes out of time order, with mixes over all of them, at tiles that straddle the
+  # blocks ops are indexed by
+  def render_graph(tile_frames):
+    notes = synther.gen_buffer()
+    mix = synther.gen_buffer()
+    ops = [(0, notes, 4200 - 7 * n if n % 2 else 7 * n, 2, 20 + n % 9, 3, 110 * (1 + n % 7), 1500, synther.WaveType(n % 4)) for n in range(600)]
+    ops += [(2, mix, notes, 0, 0, 0), (0, mix, 3000, 10, 500, 10, 220, 4000, synther.WaveType.SINE), (2, mix, notes, 1000, 0, 1500)]
+    if tile_frames == None:
+      for op in ops:
+        synther.render_graph([op], 1)
+    else:
+      synther.render_graph(ops, tile_frames)
+    output = synther.get_buffer_bytes(mix)
+    synther.free_buffer(notes)
+    synther.free_buffer(mix)
+    return output
+
+  op_by_op = render_graph(None)
+  assert render_graph(64) == op_by_op
+  assert render_graph(5000) == op_by_op
+
+def test_render_stream():
+  import synther
+  import wave
+
+  synther.set_log_level(synther.LogLvl.VERBOSE)
+
+  buffer = synther.gen_buffer()
+  synther.produce_wave(buffer, 0, 10, 300, 10, 440, 8000, synther.WaveType.TRIANGLE)
+  expected = synther.get_buffer_bytes(buffer)
+  stream = synther.render_stream(buffer, 1000)
+  # The stream works from a snapshot
+  synther.produce_wave(buffer, 0, 10, 300, 10, 220, 8000, synther.WaveType.SINE)
+  blocks = []
+  for block in stream:
+    assert block.readonly and block.format == 'h' and block.ndim == 1
+    blocks.append(bytes(block))
+    # Samples read back signed, as they are stored in .wav files
+    assert min(block) < 0
+  assert all(len(block) == 4000 for block in blocks[:-1])
+  assert b''.join(blocks) == expected
+
+  # Closing early stops the render
+  stream = synther.render_stream(buffer, 16)
+  next(stream)
+  stream.close()
+  assert list(stream) == []
+  synther.free_buffer(buffer)
+
+  proj = synther.gen_project()
+  proj.set_buffer_cache_limit(0)
+  previous = proj.queue_gen_buffer()
+  proj.queue_produce_wave(previous, 0, 10, 200, 10, 330, 8000, synther.WaveType.SAW)
+  for stage in range(3):
+    mix = proj.queue_gen_buffer()
+    proj.queue_sample_buffer(mix, previous, 0, 0, 0)
+    proj.queue_sample_buffer(mix, previous, 0, 15 * (stage % 2), 0)
+    proj.queue_produce_wave(mix, 5 * stage, 10, 50, 10, 110 * (stage + 1), 4000, synther.WaveType.SQUARE)
+    previous = mix
+  proj.queue_dump_buffer(previous, 'test_stream.wav')
+  if synther.path.exists('test_stream.wav'):
+    synther.os.remove('test_stream.wav')
+  streamed = b''.join(bytes(block) for block in synther.render_stream(proj, 256))
+  assert not synther.path.exists('test_stream.wav')
+  proj.rebuild()
+  with wave.open('test_stream.wav', 'rb') as fp:
+    assert streamed == fp.readframes(fp.getnframes())
+  proj.clean()
+
+  with pytest.raises(ValueError):
+    synther.render_stream(proj, 256, 'not-queued.wav')
+
+  # A graph that can't be tiled renders before its first block, but closing stops it part way
+  proj = synther.gen_project()
+  notes = proj.queue_gen_buffer()
+  for n in range(2000):
+    proj.queue_produce_wave(notes, 5 * n, 10, 1000, 10, 110 + n, 100, synther.WaveType.SINE)
+  mix = proj.queue_gen_buffer()
+  proj.queue_sample_buffer(mix, notes, 15, 0, 0)
+  proj.queue_dump_buffer(mix, 'test_stream_closed.wav')
+  synther.reset_stats()
+  synther.render_stream(proj, 256).close()
+  assert sum(synther.stats()['wave_samples'].values()) < 2000 * 44100
+
+def test_build_system_trace():
+  import synther
+  import json
+  import os
+
+  synther.set_log_level(synther.LogLvl.VERBOSE)
+
+  clip = synther.gen_buffer()
+  synther.produce_wave(clip, 0, 10, 100, 10, 220, 8000, synther.WaveType.SAW)
+  synther.dump_buffer(clip, 'test_trace_clip.wav')
+  synther.free_buffer(clip)
+
+  proj = synther.gen_project()
+  proj.set_buffer_cache_limit(0)
+  wave = proj.queue_gen_buffer()
+  proj.queue_produce_wave(wave, 0, 10, 100, 10, 440, 8000, synther.WaveType.SINE)
+  proj.queue_dump_buffer(wave, 'test_trace_wave.wav')
+  mix = proj.queue_gen_buffer()
+  proj.queue_sample_file(mix, 'test_trace_clip.wav', 0, 0, 0)
+  proj.queue_dump_buffer(mix, 'test_trace.wav')
+  proj.rebuild(trace_file='test_trace.json')
+
+  with open('test_trace.json') as fp:
+    events = json.load(fp)['traceEvents']
+  spans = [e for e in events if e['ph'] == 'X']
+  names = [e['name'] for e in spans]
+  for name in ('produce_wave', 'dump_buffer', 'write_wav', 'sample_file', 'read_wav'):
+    assert name in names
+  write = next(e for e in spans if e['name'] == 'write_wav')
+  read = next(e for e in spans if e['name'] == 'read_wav')
+  assert write['args']['bytes_written'] > 0 and read['args']['bytes_read'] > 0 and read['args']['samples'] > 0
+  assert all(e['dur'] >= 0 for e in spans)
+  assert any(e['ph'] == 'M' and e['tid'] == spans[0]['tid'] for e in events)
+
+  # Streams render on a track of their own
+  synther.start_trace()
+  for block in synther.render_stream(proj, 512, 'test_trace.wav'):
+    pass
+  synther.stop_trace('test_trace.json')
+  with open('test_trace.json') as fp:
+    events = json.load(fp)['traceEvents']
+  blocks = [e for e in events if e['name'] == 'render_block']
+  assert len(blocks) > 0
+  assert any(e['ph'] == 'M' and e['tid'] == blocks[0]['tid'] and e['args']['name'] == 'render_stream' for e in events)
+  proj.clean()
+  os.remove('test_trace_clip.wav')
+  os.remove('test_trace.json')